@@ -0,0 +1,311 @@
+//
+// Automatic timing calibration
+//
+#include "calib.h"
+#include "decoder.h"
+#include "simd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+
+#define VMASK (1 << BIT_VSYNC)
+#define HMASK (1 << BIT_HSYNC)
+#define RGBMASK 7
+
+void calib_init(calib *cal, int oversample, int frames) {
+    cal->oversample = oversample;
+    cal->frames = frames;
+    cal->mode_changes = 0;
+    memset(&cal->measured, 0, sizeof(cal->measured));
+    memset(&cal->result, 0, sizeof(cal->result));
+    calib_restart(cal);
+}
+
+// Back to CAL_MEASURE, keeping the levels and the runs in progress
+static void clear_runs(calib *cal) {
+    cal->phase = CAL_MEASURE;
+    cal->h_count[0] = cal->h_count[1] = 0;
+    cal->v_count[0] = cal->v_count[1] = 0;
+    cal->in_frame = 0;
+}
+
+void calib_restart(calib *cal) {
+    clear_runs(cal);
+    cal->h_level = -1;
+    cal->v_level = -1;
+}
+
+static void start_content(calib *cal) {
+    cal->phase = CAL_CONTENT;
+    cal->in_frame = 0;
+    cal->frame = 0;
+    cal->first_off = INT_MAX;
+    cal->last_off = -1;
+    cal->first_row = INT_MAX;
+    cal->last_row = -1;
+}
+
+//----------------------------------------------------------------------
+// Sync timing from the medians of the recent runs
+//----------------------------------------------------------------------
+static uint64_t median(const uint64_t *runs, uint64_t count, int size) {
+    uint64_t t[CALIB_HRUNS];
+    int n = (count < (uint64_t)size) ? (int)count : size;
+
+    memcpy(t, runs, n * sizeof(t[0]));
+    std::nth_element(t, t + n / 2, t + n);
+    return t[n / 2];
+}
+
+// Returns 0 until enough runs have been seen
+static int measure(const calib *cal, calib_result *m) {
+    if (cal->h_count[0] < CALIB_HRUNS || cal->h_count[1] < CALIB_HRUNS
+        || cal->v_count[0] < 2 || cal->v_count[1] < 2) {
+        return 0;
+    }
+    uint64_t h[2], v[2];
+    for (int l = 0; l < 2; l++) {
+        h[l] = median(cal->h_runs[l], cal->h_count[l], CALIB_HRUNS);
+        v[l] = median(cal->v_runs[l], cal->v_count[l], CALIB_VRUNS);
+    }
+
+    // The sync pulse is the shorter level
+    int h_pulse = h[1] < h[0];
+    int v_pulse = v[1] < v[0];
+    uint64_t period = h[0] + h[1];
+
+    memset(m, 0, sizeof(*m));
+    m->sync_pol = (h_pulse ? HMASK : 0) | (v_pulse ? VMASK : 0);
+    m->h_period = (int)period;
+    m->h_sync = (int)h[h_pulse];
+    m->v_lines = (int)((v[0] + v[1] + period / 2) / period);
+    m->v_sync = (int)((v[v_pulse] + period / 2) / period);
+    return 1;
+}
+
+static int same_mode(const calib_result *a, const calib_result *b, int oversample) {
+    return a->sync_pol == b->sync_pol
+        && abs(a->h_period - b->h_period) <= a->h_period / 32 + oversample
+        && abs(a->v_lines - b->v_lines) <= 2;
+}
+
+static void finish(calib *cal) {
+    int os = cal->oversample;
+
+    cal->result = cal->measured;
+    if (cal->last_off >= 0) {
+        // Pixel x is the sample at (h_porch + x) * os
+        cal->result.first_col = (cal->first_off + os - 1) / os;
+        cal->result.last_col = cal->last_off / os;
+        cal->result.first_row = cal->first_row;
+        cal->result.last_row = cal->last_row;
+    } else {
+        cal->result.first_col = cal->result.last_col = -1;
+        cal->result.first_row = cal->result.last_row = -1;
+    }
+    cal->phase = CAL_WATCH;
+}
+
+//----------------------------------------------------------------------
+// Non-black samples of a line, in [a, b)
+//----------------------------------------------------------------------
+static void scan_content(calib *cal, const uint8_t *a, const uint8_t *b) {
+    int o = cal->line_off;
+    int len = (int)(b - a);
+    int hit = 0;
+
+    // Ignore the samples past the line length (H-Sync is missing)
+    if (o + len > cal->measured.h_period) {
+        len = cal->measured.h_period - o;
+    }
+    if (len <= 0 || cal->row >= cal->measured.v_lines) {
+        return;
+    }
+
+    // Left of the first non-black sample so far
+    if (o < cal->first_off) {
+        int n = std::min(len, cal->first_off - o);
+        int i = (int)scan_bit_set(a, n, RGBMASK);
+        if (i < n) {
+            cal->first_off = o + i;
+            hit = 1;
+        }
+    }
+    // Right of the last one, backwards (usually a short black border)
+    int from = std::max(o, cal->last_off + 1) - o;
+    for (int i = len; i > from;) {
+        if (a[--i] & RGBMASK) {
+            cal->last_off = o + i;
+            hit = 1;
+            break;
+        }
+    }
+    // Lines outside of the non-black rows so far
+    if (!hit && (cal->row < cal->first_row || cal->row > cal->last_row)) {
+        hit = (int)scan_bit_set(a, len, RGBMASK) < len;
+    }
+    if (hit) {
+        cal->first_row = std::min(cal->first_row, cal->row);
+        cal->last_row = std::max(cal->last_row, cal->row);
+    }
+}
+
+// Samples [a, b) with constant H-Sync and V-Sync levels
+static void span_levels(calib *cal, const uint8_t *a, const uint8_t *b) {
+    if (cal->phase == CAL_CONTENT && cal->in_frame && cal->v_level != ((cal->measured.sync_pol & VMASK) != 0)) {
+        if (cal->h_level == ((cal->measured.sync_pol & HMASK) != 0)) {
+            // H-Sync pulse, counted when it starts after the end of V-Sync
+            // as the decoder does
+            if (b - a > cal->vend_skip) {
+                cal->row_pending = 1;
+            }
+        } else if (cal->row >= 0) {
+            scan_content(cal, a, b);
+        }
+    }
+    cal->vend_skip = 0;
+    if (cal->phase == CAL_CONTENT && cal->h_level != ((cal->measured.sync_pol & HMASK) != 0)) {
+        cal->line_off += (int)(b - a);
+    }
+}
+
+//----------------------------------------------------------------------
+// Sync edges
+//----------------------------------------------------------------------
+static void h_edge(calib *cal) {
+    int l = cal->h_level;
+
+    if (!cal->h_partial) {
+        cal->h_runs[l][cal->h_count[l]++ % CALIB_HRUNS] = cal->h_run;
+    }
+    cal->h_partial = 0;
+    cal->h_level = !l;
+    cal->h_run = 0;
+
+    // End of an H-Sync pulse
+    if (cal->phase == CAL_CONTENT && cal->h_level != ((cal->measured.sync_pol & HMASK) != 0)) {
+        if (cal->row_pending) {
+            cal->row++;
+            cal->row_pending = 0;
+        }
+        cal->line_off = 0;
+    }
+}
+
+// Returns 1 when a new result is available
+static int v_edge(calib *cal) {
+    int l = cal->v_level;
+    int updated = 0;
+
+    if (!cal->v_partial) {
+        cal->v_runs[l][cal->v_count[l]++ % CALIB_VRUNS] = cal->v_run;
+    }
+    cal->v_partial = 0;
+    cal->v_level = !l;
+    cal->v_run = 0;
+
+    switch (cal->phase) {
+    case CAL_MEASURE:
+        if (measure(cal, &cal->measured)) {
+            start_content(cal);
+        }
+        break;
+
+    case CAL_CONTENT:
+        // End of a V-Sync pulse
+        if (cal->v_level != ((cal->measured.sync_pol & VMASK) != 0)) {
+            if (cal->in_frame && ++cal->frame == cal->frames) {
+                finish(cal);
+                updated = 1;
+                break;
+            }
+            cal->in_frame = 1;
+            cal->row = -1;
+            cal->row_pending = 0;
+            cal->vend_skip = 1;
+            cal->line_off = 0;
+        }
+        break;
+
+    case CAL_WATCH: {
+        calib_result m;
+        if (cal->v_level != ((cal->result.sync_pol & VMASK) != 0)
+            && measure(cal, &m) && !same_mode(&cal->result, &m, cal->oversample)) {
+            cal->mode_changes++;
+            clear_runs(cal);
+        }
+        break;
+    }
+    }
+    return updated;
+}
+
+int calib_feed(calib *cal, const uint8_t *p, size_t n) {
+    const uint8_t *end = p + n;
+    int updated = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+    if (cal->h_level < 0) {
+        cal->h_level = (*p & HMASK) != 0;
+        cal->h_partial = 1;
+        cal->h_run = 0;
+    }
+    if (cal->v_level < 0) {
+        cal->v_level = (*p & VMASK) != 0;
+        cal->v_partial = 1;
+        cal->v_run = 0;
+    }
+
+    while (p < end) {
+        // Up to the next H-Sync edge
+        size_t len = cal->h_level ? scan_bit_clear(p, end - p, HMASK) : scan_bit_set(p, end - p, HMASK);
+        const uint8_t *q = p + len;
+
+        // Split at the V-Sync edges
+        while (p < q) {
+            size_t vlen = cal->v_level ? scan_bit_clear(p, q - p, VMASK) : scan_bit_set(p, q - p, VMASK);
+            span_levels(cal, p, p + vlen);
+            cal->v_run += vlen;
+            p += vlen;
+            if (p < q) {
+                updated |= v_edge(cal);
+            }
+        }
+        cal->h_run += len;
+        if (q < end) {
+            h_edge(cal);
+        }
+    }
+    return updated;
+}
+
+//----------------------------------------------------------------------
+// Porches
+//----------------------------------------------------------------------
+// Offset of a window of size which shows [first, last], or cur when it
+// already does. Larger areas are centered.
+static int fit_window(int first, int last, int size, int cur) {
+    if (first < 0 || last < first) {
+        return cur;
+    }
+    int n = last - first + 1;
+    if (n >= size) {
+        return first + (n - size) / 2;
+    }
+    if (first < cur) {
+        return first;
+    }
+    if (last >= cur + size) {
+        return last - size + 1;
+    }
+    return cur;
+}
+
+void calib_porch(const calib_result *res, int *v_porch, int *h_porch) {
+    *v_porch = std::max(fit_window(res->first_row, res->last_row, DH, *v_porch), 0);
+    *h_porch = std::max(fit_window(res->first_col, res->last_col, DW, *h_porch), 1);
+}
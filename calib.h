@@ -0,0 +1,81 @@
+//
+// Automatic timing calibration
+//
+// Measures the sync periods and polarity and the area of non-black pixels
+// from the sample stream, and derives the porches of the decoder.
+// The spans are fed alongside the decoder. After the first result the
+// calibrator keeps watching the sync timing (a couple of edge scans per
+// line) and starts over when the video mode changes.
+//
+#ifndef CALIB_H
+#define CALIB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CALIB_HRUNS 16    // Recent H-Sync runs kept per level
+#define CALIB_VRUNS 4     // Recent V-Sync runs kept per level
+
+// Calibration phases
+enum {
+    CAL_MEASURE,      // Sync periods and polarity
+    CAL_CONTENT,      // Non-black area over some frames
+    CAL_WATCH,        // Done, watch the sync timing for a mode change
+};
+
+struct calib_result {
+    uint8_t sync_pol;   // Sync bits which are active high (decoder.sync_pol)
+    int h_period;       // Samples per line
+    int h_sync;         // H-Sync width [samples]
+    int v_lines;        // Lines per frame
+    int v_sync;         // V-Sync width [lines]
+
+    // Non-black area (-1: all black), counted like decoder.h_porch / v_porch
+    int first_col, last_col;
+    int first_row, last_row;
+};
+
+struct calib {
+    int oversample;
+    int frames;         // Frames to analyze in CAL_CONTENT
+    int phase;
+
+    // Sync runs
+    int h_level, v_level;       // Current level (-1: not seen yet)
+    int h_partial, v_partial;   // The current run started before the first sample
+    uint64_t h_run, v_run;      // Samples in the current run
+    uint64_t h_runs[2][CALIB_HRUNS];
+    uint64_t v_runs[2][CALIB_VRUNS];
+    uint64_t h_count[2], v_count[2];
+
+    // Non-black area
+    int in_frame;       // A V-Sync has ended
+    int frame;          // Frames analyzed
+    int row;            // Line since the end of V-Sync (-1: before the first H-Sync)
+    int row_pending;    // An H-Sync pulse has started after the end of V-Sync
+    int vend_skip;      // The first sample after V-Sync does not start an H-Sync
+    int line_off;       // Samples since the end of H-Sync
+    int first_off, last_off;
+    int first_row, last_row;
+
+    calib_result measured;  // Sync timing of CAL_CONTENT / CAL_WATCH
+    calib_result result;
+
+    // Statistics
+    uint64_t mode_changes;
+};
+
+void calib_init(calib *cal, int oversample, int frames);
+
+// Start over from CAL_MEASURE
+void calib_restart(calib *cal);
+
+// Feed the next n samples. Returns 1 when a new result is available.
+int calib_feed(calib *cal, const uint8_t *p, size_t n);
+
+// Porches which bring the non-black area into the DW x DH window.
+// The given porches are kept when the area already fits, so that a
+// partly black screen does not move the picture.
+void calib_porch(const calib_result *res, int *v_porch, int *h_porch);
+
+#endif
@@ -0,0 +1,159 @@
+//
+// Raw capture container
+//
+#include "capfile.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+void capfile_init_header(capfile_header *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, CAPFILE_MAGIC, sizeof(hdr->magic));
+    hdr->header_size = sizeof(*hdr);
+    hdr->version = CAPFILE_VERSION;
+}
+
+size_t capfile_parse_header(const uint8_t *data, size_t size, capfile_header *hdr) {
+    if (size < sizeof(*hdr) || memcmp(data, CAPFILE_MAGIC, sizeof(hdr->magic)) != 0) {
+        return 0;
+    }
+    memcpy(hdr, data, sizeof(*hdr));
+    if (hdr->header_size < sizeof(*hdr) || hdr->header_size > size) {
+        return 0;
+    }
+    return hdr->header_size;
+}
+
+//----------------------------------------------------------------------
+// Recording
+//----------------------------------------------------------------------
+int capfile_writer::open(const char *path, const capfile_header *hdr) {
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Record: Could not create %s\n", path);
+        return -1;
+    }
+    // Blocks are large, let fwrite() go straight to the OS
+    setvbuf(fp, NULL, _IONBF, 0);
+
+    header = *hdr;
+    written = 0;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        close();
+        return -1;
+    }
+    return 0;
+}
+
+int capfile_writer::write(const uint8_t *data, size_t len) {
+    if (fp == NULL) {
+        return -1;
+    }
+    if (fwrite(data, 1, len, fp) != len) {
+        fprintf(stderr, "Record: Write failed, recording stopped\n");
+        close();
+        return -1;
+    }
+    written += len;
+    return 0;
+}
+
+void capfile_writer::close(uint32_t sample_clock) {
+    if (fp == NULL) {
+        return;
+    }
+    if (sample_clock != 0) {
+        header.sample_clock = sample_clock;
+        fseek(fp, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, fp);
+    }
+    fclose(fp);
+    fp = NULL;
+}
+
+//----------------------------------------------------------------------
+// Read-only memory mapped file
+//----------------------------------------------------------------------
+#ifdef _WIN32
+mapped_file::mapped_file() : base(NULL), length(0), file(INVALID_HANDLE_VALUE), mapping(NULL) {}
+
+int mapped_file::open(const char *path) {
+    LARGE_INTEGER size;
+
+    file = ::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE || !::GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        close();
+        return -1;
+    }
+    mapping = ::CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        close();
+        return -1;
+    }
+    base = (const uint8_t *)::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (base == NULL) {
+        close();
+        return -1;
+    }
+    length = (size_t)size.QuadPart;
+    return 0;
+}
+
+void mapped_file::close(void) {
+    if (base != NULL) {
+        ::UnmapViewOfFile(base);
+    }
+    if (mapping != NULL) {
+        ::CloseHandle(mapping);
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+        ::CloseHandle(file);
+    }
+    base = NULL;
+    length = 0;
+    mapping = NULL;
+    file = INVALID_HANDLE_VALUE;
+}
+#else
+mapped_file::mapped_file() : base(NULL), length(0) {}
+
+int mapped_file::open(const char *path) {
+    struct stat st;
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        ::close(fd);
+        return -1;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    // Replay reads the file front to back
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    base = (const uint8_t *)p;
+    length = st.st_size;
+    return 0;
+}
+
+void mapped_file::close(void) {
+    if (base != NULL) {
+        munmap((void *)base, length);
+    }
+    base = NULL;
+    length = 0;
+}
+#endif
@@ -0,0 +1,86 @@
+//
+// Raw capture container
+//
+// A capfile_header followed by the raw "000VHRGB" sample blocks exactly as
+// they came from EP6. Files without the header (plain byte dumps) are
+// accepted by the replay as well.
+//
+#ifndef CAPFILE_H
+#define CAPFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define CAPFILE_MAGIC "DRGBCAP1"
+#define CAPFILE_VERSION 1
+
+// All fields are little endian
+struct capfile_header {
+    char magic[8];            // CAPFILE_MAGIC
+    uint32_t header_size;     // sizeof(capfile_header), the samples follow
+    uint32_t version;
+    uint32_t sample_clock;    // Samples per second (0: unknown)
+    uint16_t h_pixels;        // H_TOTAL (CS2300-CP ratio)
+    uint16_t h_porch;
+    uint16_t v_porch;
+    uint16_t oversample;      // Samples per pixel
+    uint32_t block_size;      // USB transfer size at recording
+    uint32_t reserved[8];
+};
+
+static_assert(sizeof(capfile_header) == 64, "capfile_header must be 64 bytes");
+
+void capfile_init_header(capfile_header *hdr);
+
+// Returns the size of a valid header at the top of data, 0 if there is none
+size_t capfile_parse_header(const uint8_t *data, size_t size, capfile_header *hdr);
+
+//----------------------------------------------------------------------
+// Recording
+//----------------------------------------------------------------------
+class capfile_writer {
+public:
+    capfile_writer() : fp(NULL), written(0) {}
+    ~capfile_writer() { close(); }
+
+    int open(const char *path, const capfile_header *hdr);
+
+    // Write a block straight from the capture buffer (unbuffered, no copy)
+    int write(const uint8_t *data, size_t len);
+
+    // sample_clock != 0 updates the header before closing
+    void close(uint32_t sample_clock = 0);
+
+    uint64_t bytes(void) const { return written; }
+
+private:
+    FILE *fp;
+    capfile_header header;
+    uint64_t written;
+};
+
+//----------------------------------------------------------------------
+// Read-only memory mapped file
+//----------------------------------------------------------------------
+class mapped_file {
+public:
+    mapped_file();
+    ~mapped_file() { close(); }
+
+    int open(const char *path);
+    void close(void);
+
+    const uint8_t *data(void) const { return base; }
+    size_t size(void) const { return length; }
+
+private:
+    const uint8_t *base;
+    size_t length;
+#ifdef _WIN32
+    void *file;
+    void *mapping;
+#endif
+};
+
+#endif
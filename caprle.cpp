@@ -0,0 +1,356 @@
+//
+// Run-length compressed capture container
+//
+#include "caprle.h"
+#include "decoder.h"
+#include "simd.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#define VMASK (1 << BIT_VSYNC)
+
+// Token types (upper 3 bits)
+#define RLE_SHORT_MAX 6         // Runs up to this length in one byte
+#define RLE_ESCAPE 0xc0
+#define RLE_LONG 0xe0
+
+size_t caprle_parse_header(const uint8_t *data, size_t size, capfile_header *hdr) {
+    if (size < sizeof(*hdr) || memcmp(data, CAPRLE_MAGIC, sizeof(hdr->magic)) != 0) {
+        return 0;
+    }
+    memcpy(hdr, data, sizeof(*hdr));
+    if (hdr->header_size < sizeof(*hdr) || hdr->header_size > size) {
+        return 0;
+    }
+    return hdr->header_size;
+}
+
+//----------------------------------------------------------------------
+// Codec
+//----------------------------------------------------------------------
+size_t caprle_encode(const uint8_t *src, size_t n, uint8_t *dst) {
+    uint8_t *q = dst;
+    size_t i = 0;
+
+    while (i < n) {
+        uint8_t s = src[i];
+        size_t run = scan_run(src + i, n - i);
+        i += run;
+
+        if (s & ~0x1f) {
+            // Not a "000VHRGB" sample, kept as it is
+            for (size_t k = 0; k < run; k++) {
+                *q++ = RLE_ESCAPE;
+                *q++ = s;
+            }
+        } else if (run <= RLE_SHORT_MAX) {
+            *q++ = (uint8_t)(((run - 1) << 5) | s);
+        } else {
+            *q++ = RLE_LONG | s;
+            run -= RLE_SHORT_MAX + 1;
+            while (run >= 0x80) {
+                *q++ = (uint8_t)(run | 0x80);
+                run >>= 7;
+            }
+            *q++ = (uint8_t)run;
+        }
+    }
+    return q - dst;
+}
+
+long caprle_decode(const uint8_t *src, size_t n, uint8_t *dst, size_t max) {
+    const uint8_t *end = src + n;
+    size_t o = 0;
+
+    while (src < end) {
+        uint8_t b = *src++;
+        uint8_t s = b & 0x1f;
+        size_t run;
+
+        if ((b & 0xe0) == RLE_ESCAPE) {
+            if (src == end) {
+                return -1;
+            }
+            s = *src++;
+            run = 1;
+        } else if ((b & 0xe0) == RLE_LONG) {
+            run = 0;
+            for (int shift = 0;; shift += 7) {
+                if (src == end || shift > 28) {
+                    return -1;
+                }
+                uint8_t v = *src++;
+                run |= (size_t)(v & 0x7f) << shift;
+                if (!(v & 0x80)) {
+                    break;
+                }
+            }
+            run += RLE_SHORT_MAX + 1;
+        } else {
+            run = (b >> 5) + 1;
+        }
+        if (run > max - o) {
+            return -1;
+        }
+
+        if (run <= 8) {
+            // Short runs (most of the pixels) as one store into the slack
+            uint64_t w = 0x0101010101010101ULL * s;
+            memcpy(dst + o, &w, 8);
+        } else {
+            memset(dst + o, s, run);
+        }
+        o += run;
+    }
+    return (long)o;
+}
+
+//----------------------------------------------------------------------
+// V-Sync pulse finder
+//----------------------------------------------------------------------
+void caprle_vsync_init(caprle_vsync *vs) {
+    vs->level = -1;
+    vs->run_start = 0;
+    vs->prev_run = 0;
+    vs->partial = 0;
+}
+
+void caprle_vsync_feed(caprle_vsync *vs, const uint8_t *p, size_t n, uint64_t pos, std::vector<uint64_t> *frames) {
+    if (n == 0) {
+        return;
+    }
+    if (vs->level < 0) {
+        // The first run has begun before the stream, its length is unknown
+        vs->level = (p[0] & VMASK) != 0;
+        vs->run_start = pos;
+        vs->prev_run = 0;
+        vs->partial = 1;
+    }
+
+    size_t i = 0;
+    for (;;) {
+        i += vs->level ? scan_bit_clear(p + i, n - i, VMASK) : scan_bit_set(p + i, n - i, VMASK);
+        if (i == n) {
+            break;
+        }
+        uint64_t run = pos + i - vs->run_start;
+        if (vs->prev_run != 0 && run < vs->prev_run) {
+            frames->push_back(vs->run_start);
+        }
+        vs->prev_run = vs->partial ? 0 : run;
+        vs->partial = 0;
+        vs->run_start = pos + i;
+        vs->level ^= 1;
+    }
+}
+
+//----------------------------------------------------------------------
+// Recording
+//----------------------------------------------------------------------
+int caprle_writer::open(const char *path, const capfile_header *hdr) {
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Record: Could not create %s\n", path);
+        return -1;
+    }
+    // Coded blocks are small, collect them into large writes
+    setvbuf(fp, NULL, _IOFBF, 1024 * 1024);
+
+    packed = (uint8_t *)malloc(sizeof(caprle_block_header) + CAPRLE_PACKED_MAX(CAPRLE_BLOCK_MAX));
+    if (packed == NULL) {
+        close();
+        return -1;
+    }
+
+    header = *hdr;
+    memcpy(header.magic, CAPRLE_MAGIC, sizeof(header.magic));
+    header.version = CAPRLE_VERSION;
+    header.block_size = CAPRLE_BLOCK_MAX;
+    written = 0;
+    caprle_vsync_init(&vsync);
+    blocks.clear();
+    frames.clear();
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        close();
+        return -1;
+    }
+    file_pos = sizeof(header);
+    return 0;
+}
+
+int caprle_writer::write(const uint8_t *data, size_t len) {
+    if (fp == NULL) {
+        return -1;
+    }
+    caprle_vsync_feed(&vsync, data, len, written, &frames);
+
+    for (size_t off = 0; off < len; off += CAPRLE_BLOCK_MAX) {
+        size_t n = (len - off < CAPRLE_BLOCK_MAX) ? len - off : CAPRLE_BLOCK_MAX;
+        caprle_block_header bh;
+        bh.raw_size = (uint32_t)n;
+        bh.packed_size = (uint32_t)caprle_encode(data + off, n, packed + sizeof(bh));
+        memcpy(packed, &bh, sizeof(bh));
+
+        size_t size = sizeof(bh) + bh.packed_size;
+        if (fwrite(packed, 1, size, fp) != size) {
+            fprintf(stderr, "Record: Write failed, recording stopped\n");
+            close();
+            return -1;
+        }
+        blocks.push_back(caprle_block_entry{file_pos, written});
+        file_pos += size;
+        written += n;
+    }
+    return 0;
+}
+
+void caprle_writer::close(uint32_t sample_clock) {
+    if (fp == NULL) {
+        return;
+    }
+
+    caprle_trailer tr;
+    tr.index_offset = file_pos;
+    tr.blocks = (uint32_t)blocks.size();
+    tr.frames = (uint32_t)frames.size();
+    memcpy(tr.magic, CAPRLE_INDEX_MAGIC, sizeof(tr.magic));
+    if (!blocks.empty()) {
+        fwrite(blocks.data(), sizeof(blocks[0]), blocks.size(), fp);
+    }
+    if (!frames.empty()) {
+        fwrite(frames.data(), sizeof(frames[0]), frames.size(), fp);
+    }
+    fwrite(&tr, sizeof(tr), 1, fp);
+
+    if (sample_clock != 0) {
+        header.sample_clock = sample_clock;
+        fseek(fp, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, fp);
+    }
+    fclose(fp);
+    fp = NULL;
+    free(packed);
+    packed = NULL;
+}
+
+//----------------------------------------------------------------------
+// Replay
+//----------------------------------------------------------------------
+int caprle_reader::open(const char *path, capfile_header *hdr) {
+    if (file.open(path) < 0) {
+        return -1;
+    }
+    top = caprle_parse_header(file.data(), file.size(), hdr);
+    if (top == 0) {
+        close();
+        return -1;
+    }
+    if (load_index() < 0) {
+        fprintf(stderr, "Replay: %s has no index, scanning the blocks\n", path);
+        rebuild_index();
+    }
+    return 0;
+}
+
+void caprle_reader::close(void) {
+    file.close();
+    blocks.clear();
+    frames.clear();
+}
+
+int caprle_reader::load_index(void) {
+    const uint8_t *data = file.data();
+    size_t size = file.size();
+    caprle_trailer tr;
+
+    if (size < top + sizeof(tr)) {
+        return -1;
+    }
+    memcpy(&tr, data + size - sizeof(tr), sizeof(tr));
+    uint64_t index_size = (uint64_t)tr.blocks * sizeof(caprle_block_entry) + (uint64_t)tr.frames * sizeof(uint64_t);
+    if (memcmp(tr.magic, CAPRLE_INDEX_MAGIC, sizeof(tr.magic)) != 0
+        || tr.index_offset < top || tr.index_offset + index_size + sizeof(tr) != size) {
+        return -1;
+    }
+
+    const uint8_t *p = data + tr.index_offset;
+    blocks.resize(tr.blocks);
+    frames.resize(tr.frames);
+    if (tr.blocks > 0) {
+        memcpy(blocks.data(), p, tr.blocks * sizeof(caprle_block_entry));
+    }
+    if (tr.frames > 0) {
+        memcpy(frames.data(), p + tr.blocks * sizeof(caprle_block_entry), tr.frames * sizeof(uint64_t));
+    }
+    return 0;
+}
+
+// Walk the block headers up to the first broken one, and find the frames
+// in the samples again
+void caprle_reader::rebuild_index(void) {
+    const uint8_t *data = file.data();
+    size_t size = file.size();
+    uint8_t *buf = (uint8_t *)malloc(CAPRLE_BLOCK_MAX + 8);
+    caprle_vsync vs;
+    uint64_t raw = 0;
+
+    blocks.clear();
+    frames.clear();
+    caprle_vsync_init(&vs);
+
+    for (size_t pos = top; buf != NULL && pos + sizeof(caprle_block_header) <= size;) {
+        caprle_block_header bh;
+        memcpy(&bh, data + pos, sizeof(bh));
+        if (bh.raw_size == 0 || bh.raw_size > CAPRLE_BLOCK_MAX || bh.packed_size > size - pos - sizeof(bh)) {
+            break;
+        }
+        long n = caprle_decode(data + pos + sizeof(bh), bh.packed_size, buf, CAPRLE_BLOCK_MAX);
+        if (n != (long)bh.raw_size) {
+            break;
+        }
+        blocks.push_back(caprle_block_entry{pos, raw});
+        caprle_vsync_feed(&vs, buf, n, raw, &frames);
+        raw += n;
+        pos += sizeof(bh) + bh.packed_size;
+    }
+    free(buf);
+}
+
+long caprle_reader::read_block(int i, uint8_t *dst) const {
+    const uint8_t *data = file.data();
+    size_t size = file.size();
+    uint64_t pos = blocks[i].file_offset;
+    caprle_block_header bh;
+
+    if (pos + sizeof(bh) > size) {
+        return -1;
+    }
+    memcpy(&bh, data + pos, sizeof(bh));
+    if (bh.raw_size > CAPRLE_BLOCK_MAX || bh.packed_size > size - pos - sizeof(bh)) {
+        return -1;
+    }
+    long n = caprle_decode(data + pos + sizeof(bh), bh.packed_size, dst, CAPRLE_BLOCK_MAX);
+    return (n == (long)bh.raw_size) ? n : -1;
+}
+
+int caprle_reader::find_frame(uint64_t n, int *block, size_t *offset) const {
+    if (n >= frames.size()) {
+        return -1;
+    }
+    uint64_t raw = frames[n];
+
+    // Last block which begins at or before the frame
+    auto it = std::upper_bound(blocks.begin(), blocks.end(), raw,
+                               [](uint64_t r, const caprle_block_entry &b) { return r < b.raw_offset; });
+    if (it == blocks.begin()) {
+        return -1;
+    }
+    --it;
+    *block = (int)(it - blocks.begin());
+    *offset = (size_t)(raw - it->raw_offset);
+    return 0;
+}
@@ -0,0 +1,147 @@
+//
+// Run-length compressed capture container
+//
+// A capfile_header (magic CAPRLE_MAGIC), the sample blocks each coded on
+// its own, a seek index and a trailer. Any block can be decoded without
+// the ones before it, and the index lists the start of every V-Sync pulse,
+// so that a replay can begin at any frame. A file without the index (the
+// recording was cut off) is indexed again by walking the blocks.
+//
+// Samples are coded one token per run ("000VHRGB" leaves the upper 3 bits
+// of every sample free for the run length):
+//   000sssss              1 sample s
+//   ttt sssss             t + 1 samples s (t = 1..5)
+//   110xxxxx b            1 sample b (escape, any byte value)
+//   111sssss varint       (varint + 7) samples s, LEB128
+//
+#ifndef CAPRLE_H
+#define CAPRLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "capfile.h"
+
+#define CAPRLE_MAGIC "DRGBRLE1"
+#define CAPRLE_VERSION 1
+#define CAPRLE_INDEX_MAGIC "DRGBIDX1"
+
+#define CAPRLE_BLOCK_MAX (64 * 1024)        // Samples per block at most
+#define CAPRLE_PACKED_MAX(n) ((n) * 2)      // Coded size of n samples at worst
+
+// All fields are little endian
+struct caprle_block_header {
+    uint32_t raw_size;        // Samples
+    uint32_t packed_size;     // Coded bytes following this header
+};
+
+// Index: blocks x caprle_block_entry, frames x uint64_t (sample offset of
+// every V-Sync pulse), then the trailer at the very end of the file
+struct caprle_block_entry {
+    uint64_t file_offset;     // caprle_block_header
+    uint64_t raw_offset;      // First sample of the block in the stream
+};
+
+struct caprle_trailer {
+    uint64_t index_offset;
+    uint32_t blocks;
+    uint32_t frames;
+    char magic[8];            // CAPRLE_INDEX_MAGIC
+};
+
+static_assert(sizeof(caprle_block_header) == 8, "caprle_block_header must be 8 bytes");
+static_assert(sizeof(caprle_block_entry) == 16, "caprle_block_entry must be 16 bytes");
+static_assert(sizeof(caprle_trailer) == 24, "caprle_trailer must be 24 bytes");
+
+// Returns the size of a valid header at the top of data, 0 if there is none
+size_t caprle_parse_header(const uint8_t *data, size_t size, capfile_header *hdr);
+
+// Code n samples into dst (CAPRLE_PACKED_MAX(n) bytes). Returns the coded size.
+size_t caprle_encode(const uint8_t *src, size_t n, uint8_t *dst);
+
+// Decode n coded bytes into dst (max samples, plus 8 bytes of slack).
+// Returns the number of samples, -1 if the data is corrupt.
+long caprle_decode(const uint8_t *src, size_t n, uint8_t *dst, size_t max);
+
+//----------------------------------------------------------------------
+// V-Sync pulse finder
+//----------------------------------------------------------------------
+// Polarity free: of two consecutive runs of the V-Sync bit, the shorter
+// one which follows the longer one is the pulse.
+struct caprle_vsync {
+    int level;            // Current level of the V-Sync bit (-1: no sample yet)
+    uint64_t run_start;   // Sample offset of the current run
+    uint64_t prev_run;    // Length of the run before (0: unknown)
+    int partial;          // The current run is the first one
+};
+
+void caprle_vsync_init(caprle_vsync *vs);
+
+// Feed n samples at stream offset pos, the pulse starts are appended to frames
+void caprle_vsync_feed(caprle_vsync *vs, const uint8_t *p, size_t n, uint64_t pos, std::vector<uint64_t> *frames);
+
+//----------------------------------------------------------------------
+// Recording
+//----------------------------------------------------------------------
+// Same use as capfile_writer. Coding runs on the calling thread, well
+// above the USB byte rate.
+class caprle_writer {
+public:
+    caprle_writer() : fp(NULL), written(0), file_pos(0), packed(NULL) {}
+    ~caprle_writer() { close(); }
+
+    int open(const char *path, const capfile_header *hdr);
+
+    // Code and write the samples, in blocks of up to CAPRLE_BLOCK_MAX
+    int write(const uint8_t *data, size_t len);
+
+    // Writes the index. sample_clock != 0 updates the header as well
+    void close(uint32_t sample_clock = 0);
+
+    uint64_t bytes(void) const { return written; }
+    uint64_t packed_bytes(void) const { return file_pos; }
+
+private:
+    FILE *fp;
+    capfile_header header;
+    uint64_t written;     // Samples
+    uint64_t file_pos;
+    uint8_t *packed;      // caprle_block_header and the coded samples
+    caprle_vsync vsync;
+    std::vector<caprle_block_entry> blocks;
+    std::vector<uint64_t> frames;
+};
+
+//----------------------------------------------------------------------
+// Replay
+//----------------------------------------------------------------------
+class caprle_reader {
+public:
+    int open(const char *path, capfile_header *hdr);
+    void close(void);
+
+    int block_count(void) const { return (int)blocks.size(); }
+    uint64_t frame_count(void) const { return frames.size(); }
+
+    // Decode block i into dst (CAPRLE_BLOCK_MAX + 8 bytes).
+    // Returns the number of samples, -1 if the block is corrupt.
+    long read_block(int i, uint8_t *dst) const;
+
+    // Block and the sample offset within it where frame n (0, 1, ...)
+    // starts. Returns -1 if there is no such frame.
+    int find_frame(uint64_t n, int *block, size_t *offset) const;
+
+private:
+    int load_index(void);
+    void rebuild_index(void);
+
+    mapped_file file;
+    size_t top;           // First block
+    std::vector<caprle_block_entry> blocks;
+    std::vector<uint64_t> frames;
+};
+
+#endif
@@ -0,0 +1,62 @@
+//
+// Capture source interface
+//
+// A capture source delivers the raw "000VHRGB" sample stream as a sequence
+// of contiguous buffers. The USB thread (EZ-USB FX2) and the file replay
+// are both implemented behind this interface, so the decoder does not care
+// where the samples come from.
+//
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+class capture_source {
+public:
+    virtual ~capture_source() {}
+
+    // Prepare the source (open device / file). Returns 0 on success, -1 on error
+    virtual int open(void) = 0;
+
+    // Start delivering samples. Returns 0 on success, -1 on error
+    virtual int start(void) = 0;
+
+    // Wait for the next filled buffer.
+    // Returns its length (> 0), 0 on timeout, or -1 at end of stream.
+    // The buffer stays valid until release() is called.
+    virtual long next_buffer(const uint8_t **data, int timeout_ms) = 0;
+
+    // Give back the buffer obtained by next_buffer()
+    virtual void release(void) = 0;
+
+    // When the samples of that buffer arrived (telemetry_now_us()),
+    // 0 if the source does not know
+    virtual uint64_t buffer_time(void) { return 0; }
+
+    // Stop delivering samples. start() may be called again afterwards
+    virtual void stop(void) = 0;
+
+    // Number of blocks lost because the consumer could not keep up
+    virtual uint64_t overruns(void) { return 0; }
+};
+
+//----------------------------------------------------------------------
+// File replay
+//----------------------------------------------------------------------
+// Streams a recorded capture (capfile.h) or a plain raw "000VHRGB" byte
+// file straight from a memory mapping, or decodes a compressed capture
+// (caprle.h) block by block.
+// bytes_per_sec == 0 replays at full speed, otherwise the replay is paced
+// to the given byte rate (8-16 MB/s for the real hardware).
+// start_frame > 0 begins at that frame (compressed captures only, they
+// have the index of the frames).
+// If info is not NULL, open() stores the recording settings there
+// (all zero for a plain byte file).
+#define CAPTURE_FILE_BLOCK (64 * 1024)
+
+struct capfile_header;
+
+capture_source *capture_file_create(const char *path, double bytes_per_sec, bool loop, uint64_t start_frame, capfile_header *info);
+
+#endif
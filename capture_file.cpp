@@ -0,0 +1,216 @@
+//
+// File replay capture source
+//
+// Memory maps a recorded capture (capfile container or a plain raw
+// "000VHRGB" byte file) and hands out spans of the mapping, no copies.
+// Compressed captures (caprle container) are decoded one block at a time.
+// Portable (no CyAPI) so that the decoder can run on build hosts without
+// the hardware attached.
+//
+#include "capture.h"
+#include "capfile.h"
+#include "caprle.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+// Delivers no faster than the real byte rate (rate == 0: full speed)
+struct pacer {
+    double rate;
+    uint64_t sent;
+    std::chrono::steady_clock::time_point t0;
+
+    void start(void) {
+        t0 = std::chrono::steady_clock::now();
+        sent = 0;
+    }
+
+    void wait(size_t len) {
+        if (rate > 0) {
+            sent += len;
+            auto due = t0 + std::chrono::duration<double>(sent / rate);
+            std::this_thread::sleep_until(due);
+        }
+    }
+};
+
+class file_source : public capture_source {
+public:
+    file_source(const char *path, double bytes_per_sec, bool loop, capfile_header *info)
+        : path(path), loop(loop), info(info), top(0), pos(0) {
+        pace.rate = bytes_per_sec;
+    }
+
+    int open(void) {
+        if (file.open(path) < 0) {
+            fprintf(stderr, "Replay: Could not open %s\n", path);
+            return -1;
+        }
+
+        capfile_header hdr;
+        top = capfile_parse_header(file.data(), file.size(), &hdr);
+        if (info != NULL) {
+            if (top > 0) {
+                *info = hdr;
+            } else {
+                memset(info, 0, sizeof(*info));  // Plain byte dump
+            }
+        }
+        if (top == file.size()) {
+            fprintf(stderr, "Replay: %s has no samples\n", path);
+            return -1;
+        }
+        pos = top;
+        return 0;
+    }
+
+    int start(void) {
+        // Pacing restarts from here
+        pace.start();
+        return 0;
+    }
+
+    long next_buffer(const uint8_t **data, int timeout_ms) {
+        if (pos == file.size()) {
+            if (!loop) {
+                return -1;
+            }
+            pos = top;
+        }
+        size_t len = file.size() - pos;
+        if (len > CAPTURE_FILE_BLOCK) {
+            len = CAPTURE_FILE_BLOCK;
+        }
+
+        pace.wait(len);
+
+        *data = file.data() + pos;
+        pos += len;
+        return (long)len;
+    }
+
+    void release(void) {
+    }
+
+    void stop(void) {
+    }
+
+private:
+    const char *path;
+    bool loop;
+    capfile_header *info;
+    mapped_file file;
+    size_t top;    // First sample
+    size_t pos;
+    pacer pace;
+};
+
+//----------------------------------------------------------------------
+// Compressed capture
+//----------------------------------------------------------------------
+// One block is decoded per next_buffer(), into a buffer which is reused
+// once it has been released.
+class rle_source : public capture_source {
+public:
+    rle_source(const char *path, double bytes_per_sec, bool loop, uint64_t start_frame, capfile_header *info)
+        : path(path), loop(loop), start_frame(start_frame), info(info), block(0), skip(0), barren(0) {
+        pace.rate = bytes_per_sec;
+    }
+
+    int open(void) {
+        capfile_header hdr;
+        if (reader.open(path, &hdr) < 0) {
+            fprintf(stderr, "Replay: Could not open %s\n", path);
+            return -1;
+        }
+        if (info != NULL) {
+            *info = hdr;
+        }
+        if (reader.block_count() == 0) {
+            fprintf(stderr, "Replay: %s has no samples\n", path);
+            return -1;
+        }
+        if (start_frame > 0 && reader.find_frame(start_frame, &block, &skip) < 0) {
+            fprintf(stderr, "Replay: %s has only %llu frames\n", path, (unsigned long long)reader.frame_count());
+            return -1;
+        }
+        return 0;
+    }
+
+    int start(void) {
+        pace.start();
+        return 0;
+    }
+
+    long next_buffer(const uint8_t **data, int timeout_ms) {
+        for (;;) {
+            if (block == reader.block_count()) {
+                if (!loop) {
+                    return -1;
+                }
+                block = 0;
+            }
+            // A whole pass without samples (every block broken) never ends
+            if (barren++ == reader.block_count()) {
+                fprintf(stderr, "Replay: %s has no readable block\n", path);
+                return -1;
+            }
+            long len = reader.read_block(block++, buf);
+            if (len < 0) {
+                fprintf(stderr, "Replay: Block %d of %s is broken\n", block - 1, path);
+                continue;
+            }
+            // The first block after a seek begins at the V-Sync pulse
+            len -= (long)skip;
+            if (len <= 0) {
+                skip = 0;
+                continue;
+            }
+            pace.wait(len);
+
+            *data = buf + skip;
+            skip = 0;
+            barren = 0;
+            return len;
+        }
+    }
+
+    void release(void) {
+    }
+
+    void stop(void) {
+    }
+
+private:
+    const char *path;
+    bool loop;
+    uint64_t start_frame;
+    capfile_header *info;
+    caprle_reader reader;
+    int block;       // Next block
+    size_t skip;     // Samples before the start frame in that block
+    int barren;      // Blocks read since the last samples
+    pacer pace;
+    uint8_t buf[CAPRLE_BLOCK_MAX + 8];
+};
+
+capture_source *capture_file_create(const char *path, double bytes_per_sec, bool loop, uint64_t start_frame, capfile_header *info) {
+    // The container is told by its magic
+    char magic[8] = {0};
+    FILE *fp = fopen(path, "rb");
+    if (fp != NULL) {
+        if (fread(magic, sizeof(magic), 1, fp) != 1) {
+            memset(magic, 0, sizeof(magic));
+        }
+        fclose(fp);
+    }
+    if (memcmp(magic, CAPRLE_MAGIC, sizeof(magic)) == 0) {
+        return new rle_source(path, bytes_per_sec, loop, start_frame, info);
+    }
+    if (start_frame > 0) {
+        fprintf(stderr, "Replay: %s has no index of the frames, replaying from the top\n", path);
+    }
+    return new file_source(path, bytes_per_sec, loop, info);
+}
@@ -0,0 +1,245 @@
+//
+// Resumable "000VHRGB" frame decoder
+//
+#include "decoder.h"
+#include "simd.h"
+
+#include <string.h>
+
+#define VMASK (1 << BIT_VSYNC)
+#define HMASK (1 << BIT_HSYNC)
+#define VHMASK (VMASK | HMASK)
+
+void decoder_init(decoder *dec, uint8_t *vram, int v_porch, int h_porch, int oversample) {
+    dec->v_porch = v_porch;
+    dec->h_porch = h_porch;
+    dec->oversample = oversample;
+    dec->sync_pol = 0;
+    dec->vram = vram;
+    dec->prev = NULL;
+    dec->dirty = NULL;
+    dec->frames = 0;
+    dec->sync_lost = 0;
+#ifdef DECODER_PROFILE
+    memset(dec->prof_ticks, 0, sizeof(dec->prof_ticks));
+    memset(dec->prof_bytes, 0, sizeof(dec->prof_bytes));
+#endif
+    decoder_reset(dec);
+}
+
+void decoder_reset(decoder *dec) {
+    dec->state = DEC_WAIT_VSYNC;
+    dec->sync_low = 0;
+    dec->count = 0;
+    dec->x = 0;
+    dec->y = 0;
+    dec->phase = 0;
+}
+
+//----------------------------------------------------------------------
+// Wait for the end of a sync pulse (active, then idle).
+// Returns 1 when the first idle sample has been consumed.
+//----------------------------------------------------------------------
+static inline int wait_sync(decoder *dec, const uint8_t **pp, const uint8_t *end, uint8_t mask) {
+    const uint8_t *p = *pp;
+    int high = dec->sync_pol & mask;
+
+    if (!dec->sync_low) {
+        p += high ? find_rising_edge(p, end - p, mask) : find_falling_edge(p, end - p, mask);
+        if (p == end) {
+            *pp = p;
+            return 0;
+        }
+        dec->sync_low = 1;
+    }
+    p += high ? find_falling_edge(p, end - p, mask) : find_rising_edge(p, end - p, mask);
+    if (p == end) {
+        *pp = p;
+        return 0;
+    }
+    dec->sync_low = 0;
+    *pp = p + 1;
+    return 1;
+}
+
+#ifdef DECODER_PROFILE
+static const int stage_of[] = {
+    DEC_STAGE_SYNC,     // DEC_WAIT_VSYNC
+    DEC_STAGE_PORCH,    // DEC_V_PORCH
+    DEC_STAGE_SYNC,     // DEC_WAIT_HSYNC
+    DEC_STAGE_PORCH,    // DEC_H_PORCH
+    DEC_STAGE_PIXELS,   // DEC_ACTIVE
+};
+
+// Charge the time and bytes since the last mark to the stage it began in
+#define PROF_BEGIN() \
+    uint64_t prof_t = decoder_ticks(); \
+    const uint8_t *prof_p = p; \
+    int prof_s = dec->state
+#define PROF_MARK(ptr) \
+    do { \
+        uint64_t t = decoder_ticks(); \
+        dec->prof_ticks[stage_of[prof_s]] += t - prof_t; \
+        dec->prof_bytes[stage_of[prof_s]] += (ptr) - prof_p; \
+        prof_t = t; \
+        prof_p = (ptr); \
+        prof_s = dec->state; \
+    } while (0)
+#else
+#define PROF_BEGIN()
+#define PROF_MARK(ptr)
+#endif
+
+// A completed row is dirty when it differs from the previous frame
+static inline void compare_row(decoder *dec, int y) {
+    if (dec->dirty != NULL && (dec->prev == NULL || memcmp(&dec->vram[y * DW], &dec->prev[y * DW], DW) != 0)) {
+        dirty_set(dec->dirty, y);
+    }
+}
+
+// A frame given up on sync loss keeps the previous picture from pixel x
+// of the current row on
+static void keep_rest(decoder *dec, int x) {
+    int y = dec->y;
+
+    if (dec->prev == NULL) {
+        for (int i = y; dec->dirty != NULL && i < DH; i++) {
+            dirty_set(dec->dirty, i);
+        }
+        return;
+    }
+    memcpy(&dec->vram[y * DW + x], &dec->prev[y * DW + x], DW - x);
+    compare_row(dec, y);
+    memcpy(&dec->vram[(y + 1) * DW], &dec->prev[(y + 1) * DW], (size_t)(DH - y - 1) * DW);
+}
+
+static inline int end_frame(decoder *dec) {
+    dec->frames++;
+    decoder_reset(dec);
+    return DEC_FRAME;
+}
+
+int decoder_feed(decoder *dec, const uint8_t **pp, const uint8_t *end) {
+    const uint8_t *p = *pp;
+    int os = dec->oversample;
+    uint8_t idle = VHMASK & ~dec->sync_pol;
+    PROF_BEGIN();
+
+    while (p < end) {
+        PROF_MARK(p);
+        switch (dec->state) {
+        case DEC_WAIT_VSYNC:
+            if (!wait_sync(dec, &p, end, VMASK)) {
+                break;
+            }
+            dec->state = DEC_V_PORCH;
+            dec->count = dec->v_porch;
+            break;
+
+        case DEC_V_PORCH:
+            if (dec->count > 0) {
+                if (!wait_sync(dec, &p, end, HMASK)) {
+                    break;
+                }
+                dec->count--;
+            }
+            if (dec->count == 0) {
+                dec->y = 0;
+                dec->state = DEC_WAIT_HSYNC;
+                if (dec->dirty != NULL) {
+                    memset(dec->dirty, 0, DIRTY_WORDS * sizeof(dec->dirty[0]));
+                }
+            }
+            break;
+
+        case DEC_WAIT_HSYNC:
+            if (!wait_sync(dec, &p, end, HMASK)) {
+                break;
+            }
+            dec->state = DEC_H_PORCH;
+            dec->count = (dec->h_porch - 1) * os;
+            if (dec->count < 0) {
+                dec->count = 0;
+            }
+            break;
+
+        case DEC_H_PORCH: {
+            int skip = (end - p < dec->count) ? (int)(end - p) : dec->count;
+            p += skip;
+            dec->count -= skip;
+            if (dec->count == 0) {
+                dec->state = DEC_ACTIVE;
+                dec->x = 0;
+                dec->phase = 0;
+            }
+            break;
+        }
+
+        case DEC_ACTIVE: {
+            uint8_t *dst = &dec->vram[dec->y * DW];
+            int x = dec->x;
+            int phase = dec->phase;
+
+            // Finish a pixel split across spans
+            while (phase > 0 && p < end) {
+                uint8_t d = *p++;
+                if (++phase < os) {
+                    continue;  // Only the last sample of a pixel is used
+                }
+                phase = 0;
+                if ((d & VHMASK) != idle) {
+                    // Sync is lost, skip this frame
+                    dec->sync_lost++;
+                    keep_rest(dec, x);
+                    *pp = p;
+                    PROF_MARK(p);
+                    return end_frame(dec);
+                }
+                dst[x++] = d & 7;
+            }
+
+            // Whole pixels in this span
+            if (phase == 0 && x < DW) {
+                int n = (int)((end - p) / os);
+                if (n > DW - x) {
+                    n = DW - x;
+                }
+                int got = (int)extract_pixels(p, &dst[x], n, os, VHMASK, idle);
+                if (got < n) {
+                    // Sync is lost, skip this frame
+                    dec->sync_lost++;
+                    keep_rest(dec, x + got);
+                    *pp = p + (got + 1) * os;
+                    PROF_MARK(*pp);
+                    return end_frame(dec);
+                }
+                p += n * os;
+                x += n;
+
+                // Leading samples of a pixel continuing in the next span
+                if (x < DW && p < end) {
+                    phase = (int)(end - p);
+                    p = end;
+                }
+            }
+            dec->x = x;
+            dec->phase = phase;
+
+            if (x == DW) {
+                compare_row(dec, dec->y);
+                if (++dec->y == DH) {
+                    *pp = p;
+                    PROF_MARK(p);
+                    return end_frame(dec);
+                }
+                dec->state = DEC_WAIT_HSYNC;
+            }
+            break;
+        }
+        }
+    }
+
+    PROF_MARK(p);
+    *pp = p;
+    return DEC_MORE;
+}
@@ -0,0 +1,103 @@
+//
+// Resumable "000VHRGB" frame decoder
+//
+// The decoder is a state machine which consumes the sample stream in
+// contiguous spans and can stop / resume at any byte boundary.
+//
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DW 640
+#define DH 200
+
+#define BIT_VSYNC 4
+#define BIT_HSYNC 3
+#define BIT_R 2
+#define BIT_G 1
+#define BIT_B 0
+
+// Bitmap of DH rows, e.g. the rows which differ from the previous frame
+#define DIRTY_WORDS ((DH + 63) / 64)
+
+static inline void dirty_set(uint64_t *bits, int y) { bits[y >> 6] |= 1ULL << (y & 63); }
+static inline int dirty_test(const uint64_t *bits, int y) { return (int)(bits[y >> 6] >> (y & 63)) & 1; }
+
+// Decoder states
+enum {
+    DEC_WAIT_VSYNC,   // Wait V-Sync (active, then idle)
+    DEC_V_PORCH,      // Skip V-Sync back porch (count H-Sync)
+    DEC_WAIT_HSYNC,   // Wait H-Sync (active, then idle)
+    DEC_H_PORCH,      // Skip H-Sync back porch
+    DEC_ACTIVE,       // Active pixels
+};
+
+// Stages for profiling (build with DECODER_PROFILE)
+enum {
+    DEC_STAGE_SYNC,     // V-Sync / H-Sync search
+    DEC_STAGE_PORCH,    // V / H porch skip
+    DEC_STAGE_PIXELS,   // Active pixel extraction
+    DEC_STAGES,
+};
+
+#ifdef DECODER_PROFILE
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+// TSC ticks
+static inline uint64_t decoder_ticks(void) { return __rdtsc(); }
+#else
+#include <chrono>
+// Nanoseconds
+static inline uint64_t decoder_ticks(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+#endif
+
+// decoder_feed() results
+#define DEC_MORE 0    // Span exhausted, feed the next one
+#define DEC_FRAME 1   // A frame has been completed (or given up on sync loss)
+
+struct decoder {
+    // Settings (may be changed between frames)
+    int v_porch;      // H-Sync pulses between V-Sync and the first line
+    int h_porch;      // Pixels between H-Sync and the first pixel
+    int oversample;   // Samples per pixel (2 for CS2300-CP, 1 for dot clock)
+    uint8_t sync_pol; // Sync bits which are active high (0: both active low)
+    uint8_t *vram;    // DW x DH palette indices
+    const uint8_t *prev;  // Previous frame: rows are compared with it, and a frame
+                          // given up on sync loss is completed from it (NULL: none)
+    uint64_t *dirty;      // Rows which differ from prev (NULL: not tracked)
+
+    // State
+    int state;
+    int sync_low;     // Sync pulse (active level) has been seen
+    int count;        // Pulses / bytes left in the current state
+    int x, y;
+    int phase;        // Sample position within the current pixel
+
+    // Statistics
+    uint64_t frames;
+    uint64_t sync_lost;
+
+#ifdef DECODER_PROFILE
+    uint64_t prof_ticks[DEC_STAGES];
+    uint64_t prof_bytes[DEC_STAGES];
+#endif
+};
+
+void decoder_init(decoder *dec, uint8_t *vram, int v_porch, int h_porch, int oversample);
+void decoder_reset(decoder *dec);
+
+// Consume samples from *p up to end. *p is advanced past the consumed bytes.
+// Returns DEC_FRAME right after a frame is completed (*p may be < end),
+// otherwise DEC_MORE when the whole span has been consumed.
+int decoder_feed(decoder *dec, const uint8_t **p, const uint8_t *end);
+
+#endif
@@ -5,31 +5,55 @@
 //
 // Modified for SDL on Windows and CS2300-CP
 
-#define DW 640
-#define DH 200
-
 #include <SDL.h>
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <Windows.h>
 #include <CyAPI.h>
 #include <assert.h>
-
-#define BIT_VSYNC 4
-#define BIT_HSYNC 3
-#define BIT_R 2
-#define BIT_G 1
-#define BIT_B 0
-
-// Built-in firmware hex strings.
-static const char *firmware[] = {
+#include <atomic>
+#include <vector>
+
+#include "calib.h"
+#include "capture.h"
+#include "capfile.h"
+#include "caprle.h"
+#include "decoder.h"
+#include "framepool.h"
+#include "framesink.h"
+#include "fwimage.h"
+#include "fx2ctl.h"
+#include "fx2load.h"
+#include "netstream.h"
+#include "palette.h"
+#include "plltune.h"
+#include "ring.h"
+#include "simd.h"
+#include "telemetry.h"
+#include "xfertune.h"
+
+// Built-in firmware hex strings, turned into the binary image (merged
+// address ranges) while compiling
+static constexpr const char *firmware_hex[] = {
 #include "slave.inc"
-    NULL};
-
-#define READ() usb_read()
-
+};
+static constexpr fw_size firmware_size = fw_measure(firmware_hex);
+static_assert(firmware_size.error == 0, "slave.inc: bad Intel HEX record");
+static constexpr fw_image<firmware_size.bytes, firmware_size.ranges> firmware =
+    fw_parse<firmware_size.bytes, firmware_size.ranges>(firmware_hex);
+
+// The slave.inc of the tree is still the build before Identify. It is
+// downloaded on every start until slave.inc is generated again from
+// firmware/slave.c, which changes the hash.
+#define FIRMWARE_OLD_HASH 0x944af5d2f73bfd23ULL
+static constexpr int firmware_protocol = (firmware.hash == FIRMWARE_OLD_HASH) ? 0 : FX2_PROTOCOL;
+
+struct pipeline;
 void finalize(void);
+int open_usb(pipeline *p, int index);
 
 //======================================================================
 // USB
@@ -37,194 +61,290 @@ void finalize(void);
 #define VID 0x04b4
 #define PID 0x8613
 #define IN_EP (6)
-#define RX_SIZE (16 * 1024 * 4)
-#define XFR_NUM 8
-#define READ_SIZE (RX_SIZE * XFR_NUM)
-static uint8_t buf[XFR_NUM * RX_SIZE];
-static volatile int usb_run_flag = 1;
-
-CCyUSBDevice *USBDevice;
-OVERLAPPED ov_ep6[XFR_NUM];
-HANDLE ev_ep6[XFR_NUM];
+#define RX_SIZE (16 * 1024 * 4)   // Default transfer size
+#define XFR_NUM 8                 // Default queue depth
 
-OVERLAPPED ov_ep1;
-HANDLE ev_ep1;
-
-CCyBulkEndPoint *ep6;
-CCyBulkEndPoint *ep1;
-CCyControlEndPoint *cep;
+// Transfer size / queue depth (-xfer), one ring block per transfer
+static xfer_setting xfer = {RX_SIZE, XFR_NUM};
+static bool xfer_auto;                // Tune them on the live stream
 
 static volatile int ui_run_flag = 1;
-
+static uint64_t start_us;             // Program start, for the time to the first frame
+
+static const char *record_file;       // Raw capture output
+static bool record_rle;               // Compress the capture output
+static bool auto_calib = true;        // Follow the timing of the source
+static bool force_reload;             // Download the firmware even if it runs already
+static int h_total;                   // PLL setting sent on start (-htotal), 0: as the firmware starts
+static bool h_total_auto;             // Tune it on the live stream
+static uint32_t palette_rgb[PALETTE_SIZE];
+static int band_lines;                // Present in bands as they are decoded (-band), 0: whole frames
+
+// Headless output (-o), instead of the window
+static const char *sink_file;
+static int sink_format = SINK_RAW;
+static int sink_every = 1;            // Write every n-th frame
+static int sink_fps = 60;             // Source frame rate for the Y4M header
+
+// Frame stream for viewers on the network (-serve), one port per device
+static char serve_addr[64] = "127.0.0.1";
+static int serve_port;
+
+// Telemetry: log line every stats_interval seconds (-stats), HTTP endpoint (-metrics)
+static int stats_interval;
+static metrics_server metrics_http;
+static char metrics_addr[64] = "127.0.0.1";
+static int metrics_port;
 
 //----------------------------------------------------------------------
-// USB write RAM
+// Pipelines
 //----------------------------------------------------------------------
-#define USB_WRITE_RAM_MAX_SIZE 64
-int usb_write_ram(int addr, uint8_t *dat, int size) {
+// One per capture device (EZ-USB FX2) or replayed file, each with its own
+// ring, USB and decode threads, frames, window or headless sink, frame
+// server and telemetry. They share nothing on the streaming path, so
+// several devices run side by side as fast as one.
+struct pipeline {
+    int id;                           // 0, 1, ... in the order of -dev / -r
+
+    // USB (all NULL when replaying a file)
+    CCyUSBDevice *usb;
+    CCyBulkEndPoint *ep6;
+    CCyBulkEndPoint *ep1;
+    CCyControlEndPoint *cep;
+    fx2_port *port;                   // Control endpoint and EP1
+    fx2_control *control;             // EP1 commands beside the stream
+    spsc_ring ring;
+    volatile int usb_run_flag;
+    HANDLE h_usb_thread;
+    std::vector<OVERLAPPED> ov_ep6;
+    std::vector<HANDLE> ev_ep6;
+    xfer_setting xfer;                // Transfer size / queue depth
+
+    capture_source *capture;
+    capfile_header replay_info;       // Settings of the replayed recording
+    volatile unsigned short h_pixels;
+
+    // Decode
+    frame_pool frames;
+    HANDLE h_decode_thread;
+    char record_path[MAX_PATH];       // Capture output, "" for none
+    int mark_seq;                     // Command whose stream marker is awaited, 0: none
+    uint64_t mark_deadline_us;        // Given up after this (command lost)
+
+    // Key requests from the display thread, carried out by the decode
+    // thread between spans (the decoder settings and USB commands belong to it)
+    std::atomic<int> req_v_porch;     // Deltas
+    std::atomic<int> req_h_porch;
+    std::atomic<int> req_h_pixels;
+    std::atomic<int> req_h_tune;
+    std::atomic<int> req_restart;
+    std::atomic<int> req_calib;
+
+    // Output
+    char sink_path[MAX_PATH];         // Headless output
+    HANDLE h_sink_thread;
+    frame_server server;
+
+    // Cores of the USB and decode threads (-pin), -1: any
+    int cpu_usb, cpu_decode;
+
+    telemetry stats;
+    telemetry_sample stats_prev;      // At the last log line
+    bool stats_started;
+};
+
+static std::vector<pipeline *> pipes;
+static std::atomic<int> pipes_running(0);     // Decode threads not finished yet
+
+// Cores to pin the threads to (-pin): USB #0, decode #0, USB #1, ...
+static std::vector<int> pin_cpus;
+
+static void pin_thread(HANDLE h, int cpu) {
+    if (cpu >= 0 && ::SetThreadAffinityMask(h, (DWORD_PTR)1 << cpu) == 0) {
+        fprintf(stderr, "Main: Could not pin a thread to CPU %d\n", cpu);
+    }
+}
 
-    for (int i = 0; i < size; i += USB_WRITE_RAM_MAX_SIZE) {
-        LONG len = (size - i > USB_WRITE_RAM_MAX_SIZE) ? USB_WRITE_RAM_MAX_SIZE : size - i;
-        cep->Target = TGT_DEVICE;
-        cep->ReqType = REQ_VENDOR;
-        cep->Direction = DIR_TO_DEVICE;
-        cep->ReqCode = 0xa0;
-        cep->Value = addr + i;
-        cep->Index = 0;
-        bool ret = cep->Write(dat + i, len);
-        if (ret == false) {
-            fprintf(stderr, "USB: Write Ram at %04x (len %d) failed.\n", addr + i, len);
-            return -1;
-        }
+// Name of the log lines and titles, "" for a single device
+static const char *pipeline_name(const pipeline *p, char *buf, size_t size) {
+    if (pipes.size() > 1) {
+        snprintf(buf, size, "#%d ", p->id);
+    } else {
+        buf[0] = '\0';
+    }
+    return buf;
+}
+
+// Output file of a device: path itself for a single device,
+// "name-<id>.ext" for several
+static void pipeline_path(const pipeline *p, const char *path, char *buf, size_t size) {
+    const char *dot = strrchr(path, '.');
+    const char *sep = strrchr(path, '\\');
+    if (sep == NULL || strrchr(path, '/') > sep) {
+        sep = strrchr(path, '/');
+    }
+    if (pipes.size() <= 1) {
+        snprintf(buf, size, "%s", path);
+    } else if (dot == NULL || (sep != NULL && dot < sep)) {
+        snprintf(buf, size, "%s-%d", path, p->id);
+    } else {
+        snprintf(buf, size, "%.*s-%d%s", (int)(dot - path), path, p->id, dot);
     }
-    return 0;
+}
+
+// Created zeroed (counters, requests), then set up for the next id
+static pipeline *pipeline_create(void) {
+    pipeline *p = new pipeline();
+    p->id = (int)pipes.size();
+    p->xfer = xfer;
+    p->h_pixels = h_total ? h_total : 896;  // 896.. X1/turbo,  912 for Pasopia7;
+    p->cpu_usb = (2 * p->id < (int)pin_cpus.size()) ? pin_cpus[2 * p->id] : -1;
+    p->cpu_decode = (2 * p->id + 1 < (int)pin_cpus.size()) ? pin_cpus[2 * p->id + 1] : -1;
+    pipes.push_back(p);
+    return p;
 }
 
 //----------------------------------------------------------------------
-// USB load firmware
+// USB port for the firmware start-up
 //----------------------------------------------------------------------
-#define FIRMWARE_MAX_SIZE_PER_LINE 64
-static uint8_t firmware_dat[FIRMWARE_MAX_SIZE_PER_LINE];
-int usb_load_firmware(const char *firmware[]) {
-    int ret;
-
-    // Take the CPU into RESET
-    uint8_t dat = 1;
-    ret = usb_write_ram(0xe600, &dat, sizeof(dat));
-    if (ret < 0) {
-        return -1;
+// Vendor request 0xA0 on the control endpoint, commands and replies on EP1
+class cyusb_port : public fx2_port {
+public:
+    cyusb_port(CCyControlEndPoint *cep, CCyBulkEndPoint *out, CCyBulkEndPoint *in) : cep(cep), out(out), in(in) {}
+
+    int write_ram(int addr, const uint8_t *data, int size) {
+        LONG len = size;
+        setup(DIR_TO_DEVICE, addr);
+        return (cep->Write((PUCHAR)data, len) && len == size) ? 0 : -1;
     }
 
-    // Load firmware
-    int size, addr, record_type, tmp_dat;
-    for (int i = 0; firmware[i] != NULL; i++) {
-        const char *p = firmware[i] + 1;
-
-        // Extract size
-        ret = sscanf(p, "%2x", &size);
-        assert(ret != 0);
-        assert(size <= FIRMWARE_MAX_SIZE_PER_LINE);
-        p += 2;
-
-        // Extract addr
-        ret = sscanf(p, "%4x", &addr);
-        assert(ret != 0);
-        p += 4;
-
-        // Extract record type
-        ret = sscanf(p, "%2x", &record_type);
-        assert(ret != 0);
-        p += 2;
-
-        // Write program to EZ-USB's RAM (record_type==0).
-        if (record_type == 0) {
-            for (int j = 0; j < size; j++) {
-                ret = sscanf(p, "%2x", &tmp_dat);
-                firmware_dat[j] = tmp_dat & 0xff;
-                assert(ret != 0);
-                p += 2;
-            }
+    int read_ram(int addr, uint8_t *data, int size) {
+        LONG len = size;
+        setup(DIR_FROM_DEVICE, addr);
+        return (cep->Read((PUCHAR)data, len) && len == size) ? 0 : -1;
+    }
 
-            ret = usb_write_ram(addr, firmware_dat, size);
-            if (ret < 0) {
-                return -1;
-            }
-        }
+    int command(const uint8_t *data, int size, int timeout_ms) {
+        LONG len = size;
+        return xfer(out, (PUCHAR)data, &len, timeout_ms) ? 0 : -1;
     }
 
-    // Take the CPU out of RESET (run)
-    dat = 0;
-    ret = usb_write_ram(0xe600, &dat, sizeof(dat));
-    if (ret < 0) {
-        return -1;
+    int reply(uint8_t *data, int size, int timeout_ms) {
+        LONG len = size;
+        return xfer(in, data, &len, timeout_ms) ? (int)len : -1;
     }
 
-    return 0;
-}
+private:
+    void setup(CTL_XFER_DIR_TYPE dir, int addr) {
+        cep->Target = TGT_DEVICE;
+        cep->ReqType = REQ_VENDOR;
+        cep->Direction = dir;
+        cep->ReqCode = 0xa0;
+        cep->Value = addr;
+        cep->Index = 0;
+    }
 
-HANDLE usb_cond;
+    // Bulk transfer with its own timeout
+    static bool xfer(CCyBulkEndPoint *ep, PUCHAR data, LONG *len, int timeout_ms) {
+        if (ep == NULL) {
+            return false;
+        }
+        ULONG timeout = ep->TimeOut;
+        ep->TimeOut = timeout_ms;
+        bool ret = ep->XferData(data, *len, NULL);
+        ep->TimeOut = timeout;
+        return ret;
+    }
 
-static volatile uint64_t usb_received_size = 0;
-static volatile int usb_trans_pos = 0;
-static int usb_closed_flag = 0;
-CRITICAL_SECTION received_size_section;
+    CCyControlEndPoint *cep;
+    CCyBulkEndPoint *out;
+    CCyBulkEndPoint *in;
+};
 
 //----------------------------------------------------------------------
 // USB thread for bulk-in transfer
 //----------------------------------------------------------------------
-static HANDLE h_usb_thread;
-
 struct timeval tv = {0, 1};
 DWORD WINAPI usb_run(void *arg) {
+    pipeline *pl = (pipeline *)arg;
+    CCyBulkEndPoint *ep6 = pl->ep6;
+    spsc_ring &usb_ring = pl->ring;
+    std::vector<OVERLAPPED> &ov_ep6 = pl->ov_ep6;
+    std::vector<HANDLE> &ev_ep6 = pl->ev_ep6;
+    telemetry &metrics = pl->stats;
+
     //puts("USB: Start receiving VH-RGB signals.");
-    UCHAR *ctx[XFR_NUM];
+    // The ring has been set up with the current transfer size / depth
+    const LONG size = (LONG)usb_ring.get_block_size();
+    const int num = usb_ring.get_blocks();
+    std::vector<UCHAR *> ctx(num);
+    ov_ep6.assign(num, OVERLAPPED());
+    ev_ep6.assign(num, (HANDLE)NULL);
 
-    // Submit USB transfers
-    ep6->SetXferSize(RX_SIZE);
+    // Submit USB transfers straight into the ring blocks
+    ep6->SetXferSize(size);
 
-    for (int i = 0; i < XFR_NUM; i++) {
-        memset(&ov_ep6[i], 0, sizeof(ov_ep6[0]));
+    for (int i = 0; i < num; i++) {
         ev_ep6[i] = ::CreateEvent(NULL, false, false, NULL);
         ov_ep6[i].hEvent = ev_ep6[i];
-        ctx[i] = ep6->BeginDataXfer(&buf[i * RX_SIZE], RX_SIZE, &ov_ep6[i]);
+        ctx[i] = ep6->BeginDataXfer(usb_ring.block(i), size, &ov_ep6[i]);
     }
 
     // Waiting transfer completion repeatedly
     int64_t last = timeGetTime();
     int64_t cur;
     int64_t msec;
-    float avg = 0;
+    double avg = 0;
     int index = 0;
     LONG length = 0;
+    uint64_t received_size = 0;
     bool status;
 
-    while (usb_run_flag) {
+    while (pl->usb_run_flag) {
         status = ep6->WaitForXfer(&ov_ep6[index], 500);
-        if (status == true) {
-            length = RX_SIZE;
-            ep6->FinishDataXfer(&buf[index * RX_SIZE], length, &ov_ep6[index], ctx[index], NULL);
+        if (status != true) {
+            metrics.usb_timeouts.fetch_add(1, std::memory_order_relaxed);
+            continue;  // Still pending (no signal), keep waiting for it
         }
-        ::EnterCriticalSection(&received_size_section);
-        usb_received_size += length;
-        ::LeaveCriticalSection(&received_size_section);
-
-        if (length != RX_SIZE) {
-            //break;   // TODO
+        length = size;
+        if (!ep6->FinishDataXfer(usb_ring.block(index), length, &ov_ep6[index], ctx[index], NULL)) {
+            metrics.usb_failed.fetch_add(1, std::memory_order_relaxed);
+            length = 0;
         }
+        received_size += length;
+        metrics.usb_bytes.fetch_add(length, std::memory_order_relaxed);
+        metrics.usb_transfers.fetch_add(1, std::memory_order_relaxed);
 
-        usb_trans_pos = RX_SIZE * index;
-        ::SetEvent(usb_cond);
+        // Hand the block over to the decoder
+        usb_ring.commit(length);
 
         // Re-submit
-        ctx[index] = ep6->BeginDataXfer(&buf[index * RX_SIZE], RX_SIZE, &ov_ep6[index]);
+        ctx[index] = ep6->BeginDataXfer(usb_ring.block(index), size, &ov_ep6[index]);
         index++;
-        index %= XFR_NUM;
+        index %= num;
         cur = timeGetTime();
         msec = cur - last;
         if (msec > 1000) {
-            ::EnterCriticalSection(&received_size_section);
-            int size = usb_received_size;
-            usb_received_size = 0;
-            ::LeaveCriticalSection(&received_size_section);
-
-            float mbps = size / ((cur - last) / 1000.0) / 1024.0 / 1024.0;
-            avg = (!avg) ? mbps : avg * 0.95 + mbps * 0.05;
-            //printf("Receiving at %.3f MBps (Avg. %.3f Mbps)\r", mbps, avg);
+            double rate = received_size / (msec / 1000.0);
+            avg = (!avg) ? rate : avg * 0.95 + rate * 0.05;
+            metrics.usb_rate.store((uint64_t)rate, std::memory_order_relaxed);
+            metrics.usb_rate_avg.store((uint64_t)avg, std::memory_order_relaxed);
+            received_size = 0;
             last = cur;
         }
     }
 
-    // Close all pending Xfers
-    int start_index = index;
-    do {
-        status = ep6->WaitForXfer(&ov_ep6[index], 100);
-        if (status == true) {
-            length = RX_SIZE;
-            ep6->FinishDataXfer(&buf[index * RX_SIZE], length, &ov_ep6[index], ctx[index], NULL);
-            ::CloseHandle(ov_ep6[index].hEvent);
-        }
-        index = (index + 1) % XFR_NUM;
-    } while (index != start_index);
+    // Close all pending Xfers. They write into the ring blocks and the
+    // kernel holds their OVERLAPPED, so every one must have completed
+    // before set_xfer() / the next start reallocates them.
+    ep6->Abort();
+    for (int i = 0; i < num; i++) {
+        ep6->WaitForXfer(&ov_ep6[i], INFINITE);
+        length = size;
+        ep6->FinishDataXfer(usb_ring.block(i), length, &ov_ep6[i], ctx[i], NULL);
+        ::CloseHandle(ev_ep6[i]);
+        ev_ep6[i] = NULL;
+    }
 
     //puts("USB: Thread finished.");
 
@@ -232,242 +352,763 @@ DWORD WINAPI usb_run(void *arg) {
 }
 
 //----------------------------------------------------------------------
-// Read one "000VHRGB" signal byte via USB
+// USB capture source
 //----------------------------------------------------------------------
-__forceinline static uint8_t usb_read() {
-    static unsigned int read_pos = 0;
-    static int wait_count = 0;
-    DWORD ret;
+// Hands out the ring blocks in order of completion. All the blocks ready
+// at once are taken as a batch and released together.
+class usb_source : public capture_source {
+public:
+    usb_source(pipeline *p) : pl(p), ready(0), cur(0) {}
+
+    int open(void) {
+        return pl->ring.init(pl->xfer.size, pl->xfer.num);
+    }
 
-    while (read_pos == usb_trans_pos) {
-        ret = ::WaitForSingleObject(usb_cond, 100);
-        ::ResetEvent(usb_cond);
-        if (ret != WAIT_OBJECT_0) {
-            return 0;
+    int start(void) {
+        // The transfers restart from the first block
+        pl->ring.reset();
+        ready = 0;
+        cur = 0;
+
+        pl->usb_run_flag = 1;
+        pl->h_usb_thread = ::CreateThread(NULL, 0, usb_run, pl, 0, NULL);
+        if (pl->h_usb_thread == NULL) {
+            return -1;
         }
+        pin_thread(pl->h_usb_thread, pl->cpu_usb);
+        return 0;
     }
-    uint8_t dat = buf[read_pos++];
-    read_pos %= READ_SIZE;
-    return dat;
-}
 
-void send_command(uint8_t *data, LONG length) {
-    // Stop usb thread
-    usb_run_flag = 0;
-    ::WaitForSingleObject(h_usb_thread, INFINITE);
+    long next_buffer(const uint8_t **data, int timeout_ms) {
+        for (;;) {
+            if (cur == ready) {
+                if (ready > 0) {
+                    pl->ring.release(ready);
+                    ready = 0;
+                    cur = 0;
+                }
+                ready = pl->ring.acquire(1, timeout_ms);
+                if (ready == 0) {
+                    return 0;
+                }
+            }
 
-    ep1->XferData(data, length, NULL);
+            long len;
+            *data = pl->ring.peek(cur, &len);
+            if (len > 0) {
+                return len;
+            }
+            cur++;  // Failed transfer
+        }
+    }
 
-    // Restart usb thread
-    usb_run_flag = 1;
-    h_usb_thread = ::CreateThread(NULL, NULL, usb_run, NULL, NULL, NULL);
-}
+    uint64_t buffer_time(void) {
+        return (cur < ready) ? pl->ring.commit_time(cur) : 0;
+    }
+
+    void release(void) {
+        // A block handed out before a restart is simply dropped
+        if (cur < ready) {
+            cur++;
+        }
+    }
 
-static unsigned short h_pixels;
+    void stop(void) {
+        pl->usb_run_flag = 0;
+        ::WaitForSingleObject(pl->h_usb_thread, INFINITE);
+        ::CloseHandle(pl->h_usb_thread);
+    }
+
+    uint64_t overruns(void) {
+        return pl->ring.overruns();
+    }
+
+private:
+    pipeline *pl;
+    int ready;    // Blocks acquired from the ring
+    int cur;      // Blocks consumed of them
+};
+
+// Queue an EP1 command, the transfers stay in flight. Returns its sequence
+// number, 0 when replaying a file (no device to talk to)
+int send_command(pipeline *p, uint8_t code, const uint8_t *args, int size) {
+    if (p->control == NULL) {
+        return 0;
+    }
+    return p->control->post(code, args, size);
+}
 
-void set_pll(void) 
+int set_pll(pipeline *p)
 {
     uint32_t ratio_val;
-    uint8_t ep1_data[5];
+    uint8_t ratio[4];
 
     // Send command
-    ratio_val = (h_pixels * 2) << 4;
-    ep1_data[0] = 0x01;    // Set PLL
-    ep1_data[1] = ratio_val >> 16;
-    ep1_data[2] = ratio_val >> 8;
-    ep1_data[3] = ratio_val & 0xff;
-    ep1_data[4] = 0x00;
+    ratio_val = (p->h_pixels * 2) << 4;
+    ratio[0] = ratio_val >> 16;
+    ratio[1] = ratio_val >> 8;
+    ratio[2] = ratio_val & 0xff;
+    ratio[3] = 0x00;
 
-    send_command(ep1_data, sizeof(ep1_data));
+    return send_command(p, FX2_CMD_SET_PLL, ratio, sizeof(ratio));
 }
 
-void restart_usb(void) {
-    uint8_t ep1_data[2];
+int restart_usb(pipeline *p) {
+    return send_command(p, FX2_CMD_RESET_EP6, NULL, 0);
+}
+
+// Set up the transfers again with another size / depth
+int set_xfer(pipeline *p, const xfer_setting *s) {
+    p->capture->stop();
+    p->xfer = *s;
+    p->stats.usb_xfer_size.store(p->xfer.size, std::memory_order_relaxed);
+    p->stats.usb_xfer_num.store(p->xfer.num, std::memory_order_relaxed);
+    if (p->ring.init(p->xfer.size, p->xfer.num) < 0) {
+        return -1;
+    }
+    return p->capture->start();
+}
 
-    ep1_data[0] = 0x02;  // Reset EP6
-    ep1_data[1] = 0x00;  // no meanings
 
-    send_command(ep1_data, sizeof(ep1_data));
+//----------------------------------------------------------------------
+// Decode thread
+//----------------------------------------------------------------------
+// Consumes the capture as fast as it arrives and publishes the frames, so
+// that a slow present or a burst of events never backs up the USB ring.
+// One per pipeline.
+// The decoder resyncs at the stream marker of command seq, or gives up
+// waiting after MARKER_WAIT_MS. A firmware before the markers (the
+// slave.inc of the tree, firmware_protocol) has none to wait for: the
+// decoder finds the sync again by itself, as it always did, and only the
+// H_TOTAL tuner waits out the deadline.
+#define MARKER_WAIT_MS 200
+static constexpr bool firmware_markers = firmware_protocol >= FX2_PROTOCOL_MARKER;
+
+static void expect_marker(pipeline *p, decoder *dec, int seq) {
+    if (seq == 0) {
+        decoder_reset(dec);   // Replay: the stream goes on as it is
+        return;
+    }
+    p->mark_seq = seq;
+    p->mark_deadline_us = telemetry_now_us() + MARKER_WAIT_MS * 1000;
 }
 
+static void apply_requests(pipeline *p, decoder *dec, calib *cal) {
+    int d;
 
-DWORD WINAPI draw_run(void *arg) {
-    unsigned int v_porch;
-    unsigned int h_porch;
-
-    // The window we'll be rendering to
-    SDL_Window *window = NULL;
-
-    // The surface contained by the window
-    SDL_Surface *screenSurface = NULL;
-    SDL_Renderer *Renderer = NULL;
-    SDL_Texture *Texture = NULL;
-    SDL_Palette *Palette = NULL;
-
-    auto set_title = [&]() {
-        char tmp[100];
-        snprintf(tmp, sizeof(tmp), "Digital RGB Display : H_TOTAL=%d", h_pixels);
-        SDL_SetWindowTitle(window, tmp); 
-    };
+    if ((d = p->req_v_porch.exchange(0)) != 0) {
+        dec->v_porch = (dec->v_porch + d > 0) ? dec->v_porch + d : 0;
+    }
+    if ((d = p->req_h_porch.exchange(0)) != 0) {
+        dec->h_porch = (dec->h_porch + d > 1) ? dec->h_porch + d : 1;
+    }
+#ifdef USE_CP2300
+    if ((d = p->req_h_pixels.exchange(0)) != 0) {
+        p->h_pixels = p->h_pixels + d;
+        expect_marker(p, dec, set_pll(p));
+    }
+#endif
+    if (p->req_restart.exchange(0)) {
+        expect_marker(p, dec, restart_usb(p));
+    }
+    if (p->req_calib.exchange(0)) {
+        calib_restart(cal);
+    }
+}
 
-    // Initialize SDL
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        ::MessageBoxA(NULL, "SDL could not initialize", NULL, MB_OK);
-        return -1;
+DWORD WINAPI decode_run(void *arg) {
+    pipeline *p = (pipeline *)arg;
+    frame_pool &frames = p->frames;
+    capture_source *capture = p->capture;
+    decoder dec;
+
+#ifdef USE_CP2300
+    decoder_init(&dec, frames.back()->pixels, 36, 128, 2);
+#else
+    decoder_init(&dec, frames.back()->pixels, 36, 128, 1);
+#endif
+    dec.dirty = frames.back()->dirty;
+
+    // Replay with the settings of the recording
+    if (p->replay_info.header_size != 0) {
+        p->h_pixels = p->replay_info.h_pixels;
+        dec.h_porch = p->replay_info.h_porch;
+        dec.v_porch = p->replay_info.v_porch;
+        if (p->replay_info.oversample != 0) {
+            dec.oversample = p->replay_info.oversample;
+        }
+    }
+
+    // Porches and sync polarity are measured from the stream, on start and
+    // whenever the video mode changes
+    calib cal;
+    calib_init(&cal, dec.oversample, 4);
+
+    capfile_writer recorder;
+    caprle_writer rle_recorder;
+    DWORD record_start = timeGetTime();
+    if (p->record_path[0] != '\0') {
+        capfile_header hdr;
+        capfile_init_header(&hdr);
+        hdr.h_pixels = p->h_pixels;
+        hdr.h_porch = dec.h_porch;
+        hdr.v_porch = dec.v_porch;
+        hdr.oversample = dec.oversample;
+        hdr.block_size = p->xfer.size;
+        int ret = record_rle ? rle_recorder.open(p->record_path, &hdr) : recorder.open(p->record_path, &hdr);
+        if (ret < 0) {
+            ::MessageBoxA(NULL, "Could not create the recording file", "Digital RGB Display", MB_OK);
+        }
+    }
+
+    uint64_t last_overruns = capture->overruns();
+
+    // Transfer tuning (USB only), on the running totals of the stream
+    xfer_tuner tuner;
+    xfer_tuner_init(&tuner, &p->xfer);
+    bool tuning = xfer_auto && p->ep6 != NULL;
+
+#ifdef USE_CP2300
+    // H_TOTAL tuning (USB only), on the samples as they arrive
+    pll_tuner htuner;
+    pll_tuner_init(&htuner, p->h_pixels, dec.oversample);
+    bool htuning = h_total_auto && p->control != NULL;
+    if (p->control != NULL && (h_total != 0 || h_total_auto)) {
+        expect_marker(p, &dec, set_pll(p));
+    }
+    bool hwait = p->mark_seq != 0;    // The stream is the old setting until the marker
+#endif
+
+    int band_next = band_lines;       // Rows for the next band report
+
+    while (ui_run_flag) {
+#ifdef USE_CP2300
+        // The keys take the PLL over from the tuner, 't' hands it back
+        if (htuning && p->req_h_pixels.load() != 0) {
+            htuning = false;
+        }
+        if (p->req_h_tune.exchange(0) && p->control != NULL) {
+            pll_tuner_init(&htuner, p->h_pixels, dec.oversample);
+            htuning = true;
+        }
+#endif
+        apply_requests(p, &dec, &cal);
+
+        if (tuning && xfer_tuner_step(&tuner, telemetry_now_us(), p->stats.usb_bytes.load(), capture->overruns(), dec.sync_lost)) {
+            if (set_xfer(p, &tuner.current) < 0) {
+                ui_run_flag = 0;
+                break;
+            }
+            decoder_reset(&dec);
+            last_overruns = capture->overruns();
+        }
+        if (tuning && tuner.phase == TUNE_DONE) {
+            char name[16];
+            fprintf(stderr, "USB: %s%d x %d KiB transfers, %.2f ms until a sample is seen at %.2f MB/s\n",
+                    pipeline_name(p, name, sizeof(name)), p->xfer.num, p->xfer.size / 1024,
+                    xfer_latency_ms(&p->xfer, tuner.rate), tuner.rate / 1048576.0);
+            tuning = false;
+        }
+#ifdef USE_CP2300
+        if (htuning && htuner.phase >= PLL_TUNE_DONE) {
+            char name[16];
+            if (htuner.phase == PLL_TUNE_DONE) {
+                fprintf(stderr, "PLL: %sH_TOTAL %d, drift %.1f samples per line, %d trials%s\n",
+                        pipeline_name(p, name, sizeof(name)), htuner.h_pixels, htuner.best_drift, htuner.trials,
+                        htuner.no_detail ? ", no detail to measure further" : "");
+            } else if (htuner.no_detail) {
+                fprintf(stderr, "PLL: %sNo detail to measure, back at H_TOTAL %d\n",
+                        pipeline_name(p, name, sizeof(name)), htuner.h_pixels);
+            } else {
+                fprintf(stderr, "PLL: %sNo lock, back at H_TOTAL %d\n", pipeline_name(p, name, sizeof(name)),
+                        htuner.h_pixels);
+            }
+            htuning = false;
+        }
+#endif
+
+        const uint8_t *span;
+        long len = capture->next_buffer(&span, 100);
+        if (len < 0) {
+            break;  // End of stream
+        } else if (len == 0) {
+            continue;  // No signal
+        }
+        uint64_t arrival = capture->buffer_time();
+        if (arrival == 0) {
+            arrival = telemetry_now_us();
+        }
+
+        // The device has restarted its FIFO on a command: the samples in
+        // front of the marker are the old stream, the frame in progress is
+        // given up behind them
+        fx2_marker mark;
+        bool marked = p->ep6 != NULL && firmware_markers && fx2_find_marker(span, len, &mark);
+        if (marked) {
+            len -= FX2_MARKER_SIZE;
+        }
+
+#ifdef USE_CP2300
+        // A command restarts the FIFO, the rest of the span and the samples
+        // in flight up to its marker are the old stream
+        if (p->mark_seq != 0) {
+            hwait = true;
+        }
+        if (htuning && !hwait && pll_tuner_feed(&htuner, span, len)) {
+            p->h_pixels = htuner.h_pixels;
+            expect_marker(p, &dec, set_pll(p));
+            hwait = true;
+        }
+#endif
+
+        // Record straight from the capture buffer
+        if (record_rle) {
+            rle_recorder.write(span, len);
+        } else {
+            recorder.write(span, len);
+        }
+
+        if (auto_calib && calib_feed(&cal, span, len)) {
+            dec.sync_pol = cal.result.sync_pol;
+            calib_porch(&cal.result, &dec.v_porch, &dec.h_porch);
+            decoder_reset(&dec);
+        }
+
+        // Decode the whole span, publishing every completed frame
+        const uint8_t *s = span;
+        while (decoder_feed(&dec, &s, span + len) == DEC_FRAME) {
+            frame *f = frames.back();
+            frames.publish();
+            p->stats.decode_latency.add(f->published_us - arrival);
+            if (f->seq == 1) {
+                char name[16];
+                fprintf(stderr, "Main: %sFirst frame %.0f ms after start\n", pipeline_name(p, name, sizeof(name)),
+                        (f->published_us - start_us) / 1000.0);
+            }
+
+            // The next frame is compared with this one row by row
+            dec.prev = f->pixels;
+            dec.vram = frames.back()->pixels;
+            dec.dirty = frames.back()->dirty;
+            band_next = band_lines;
+        }
+
+        // The rows of the frame in progress are reported once per band.
+        // A span is decoded at once, so a band has at least its rows.
+        if (dec.y + band_lines < band_next) {
+            band_next = band_lines;   // Restarted on sync loss
+        }
+        if (band_lines > 0 && dec.y >= band_next) {
+            frames.progress(dec.y, arrival);
+            band_next = (dec.y / band_lines + 1) * band_lines;
+        }
+        capture->release();
+        p->stats.sync_lost.store(dec.sync_lost, std::memory_order_relaxed);
+
+        if (marked) {
+            decoder_reset(&dec);
+            if (mark.seq == p->mark_seq) {
+                p->mark_seq = 0;
+            }
+        } else if (p->mark_seq != 0 && telemetry_now_us() > p->mark_deadline_us) {
+            if (firmware_markers) {
+                decoder_reset(&dec);   // The marker has been lost
+            }
+            p->mark_seq = 0;
+        }
+#ifdef USE_CP2300
+        if (hwait && p->mark_seq == 0) {
+            pll_tuner_restart(&htuner);   // The next span is the new setting
+            hwait = false;
+        }
+#endif
+
+        // Samples have been lost, the frame in progress is torn
+        uint64_t overruns = capture->overruns();
+        if (overruns != last_overruns) {
+            last_overruns = overruns;
+            decoder_reset(&dec);
+        }
+    }
+
+    // Store the measured sample clock
+    DWORD record_msec = timeGetTime() - record_start;
+    uint64_t record_bytes = record_rle ? rle_recorder.bytes() : recorder.bytes();
+    uint32_t sample_clock = record_msec ? (uint32_t)(record_bytes * 1000 / record_msec) : 0;
+    recorder.close(sample_clock);
+    rle_recorder.close(sample_clock);
+
+    // The end of the last replay closes the window
+    if (--pipes_running == 0) {
+        ui_run_flag = 0;
+    }
+    return 0;
+}
+
+// Decode threads of all the pipelines
+static int start_decoders(void) {
+    pipes_running = (int)pipes.size();
+    for (pipeline *p : pipes) {
+        p->h_decode_thread = ::CreateThread(NULL, 0, decode_run, p, 0, NULL);
+        if (p->h_decode_thread == NULL) {
+            ui_run_flag = 0;
+            return -1;
+        }
+        pin_thread(p->h_decode_thread, p->cpu_decode);
+    }
+    return 0;
+}
+
+static void join_decoders(void) {
+    for (pipeline *p : pipes) {
+        if (p->h_decode_thread != NULL) {
+            ::WaitForSingleObject(p->h_decode_thread, INFINITE);
+            ::CloseHandle(p->h_decode_thread);
+            p->h_decode_thread = NULL;
+        }
+    }
+}
+
+//----------------------------------------------------------------------
+// Telemetry
+//----------------------------------------------------------------------
+static void collect_metrics(pipeline *p, telemetry_sample *s) {
+    telemetry_collect(&p->stats, s);
+    s->frames_decoded = p->frames.decoded();
+    s->frames_presented = p->frames.presented();
+    s->frames_skipped = p->frames.skipped();
+    s->ring_overruns = p->capture->overruns();
+    s->ring_occupancy = p->ring.occupancy();
+    s->ring_blocks = p->ring.get_blocks();
+}
+
+// Page of the metrics endpoint (on its thread)
+static size_t render_metrics(char *buf, size_t size) {
+    std::vector<telemetry_sample> s(pipes.size());
+    for (size_t i = 0; i < pipes.size(); i++) {
+        collect_metrics(pipes[i], &s[i]);
+    }
+    return telemetry_format(s.data(), (int)s.size(), buf, size);
+}
+
+// The log line of the last interval, called from the presentation loop
+static void log_metrics(pipeline *p) {
+    if (stats_interval <= 0) {
+        return;
+    }
+    uint64_t now = telemetry_now_us();
+    if (p->stats_started && now - p->stats_prev.time_us < (uint64_t)stats_interval * 1000000) {
+        return;
+    }
+    telemetry_sample s;
+    collect_metrics(p, &s);
+    if (p->stats_started) {
+        char name[16];
+        telemetry_log(&s, &p->stats_prev, pipeline_name(p, name, sizeof(name)), stderr);
+    }
+    p->stats_prev = s;
+    p->stats_started = true;
+}
+
+//----------------------------------------------------------------------
+// Display
+//----------------------------------------------------------------------
+// One window per pipeline. SDL keeps its windows and events on one
+// thread, so the display thread serves all of them.
+struct view {
+    pipeline *p;
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    bool redraw;                  // The window needs the picture again
+
+    // H_TOTAL and the frame rates of the last second
+    int shown_h_pixels;
+    uint64_t last_decoded, last_presented;
+    uint64_t unchanged;           // Frames with no changed rows, not presented
+    DWORD last_time;
+
+    // Band presentation, and its source to screen latency of the last second
+    frame_band band;
+    uint64_t band_arrival;
+    uint64_t band_sum_us, band_count;
+
+    // The picture of the texture. Rows are uploaded only where they differ
+    // from it (known: the texture row holds shown's row).
+    uint8_t shown[DW * DH];
+    bool shown_known[DH];
+    uint8_t band_buf[DW * DH];    // Rows copied out of the frame being decoded
+};
+
+static void convert_rows(const uint8_t *src, uint8_t *dst, int pitch, int rows, const uint32_t *lut) {
+    for (int y = 0; y < rows; y++) {
+        expand_palette32(&src[y * DW], (uint32_t *)(dst + y * pitch), DW, lut);
+    }
+}
+
+// Upload the runs of changed rows. Returns 0 if nothing has changed.
+static int update_texture(SDL_Texture *texture, const frame *f, const uint32_t *lut) {
+    int updated = 0;
+
+    for (int y = 0; y < DH;) {
+        if (!dirty_test(f->changed, y)) {
+            y++;
+            continue;
+        }
+        int top = y;
+        while (y < DH && dirty_test(f->changed, y)) {
+            y++;
+        }
+
+        SDL_Rect rect = {0, top, DW, y - top};
+        void *pixels;
+        int pitch;
+        if (SDL_LockTexture(texture, &rect, &pixels, &pitch) == 0) {
+            convert_rows(&f->pixels[top * DW], (uint8_t *)pixels, pitch, y - top, lut);
+            SDL_UnlockTexture(texture);
+        }
+        updated = 1;
     }
+    return updated;
+}
+
+static inline bool row_differs(const view *v, const uint8_t *src, int y) {
+    return !v->shown_known[y] || memcmp(&v->shown[y * DW], &src[y * DW], DW) != 0;
+}
+
+// Upload the runs of rows [top, bottom) which differ from the texture.
+// Returns 0 if nothing has changed.
+static int upload_rows(view *v, const uint8_t *src, int top, int bottom, const uint32_t *lut) {
+    int updated = 0;
+
+    for (int y = top; y < bottom;) {
+        if (!row_differs(v, src, y)) {
+            y++;
+            continue;
+        }
+        int first = y;
+        while (y < bottom && row_differs(v, src, y)) {
+            memcpy(&v->shown[y * DW], &src[y * DW], DW);
+            v->shown_known[y] = true;
+            y++;
+        }
+
+        SDL_Rect rect = {0, first, DW, y - first};
+        void *pixels;
+        int pitch;
+        if (SDL_LockTexture(v->texture, &rect, &pixels, &pitch) == 0) {
+            convert_rows(&v->shown[first * DW], (uint8_t *)pixels, pitch, y - first, lut);
+            SDL_UnlockTexture(v->texture);
+        }
+        updated = 1;
+    }
+    return updated;
+}
+
+static void set_title(view *v, DWORD now) {
+    pipeline *p = v->p;
+    char tmp[200], name[16];
+    DWORD msec = now - v->last_time;
+    double decoded = msec ? (p->frames.decoded() - v->last_decoded) * 1000.0 / msec : 0;
+    double presented = msec ? (p->frames.presented() - v->last_presented) * 1000.0 / msec : 0;
+    int len = snprintf(tmp, sizeof(tmp), "Digital RGB Display %s: H_TOTAL=%d : %.1f fps decoded, %.1f presented, %llu skipped, %llu unchanged",
+                       pipeline_name(p, name, sizeof(name)), p->h_pixels, decoded, presented,
+                       (unsigned long long)p->frames.skipped(), (unsigned long long)v->unchanged);
+    if (band_lines > 0 && v->band_count > 0) {
+        snprintf(tmp + len, sizeof(tmp) - len, " : %.1f ms source to screen", v->band_sum_us / 1000.0 / v->band_count);
+        v->band_sum_us = 0;
+        v->band_count = 0;
+    }
+    SDL_SetWindowTitle(v->window, tmp);
+    v->shown_h_pixels = p->h_pixels;
+}
+
+static int open_view(view *v) {
     // Create window
-    window = SDL_CreateWindow("Digital RGB Display", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, DW, DH * 2, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
-    if (window == NULL) {
+    v->window = SDL_CreateWindow("Digital RGB Display", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, DW, DH * 2, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+    if (v->window == NULL) {
         ::MessageBoxA(NULL, "Window could not be created", NULL, MB_OK);
         return -1;
     }
 
-    Renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    if (Renderer == NULL) {
+    v->renderer = SDL_CreateRenderer(v->window, -1, SDL_RENDERER_ACCELERATED);
+    if (v->renderer == NULL) {
         ::MessageBoxA(NULL, "Coould not create renderer", NULL, MB_OK);
         return -1;
     }
-    SDL_SetRenderDrawColor(Renderer, 0x00, 0x00, 0x00, 0xff);
-    SDL_RenderClear(Renderer);
-    Palette = SDL_AllocPalette(8);
-    screenSurface = SDL_CreateRGBSurface(0, DW, DH, 8, 0, 0, 0, 0);
-
-    uint8_t d = 0;
-    uint8_t vmask = 1 << BIT_VSYNC;
-    uint8_t hmask = 1 << BIT_HSYNC;
-    uint8_t vhmask = vmask | hmask;
-    LONG len;
-    SDL_Color aColor;
-
-    aColor.a = 0xff;
-    aColor.r = 0x00;
-    aColor.g = 0x00;
-    aColor.b = 0x00;
-    SDL_SetPaletteColors(Palette, &aColor, 0, 1);
-    aColor.r = 0x00;
-    aColor.g = 0x00;
-    aColor.b = 0xff;
-    SDL_SetPaletteColors(Palette, &aColor, 1, 1);
-    aColor.r = 0x00;
-    aColor.g = 0xff;
-    aColor.b = 0x00;
-    SDL_SetPaletteColors(Palette, &aColor, 2, 1);
-    aColor.r = 0x00;
-    aColor.g = 0xff;
-    aColor.b = 0xff;
-    SDL_SetPaletteColors(Palette, &aColor, 3, 1);
-    aColor.r = 0xff;
-    aColor.g = 0x00;
-    aColor.b = 0x00;
-    SDL_SetPaletteColors(Palette, &aColor, 4, 1);
-    aColor.r = 0xff;
-    aColor.g = 0x00;
-    aColor.b = 0xff;
-    SDL_SetPaletteColors(Palette, &aColor, 5, 1);
-    aColor.r = 0xff;
-    aColor.g = 0xff;
-    aColor.b = 0x00;
-    SDL_SetPaletteColors(Palette, &aColor, 6, 1);
-    aColor.r = 0xff;
-    aColor.g = 0xff;
-    aColor.b = 0xff;
-    SDL_SetPaletteColors(Palette, &aColor, 7, 1);
-
-    SDL_SetSurfacePalette(screenSurface, Palette);
-    SDL_Event e;
+    SDL_SetRenderDrawColor(v->renderer, 0x00, 0x00, 0x00, 0xff);
+    SDL_RenderClear(v->renderer);
+
+    // One texture for the session, frames are converted into its locked memory
+    v->texture = SDL_CreateTexture(v->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, DW, DH);
+    if (v->texture == NULL) {
+        ::MessageBoxA(NULL, "Could not create texture", NULL, MB_OK);
+        return -1;
+    }
+    v->shown_h_pixels = -1;
+    v->last_time = timeGetTime();
+    return 0;
+}
 
-    v_porch = 36;
-    h_porch = 128;
+static void close_view(view *v) {
+    if (v->texture != NULL) {
+        SDL_DestroyTexture(v->texture);
+    }
+    if (v->renderer != NULL) {
+        SDL_DestroyRenderer(v->renderer);
+    }
+    if (v->window != NULL) {
+        SDL_DestroyWindow(v->window);
+    }
+}
 
-    h_pixels = 896;  // 896.. X1/turbo,  912 for Pasopia7;
+// Show the newest complete frame of the pipeline, older ones are skipped.
+// Static screens need neither an upload nor a present. Returns false if
+// there was nothing new.
+static bool update_view(view *v, const uint32_t *lut) {
+    pipeline *p = v->p;
+    bool updated = false;
+
+    const frame *f = p->frames.acquire(0);
+    const frame *presented = NULL;
+    if (f != NULL) {
+        updated = true;
+        p->server.publish(f->pixels, f->seq);
+        if (band_lines > 0 ? upload_rows(v, f->pixels, 0, DH, lut) : update_texture(v->texture, f, lut)) {
+            v->redraw = true;
+            presented = f;
+        } else if (band_lines == 0) {
+            v->unchanged++;
+        }
+    }
 
-    memset(&ov_ep1, 0, sizeof(ov_ep1));
-    ev_ep1 = ::CreateEvent(NULL, false, false, NULL);
-    ov_ep1.hEvent = ev_ep1;
+    // Band presentation: the complete rows of the frame being decoded.
+    // Rows overwritten while being copied are dropped, the published
+    // frame brings them.
+    if (band_lines > 0 && p->frames.band(&v->band)) {
+        updated = true;
+        if (v->band.rows > 0) {
+            memcpy(v->band_buf, v->band.pixels, (size_t)v->band.rows * DW);
+            if (p->frames.band_valid(&v->band) && upload_rows(v, v->band_buf, 0, v->band.rows, lut)) {
+                v->redraw = true;
+                v->band_arrival = v->band.arrival_us;
+            }
+        }
+    }
 
-    while (usb_run_flag) {
-        // Wait V-Sync
-        while (READ() & vmask)
-            ; // wait untill low
-        while (!(READ() & vmask))
-            ; // wait untill hi
+    if (v->redraw) {
+        SDL_RenderCopy(v->renderer, v->texture, NULL, NULL);
+        SDL_RenderPresent(v->renderer);
+        v->redraw = false;
 
-        // Skip V-Sync back porch
-        for (int i = 0; i < v_porch; i++) {
-            while (READ() & hmask)
-                ; // wait untill low
-            while (!(READ() & hmask))
-                ; // wait untill hi
+        uint64_t now = telemetry_now_us();
+        if (presented != NULL) {
+            p->stats.present_latency.add(now - presented->published_us);
+        }
+        if (v->band_arrival != 0) {
+            p->stats.band_latency.add(now - v->band_arrival);
+            v->band_sum_us += now - v->band_arrival;
+            v->band_count++;
+            v->band_arrival = 0;
         }
+    }
+    log_metrics(p);
+
+    DWORD now = timeGetTime();
+    if (now - v->last_time >= 1000 || p->h_pixels != v->shown_h_pixels) {
+        set_title(v, now);
+        v->last_decoded = p->frames.decoded();
+        v->last_presented = p->frames.presented();
+        v->last_time = now;
+    }
+    return updated;
+}
 
-        int x, y;
+DWORD WINAPI draw_run(void *arg) {
+    std::vector<view *> views;
+    frame_signal signal;      // Rung by the frame pools of all the views
 
-        uint8_t *vram = (uint8_t *)screenSurface->pixels;
-        uint8_t *p = vram;
+    // Initialize SDL
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        ::MessageBoxA(NULL, "SDL could not initialize", NULL, MB_OK);
+        return -1;
+    }
+    for (pipeline *p : pipes) {
+        view *v = new view();
+        v->p = p;
+        views.push_back(v);
+        if (open_view(v) < 0) {
+            return -1;
+        }
+        p->frames.attach(&signal);
+    }
+    uint32_t lut[PALETTE_SIZE];
+    palette_argb8888(palette_rgb, lut);
 
-        for (y = 0; y < DH; y++) {
-            // Wait H-Sync
-            while (READ() & hmask)
-                ; // wait untill low
-            while (!(READ() & hmask))
-                ; // wait untill hi
+    SDL_Event e;
 
-            // Skip H-Sync back porch
-            for (x = 0; x < h_porch - 1; x++) {
-#ifdef USE_CP2300
-                READ();
-#endif
-                READ();
-            }
-            p = &vram[y * DW];
-            for (x = 0; x < DW; x++) {
-#ifdef USE_CP2300
-                READ();
-#endif
-                d = READ();
-                if ((~d) & vhmask) {
-                    y = DH; // Sync is lost, skip this frame
-                    break;
-                }
-                *p++ = d & 7;
+    // Window of an event, NULL if it is none of ours
+    auto find_view = [&](Uint32 window_id) -> view * {
+        for (view *v : views) {
+            if (SDL_GetWindowID(v->window) == window_id) {
+                return v;
             }
         }
+        return NULL;
+    };
 
+    auto poll_events = [&]() {
         while (SDL_PollEvent(&e) != 0) {
             if (e.type == SDL_QUIT) {
-                usb_run_flag = 0;
+                ui_run_flag = 0;
+            } else if (e.type == SDL_WINDOWEVENT) {
+                view *v = find_view(e.window.windowID);
+                if (e.window.event == SDL_WINDOWEVENT_CLOSE) {
+                    ui_run_flag = 0;  // Any window ends all of them
+                } else if (v != NULL) {
+                    v->redraw = true;  // Exposed, resized, ...
+                }
             } else if (e.type == SDL_KEYDOWN) {
+                view *v = find_view(e.key.windowID);
+                if (v == NULL) {
+                    continue;
+                }
+                pipeline *p = v->p;
                 switch (e.key.keysym.sym) {
                 case SDLK_UP:
-                    v_porch++;
+                    p->req_v_porch++;
                     break;
                 case SDLK_DOWN:
-                    v_porch--;
+                    p->req_v_porch--;
                     break;
 
                 case SDLK_LEFT:
-                    h_porch++;
+                    p->req_h_porch++;
                     break;
                 case SDLK_RIGHT:
-                    h_porch--;
+                    p->req_h_porch--;
                     break;
 
 #ifdef USE_CP2300
                 case SDLK_a:
-                    h_pixels++;
-                    set_pll();					
-                    set_title();
+                    p->req_h_pixels++;
                     break;
 
                 case SDLK_s:
-                    h_pixels--;
-                    set_pll();
-                    set_title();
+                    p->req_h_pixels--;
+                    break;
+
+                case SDLK_t:
+                    p->req_h_tune = 1;
                     break;
 #endif
 
                 case SDLK_x:
-                    restart_usb();
+                    p->req_restart = 1;
+                    break;
+
+                case SDLK_c:
+                    p->req_calib = 1;
                     break;
 
                 default:
@@ -475,98 +1116,410 @@ DWORD WINAPI draw_run(void *arg) {
                 }
             }
         }
-        Texture = SDL_CreateTextureFromSurface(Renderer, screenSurface);
-        SDL_RenderCopy(Renderer, Texture, NULL, NULL);
-        SDL_DestroyTexture(Texture);
-        SDL_RenderPresent(Renderer);
+    };
+
+    if (start_decoders() < 0) {
+        ::MessageBoxA(NULL, "Could not create the decode thread", NULL, MB_OK);
+        join_decoders();
+        return -1;
+    }
+
+    while (ui_run_flag) {
+        poll_events();
+
+        // Sleep until one of the pipelines has something new
+        uint64_t seen = signal.value();
+        bool updated = false;
+        for (view *v : views) {
+            updated |= update_view(v, lut);
+        }
+        if (!updated) {
+            signal.wait(seen, 10);
+        }
     }
 
+    join_decoders();
+
     // gI
-    SDL_DestroyWindow(window);
+    for (view *v : views) {
+        close_view(v);
+        delete v;
+    }
     SDL_Quit();
+    return 0;
+}
+
+//----------------------------------------------------------------------
+// Headless output
+//----------------------------------------------------------------------
+static BOOL WINAPI ctrl_handler(DWORD type) {
+    // Ctrl+C / close: finish the output cleanly
+    ui_run_flag = 0;
+    return TRUE;
+}
+
+// Write every frame of a pipeline as it is published, no SDL at all. The
+// thread sleeps in the frame pool between frames.
+DWORD WINAPI sink_run(void *arg) {
+    pipeline *p = (pipeline *)arg;
+    frame_sink sink;
+    char name[16];
+
+    if (sink.open(p->sink_path, sink_format, sink_every, sink_fps, palette_rgb) < 0) {
+        ui_run_flag = 0;
+        return -1;
+    }
+
+    while (ui_run_flag) {
+        const frame *f = p->frames.acquire(100);
+        if (f == NULL) {
+            continue;
+        }
+        p->server.publish(f->pixels, f->seq);
+        if (sink.write(f->pixels, f->seq) < 0) {
+            ui_run_flag = 0;  // Nobody reads the frames any more
+        }
+        p->stats.present_latency.add(telemetry_now_us() - f->published_us);
+        log_metrics(p);
+    }
+    sink.close();
+
+    fprintf(stderr, "%s%llu frames decoded, %llu written, %llu skipped\n", pipeline_name(p, name, sizeof(name)),
+            (unsigned long long)p->frames.decoded(), (unsigned long long)sink.frames(),
+            (unsigned long long)p->frames.skipped());
+    return 0;
+}
+
+int headless_run(void) {
+    ::SetConsoleCtrlHandler(ctrl_handler, TRUE);
+
+    int ret = start_decoders();
+    if (ret < 0) {
+        fprintf(stderr, "Could not create the decode thread\n");
+    }
+    for (pipeline *p : pipes) {
+        if (ret == 0 && (p->h_sink_thread = ::CreateThread(NULL, 0, sink_run, p, 0, NULL)) == NULL) {
+            fprintf(stderr, "Could not create the output thread\n");
+            ui_run_flag = 0;
+            ret = -1;
+        }
+    }
 
-    ::CloseHandle(ov_ep1.hEvent);
+    for (pipeline *p : pipes) {
+        if (p->h_sink_thread != NULL) {
+            ::WaitForSingleObject(p->h_sink_thread, INFINITE);
+            ::CloseHandle(p->h_sink_thread);
+        }
+    }
+    join_decoders();
+    return ret;
 }
 
 //======================================================================
 // Main
 //======================================================================
-int main(int argc, char *argv[]) {
-    setvbuf(stdout, (char *)NULL, _IONBF, 0);
-    int ret;
-    USBDevice = new CCyUSBDevice(NULL);
-
-    // Initialize USB
-    int devices = USBDevice->DeviceCount();
-    int index = 0;
-
-    do {
-        USBDevice->Open(index);
-        if (USBDevice->VendorID == VID && USBDevice->ProductID == PID)
-            break;
-        index++;
-    } while (index < devices);
+// "[addr:]port", addr is left as it is when omitted. Returns the port.
+static int parse_endpoint(const char *spec, char *addr, size_t size) {
+    const char *colon = strrchr(spec, ':');
+    if (colon != NULL) {
+        snprintf(addr, size, "%.*s", (int)(colon - spec), spec);
+        spec = colon + 1;
+    }
+    return atoi(spec);
+}
 
-    if (devices == 0 || index == devices) {
-        ::MessageBoxA(NULL, "EZ-USB is not connected.", "Digital RGB Display", MB_OK);
+// "KiB[,n]", n is left as it is when omitted. Returns 0 on success.
+static int parse_xfer(const char *spec, xfer_setting *s) {
+    int kib, num = s->num;
+    if (sscanf(spec, "%d,%d", &kib, &num) < 1) {
+        return -1;
+    }
+    if (kib * 1024 < XFER_SIZE_MIN || kib * 1024 > XFER_SIZE_MAX || num < XFER_NUM_MIN || num > XFER_NUM_MAX) {
         return -1;
     }
+    s->size = kib * 1024;
+    s->num = num;
+    return 0;
+}
 
-    // Search endpoints
-    USBDevice->SetAltIntfc(1);
+// "n,n,..." of values in [0, limit), each only once if unique. Returns 0
+// on success.
+static int parse_list(const char *spec, int limit, bool unique, std::vector<int> *list) {
+    list->clear();
+    while (*spec != '\0') {
+        char *end;
+        long n = strtol(spec, &end, 10);
+        if (end == spec || n < 0 || n >= limit || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        for (int m : *list) {
+            if (unique && m == n) {
+                return -1;
+            }
+        }
+        list->push_back((int)n);
+        spec = (*end == ',') ? end + 1 : end;
+    }
+    return list->empty() ? -1 : 0;
+}
 
-    cep = USBDevice->ControlEndPt;
-    assert(cep != NULL);
+// CyAPI indices of the connected EZ-USB devices
+static void find_usb(std::vector<int> *found) {
+    CCyUSBDevice probe(NULL);
+    int devices = probe.DeviceCount();
 
-    for (index = 0; index < USBDevice->EndPointCount(); index++) {
-        CCyUSBEndPoint *p = USBDevice->EndPoints[index];
+    for (int index = 0; index < devices; index++) {
+        if (probe.Open(index) && probe.VendorID == VID && probe.ProductID == PID) {
+            found->push_back(index);
+        }
+        probe.Close();
+    }
+}
 
-        if (p->Address == 0x01) { // Bulk OUT
-            ep1 = dynamic_cast<CCyBulkEndPoint *>(p);
-        } else if (p->Address == 0x86) { // Bulk IN
-            ep6 = dynamic_cast<CCyBulkEndPoint *>(p);
+int main(int argc, char *argv[]) {
+    setvbuf(stdout, (char *)NULL, _IONBF, 0);
+    start_us = telemetry_now_us();
+    std::vector<const char *> replay_files;
+    double replay_rate = 0;
+    bool replay_loop = false;
+    uint64_t replay_seek = 0;
+    const char *dev_spec = "0";
+
+    // Options
+    //   -dev all|n,...  capture from these EZ-USB devices (0: the first found, default)
+    //   -pin cpu,...    pin the threads to cores: USB #0, decode #0, USB #1, decode #1, ...
+    //   -r file    replay a recorded raw "000VHRGB" file instead of USB (repeat for several)
+    //   -rate MBps pace the replay to the given byte rate (default: full speed)
+    //   -loop      repeat the replay file
+    //   -seek n    start the replay at frame n (compressed captures)
+    //   -w file    record the raw samples while viewing
+    //   -wz file   record the samples run-length compressed, with a seek index
+    //   -nocal     no automatic porch / polarity calibration
+    //   -reload    download the firmware even if the device runs this build already
+    //   -htotal n|auto  H_TOTAL of the source (PLL setting, default: as the firmware starts),
+    //                   auto: tune it on the live stream from 896
+    //   -palette RRGGBB,...  colors of the palette indices 0-7
+    //   -o file    headless: write the frames to file ("-": stdout), no window
+    //   -format f  raw (palette indices, default) / y4m
+    //   -every n   write every n-th frame only
+    //   -fps n     source frame rate stated in the Y4M header (default: 60)
+    //   -serve [addr:]port  stream the frames to netview (default addr: 127.0.0.1)
+    //   -band n             present every n lines as they are decoded (low latency)
+    //   -xfer KiB[,n]       USB transfer size and number of transfers in flight (default: 64,8)
+    //   -xfer auto          pick the smallest transfers which keep up with the stream
+    //   -stats sec          log the telemetry every sec seconds
+    //   -metrics [addr:]port  telemetry as Prometheus text over HTTP (default addr: 127.0.0.1)
+    // With several devices the output files get "-<device>" before the
+    // extension and the frame server of device n listens on port + n.
+    memcpy(palette_rgb, palette_default, sizeof(palette_rgb));
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-dev") && i + 1 < argc) {
+            dev_spec = argv[++i];
+        } else if (!strcmp(argv[i], "-pin") && i + 1 < argc) {
+            if (parse_list(argv[++i], 64, false, &pin_cpus) < 0) {
+                fprintf(stderr, "Bad CPU list: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            replay_files.push_back(argv[++i]);
+        } else if (!strcmp(argv[i], "-rate") && i + 1 < argc) {
+            replay_rate = atof(argv[++i]) * 1024.0 * 1024.0;
+        } else if (!strcmp(argv[i], "-loop")) {
+            replay_loop = true;
+        } else if (!strcmp(argv[i], "-seek") && i + 1 < argc) {
+            replay_seek = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            record_file = argv[++i];
+            record_rle = false;
+        } else if (!strcmp(argv[i], "-wz") && i + 1 < argc) {
+            record_file = argv[++i];
+            record_rle = true;
+        } else if (!strcmp(argv[i], "-nocal")) {
+            auto_calib = false;
+        } else if (!strcmp(argv[i], "-reload")) {
+            force_reload = true;
+        } else if (!strcmp(argv[i], "-htotal") && i + 1 < argc) {
+            if (!strcmp(argv[++i], "auto")) {
+                h_total_auto = true;
+            } else if ((h_total = atoi(argv[i])) < PLL_TUNE_MIN || h_total > PLL_TUNE_MAX) {
+                fprintf(stderr, "Bad H_TOTAL: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-palette") && i + 1 < argc) {
+            if (palette_parse(argv[++i], palette_rgb) < 0) {
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            sink_file = argv[++i];
+        } else if (!strcmp(argv[i], "-format") && i + 1 < argc) {
+            sink_format = frame_sink_format(argv[++i]);
+            if (sink_format < 0) {
+                fprintf(stderr, "Unknown format: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-every") && i + 1 < argc) {
+            sink_every = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-fps") && i + 1 < argc) {
+            sink_fps = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-serve") && i + 1 < argc) {
+            serve_port = parse_endpoint(argv[++i], serve_addr, sizeof(serve_addr));
+        } else if (!strcmp(argv[i], "-band") && i + 1 < argc) {
+            band_lines = atoi(argv[++i]);
+            if (band_lines < 0 || band_lines > DH) {
+                fprintf(stderr, "Bad band height: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-xfer") && i + 1 < argc) {
+            if (!strcmp(argv[++i], "auto")) {
+                xfer_auto = true;
+            } else if (parse_xfer(argv[i], &xfer) < 0) {
+                fprintf(stderr, "Bad transfer setting: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-stats") && i + 1 < argc) {
+            stats_interval = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-metrics") && i + 1 < argc) {
+            metrics_port = parse_endpoint(argv[++i], metrics_addr, sizeof(metrics_addr));
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return -1;
         }
     }
 
-    // load firmware
-    //printf("Main: Firmware download...");
-    if (usb_load_firmware(firmware) >= 0) {
-        //puts("finished.");
+    if (!replay_files.empty()) {
+        for (const char *file : replay_files) {
+            pipeline *p = pipeline_create();
+            p->capture = capture_file_create(file, replay_rate, replay_loop, replay_seek, &p->replay_info);
+        }
     } else {
-        ::MessageBoxA(NULL, "Firmware downloading failed.", "Digital RGB Display", MB_OK);
+        std::vector<int> found, chosen;
+        find_usb(&found);
+        if (found.empty()) {
+            ::MessageBoxA(NULL, "EZ-USB is not connected.", "Digital RGB Display", MB_OK);
+            return -1;
+        }
+        if (!strcmp(dev_spec, "all")) {
+            for (size_t i = 0; i < found.size(); i++) {
+                chosen.push_back((int)i);
+            }
+        } else if (parse_list(dev_spec, (int)found.size(), true, &chosen) < 0) {
+            // One device in two pipelines would split its stream between them
+            fprintf(stderr, "Bad device list: %s (%d EZ-USB connected)\n", dev_spec, (int)found.size());
+            return -1;
+        }
+        for (int n : chosen) {
+            pipeline *p = pipeline_create();
+            if (open_usb(p, found[n]) < 0) {
+                return -1;
+            }
+            p->capture = new usb_source(p);
+            p->stats.usb_xfer_size.store(p->xfer.size, std::memory_order_relaxed);
+            p->stats.usb_xfer_num.store(p->xfer.num, std::memory_order_relaxed);
+        }
+    }
+    if (sink_file != NULL && !strcmp(sink_file, "-") && pipes.size() > 1) {
+        fprintf(stderr, "Main: stdout takes the frames of one device only\n");
         return -1;
     }
 
-    ::InitializeCriticalSection(&received_size_section);
-    usb_cond = ::CreateEventA(NULL, TRUE, FALSE, NULL);
-    ::ResetEvent(usb_cond);
+    for (pipeline *p : pipes) {
+        if (record_file != NULL) {
+            pipeline_path(p, record_file, p->record_path, sizeof(p->record_path));
+        }
+        if (sink_file != NULL) {
+            pipeline_path(p, sink_file, p->sink_path, sizeof(p->sink_path));
+        }
+        if (p->capture->open() < 0 || p->capture->start() < 0) {
+            MessageBoxA(NULL, "Main: Failed to start capture", "Digital RGB Display", MB_OK);
+            return -1;
+        }
+        if (serve_port > 0 && p->server.start(serve_addr, serve_port + p->id, palette_rgb) < 0) {
+            MessageBoxA(NULL, "Main: Failed to start the frame server", "Digital RGB Display", MB_OK);
+            return -1;
+        }
+    }
+    if (metrics_port > 0 && metrics_http.start(metrics_addr, metrics_port, render_metrics) < 0) {
+        MessageBoxA(NULL, "Main: Failed to start the metrics endpoint", "Digital RGB Display", MB_OK);
+        return -1;
+    }
+
+    if (sink_file != NULL) {
+        headless_run();
+    } else {
+        draw_run(NULL);
+    }
+    metrics_http.stop();
+    for (pipeline *p : pipes) {
+        p->server.stop();
+    }
+
+    finalize();
+
+    for (pipeline *p : pipes) {
+        delete p->capture;
+        delete p->control;
+        delete p->port;
+        delete p->usb;
+        delete p;
+    }
+}
 
-    h_usb_thread = ::CreateThread(NULL, 0, usb_run, NULL, 0, NULL);
+//----------------------------------------------------------------------
+// Open EZ-USB and download the firmware
+//----------------------------------------------------------------------
+int open_usb(pipeline *p, int index) {
+    p->usb = new CCyUSBDevice(NULL);
 
-    if (h_usb_thread == INVALID_HANDLE_VALUE) {
-        MessageBoxA(NULL, "Main: Failed to start USB thread", "Digital RGB Display", MB_OK);
+    // Initialize USB
+    if (!p->usb->Open(index)) {
+        ::MessageBoxA(NULL, "EZ-USB could not be opened.", "Digital RGB Display", MB_OK);
         return -1;
     }
 
-    draw_run(NULL);
+    // Search endpoints
+    p->usb->SetAltIntfc(1);
 
-    finalize();
+    p->cep = p->usb->ControlEndPt;
+    assert(p->cep != NULL);
 
-    delete USBDevice;
+    CCyBulkEndPoint *ep1in = NULL;
+    for (int i = 0; i < p->usb->EndPointCount(); i++) {
+        CCyUSBEndPoint *ep = p->usb->EndPoints[i];
+
+        if (ep->Address == 0x01) { // Bulk OUT
+            p->ep1 = dynamic_cast<CCyBulkEndPoint *>(ep);
+        } else if (ep->Address == 0x81) { // Bulk IN (command replies)
+            ep1in = dynamic_cast<CCyBulkEndPoint *>(ep);
+        } else if (ep->Address == 0x86) { // Bulk IN
+            p->ep6 = dynamic_cast<CCyBulkEndPoint *>(ep);
+        }
+    }
+
+    // load firmware, unless this build runs already
+    p->port = new cyusb_port(p->cep, p->ep1, ep1in);
+    fw_view fw = fw_view_of(firmware, firmware_protocol);
+    fx2_boot_result boot;
+    if (fx2_boot(p->port, &fw, force_reload, &boot) < 0) {
+        ::MessageBoxA(NULL, "Firmware downloading failed.", "Digital RGB Display", MB_OK);
+        return -1;
+    }
+    if (boot.skipped) {
+        fprintf(stderr, "USB: Firmware of device %d: build %016llx running, not downloaded, %.1f ms\n", p->id,
+                (unsigned long long)fw.hash, boot.ms);
+    } else {
+        fprintf(stderr, "USB: Firmware of device %d: %d bytes in %d requests (up to %d bytes), %.1f ms\n", p->id,
+                fw.bytes, boot.requests, boot.chunk, boot.ms);
+    }
+    p->control = new fx2_control(p->port);
+
+    return 0;
 }
 
 void finalize() {
     //puts("\nMain: Finalizing...");
 
-    usb_closed_flag = 1;
-
-    if(::WaitForSingleObject(h_usb_thread, 1000) != WAIT_OBJECT_0){
-           //perror("Main: Failed to join USB thread.");
-    } else {
-        //puts("Main: USB thread joined.");
+    for (pipeline *p : pipes) {
+        p->capture->stop();
     }
     //puts("Main: USB device closed.");
-
-    CloseHandle(h_usb_thread);
-    CloseHandle(usb_cond);
 }
@@ -10,6 +10,16 @@
 #include "fx2regs.h"
 #include "syncdly.h"
 
+// Version of the EP1 command set, reported by Identify
+// 2: sequence number as the last byte, stream marker on resume
+#define FW_PROTOCOL 2
+
+// Identity slot at the end of the scratch RAM. The host writes the magic
+// and the build hash of the image there along with the image, and reads it
+// back with Identify to find this build already running.
+#define ID_SLOT_SIZE 16
+volatile __xdata __at (0xE1F0) BYTE id_slot[ID_SLOT_SIZE];
+
 void Initialize() {
     // ----------------------------------------------------------------------
     // CPU Clock
@@ -53,7 +63,7 @@ void Initialize() {
     // bit1:0 00=Quad, 01=Invalid, 10=Double, 11=Triple
     EP1OUTCFG = 0xa0; //0b1010_0000  // Valid, Bulk
     SYNCDELAY;
-    EP1INCFG = 0x7f; // disable
+    EP1INCFG = 0xa0; //0b1010_0000  // Valid, Bulk (command replies)
     SYNCDELAY;
     EP2CFG &= 0x7f; // disable
     SYNCDELAY;
@@ -205,8 +215,19 @@ void ResetFifo(void)
     SYNCDELAY;
 }
 
-void ResumeFifo(void)
+// Marker packet in front of the new samples: 0xff never occurs in them,
+// and as a short packet it ends the transfer pending on the host
+void ResumeFifo(BYTE command, BYTE seq)
 {
+    EP6FIFOBUF[0] = 0xff;
+    EP6FIFOBUF[1] = 0xff;
+    EP6FIFOBUF[2] = command;
+    EP6FIFOBUF[3] = seq;
+    EP6BCH = 0;
+    SYNCDELAY;
+    EP6BCL = 4;        // Commit (still NAKed until resumed)
+    SYNCDELAY;
+
     EP6FIFOCFG = 0x0C; // MANUAL mode
     SYNCDELAY;
     FIFORESET = 0x00; // Resume
@@ -218,6 +239,7 @@ void ProcessCommand(void)
     unsigned char *src = EP1OUTBUF;
     unsigned int len = ((int) EP1OUTBC);
     unsigned char command = *(src++);
+    BYTE seq = (len > 1) ? EP1OUTBUF[len - 1] : 0;  // Last byte
 
     IOA = 0x03;
 
@@ -229,13 +251,26 @@ void ProcessCommand(void)
             SendPLL(0x08, *(src++));
             SendPLL(0x09, *(src++));
             WaitPllLock();
-            ResumeFifo();
+            ResumeFifo(command, seq);
             break;
         case 0x02:
             ResetFifo();
             WaitPllLock();
-            ResumeFifo();
+            ResumeFifo(command, seq);
+            break;
+        case 0x03:  // Identify, the stream goes on
+        {
+            BYTE i;
+            while(EP1INCS & bmEPBUSY);
+            EP1INBUF[0] = 0x03;
+            EP1INBUF[1] = FW_PROTOCOL;
+            for(i = 0; i < ID_SLOT_SIZE; i++){
+                EP1INBUF[2 + i] = id_slot[i];
+            }
+            EP1INBC = 2 + ID_SLOT_SIZE;
+            SYNCDELAY;
             break;
+        }
     }
 
     IOA = 0x01;
@@ -0,0 +1,128 @@
+//
+// Triple buffered frames between the decoder and the presenter
+//
+#include "framepool.h"
+#include "telemetry.h"
+
+#include <chrono>
+#include <string.h>
+
+frame_pool::frame_pool()
+    : back_index(0), front_index(2), middle(1), progress_word(0), progress_arrival(0), n_decoded(0), n_presented(0), n_skipped(0), signal(NULL), waiting(0) {
+    memset(frames, 0, sizeof(frames));
+}
+
+//----------------------------------------------------------------------
+// Producer
+//----------------------------------------------------------------------
+void frame_pool::publish(void) {
+    frame *f = &frames[back_index];
+    f->seq = n_decoded.load(std::memory_order_relaxed) + 1;
+    f->published_us = telemetry_now_us();
+
+    // The rows changed in a frame which is never taken are still to be
+    // updated by the consumer. It may take the middle frame meanwhile,
+    // then the exchange fails and the frame has not been skipped.
+    int old = middle.load(std::memory_order_seq_cst);
+    do {
+        memcpy(f->changed, f->dirty, sizeof(f->changed));
+        if (old & FRESH) {
+            const frame *m = &frames[old & ~FRESH];
+            for (int i = 0; i < DIRTY_WORDS; i++) {
+                f->changed[i] |= m->changed[i];
+            }
+        }
+    } while (!middle.compare_exchange_weak(old, back_index | FRESH, std::memory_order_seq_cst));
+
+    if (old & FRESH) {
+        n_skipped.fetch_add(1, std::memory_order_relaxed);
+    }
+    back_index = old & ~FRESH;
+    n_decoded.fetch_add(1, std::memory_order_relaxed);
+
+    // Wake the consumer only if it sleeps
+    if (waiting.load(std::memory_order_seq_cst)) {
+        std::lock_guard<std::mutex> guard(lock);
+        cond.notify_one();
+    }
+    if (signal != NULL) {
+        signal->notify();
+    }
+}
+
+// Rows and the buffer index are packed below the sequence number
+static_assert(DH < (1 << 16), "progress_word has 16 bits for the rows");
+
+void frame_pool::progress(int rows, uint64_t arrival_us) {
+    uint64_t seq = n_decoded.load(std::memory_order_relaxed) + 1;
+
+    progress_arrival.store(arrival_us, std::memory_order_relaxed);
+    progress_word.store(seq << 24 | (uint64_t)back_index << 16 | (uint64_t)rows, std::memory_order_seq_cst);
+
+    if (waiting.load(std::memory_order_seq_cst)) {
+        std::lock_guard<std::mutex> guard(lock);
+        cond.notify_one();
+    }
+    if (signal != NULL) {
+        signal->notify();
+    }
+}
+
+//----------------------------------------------------------------------
+// Consumer
+//----------------------------------------------------------------------
+const frame *frame_pool::acquire(int timeout_ms) {
+    if (!(middle.load(std::memory_order_acquire) & FRESH)) {
+        if (timeout_ms <= 0) {
+            return NULL;
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        waiting.store(1, std::memory_order_seq_cst);
+        bool fresh = cond.wait_for(guard, std::chrono::milliseconds(timeout_ms), [&] {
+            return (middle.load(std::memory_order_seq_cst) & FRESH) != 0;
+        });
+        waiting.store(0, std::memory_order_relaxed);
+        if (!fresh) {
+            return NULL;
+        }
+    }
+
+    int old = middle.exchange(front_index, std::memory_order_acq_rel);
+    front_index = old & ~FRESH;
+    n_presented.fetch_add(1, std::memory_order_relaxed);
+    return &frames[front_index];
+}
+
+int frame_pool::band(frame_band *band) {
+    uint64_t w = progress_word.load(std::memory_order_acquire);
+    if (w == band->word) {
+        return 0;
+    }
+    band->word = w;
+    band->seq = w >> 24;
+    band->pixels = frames[(w >> 16) & 0xff].pixels;
+    band->rows = (int)(w & 0xffff);
+    band->arrival_us = progress_arrival.load(std::memory_order_relaxed);
+    return 1;
+}
+
+//----------------------------------------------------------------------
+// Signal shared by several pools
+//----------------------------------------------------------------------
+uint64_t frame_signal::value(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return count;
+}
+
+void frame_signal::wait(uint64_t seen, int timeout_ms) {
+    std::unique_lock<std::mutex> guard(lock);
+    cond.wait_for(guard, std::chrono::milliseconds(timeout_ms), [&] { return count != seen; });
+}
+
+void frame_signal::notify(void) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        count++;
+    }
+    cond.notify_all();
+}
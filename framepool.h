@@ -0,0 +1,131 @@
+//
+// Triple buffered frames between the decoder and the presenter
+//
+// The decoder fills the back frame and publishes it, the presenter takes
+// the newest published frame. Neither side waits for the other: frames
+// published faster than they are presented replace each other and are
+// counted as skipped.
+//
+// For band presentation the decoder also reports the rows of the back
+// frame which are complete. The presenter copies them out while the frame
+// is still being decoded and checks afterwards (band_valid()) that the
+// buffer has not been reused meanwhile.
+//
+// A consumer of several pools (one window per capture device) sleeps on a
+// frame_signal shared by them instead of on one of the pools.
+//
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include "decoder.h"
+
+struct frame {
+    uint8_t pixels[DW * DH];        // Palette indices
+    uint64_t dirty[DIRTY_WORDS];    // Rows which differ from the previous frame (by the decoder)
+    uint64_t changed[DIRTY_WORDS];  // Rows which differ from the frame taken before,
+                                    // i.e. dirty plus the rows of skipped frames
+    uint64_t seq;                   // Decoded frame number (1, 2, ...)
+    uint64_t published_us;          // When it was published (telemetry_now_us())
+};
+
+// Complete rows of the frame being decoded
+struct frame_band {
+    uint64_t word;            // As reported (seq << 24 | buffer << 16 | rows)
+    const uint8_t *pixels;
+    uint64_t seq;             // Frame number it will have
+    int rows;                 // Rows [0, rows) are complete
+    uint64_t arrival_us;      // When their last sample arrived (telemetry_now_us())
+};
+
+// Rung by every pool attached to it on publish() and progress()
+class frame_signal {
+public:
+    frame_signal() : count(0) {}
+
+    // Number of rings so far, taken before looking into the pools
+    uint64_t value(void);
+
+    // Wait up to timeout_ms for a ring after value() returned seen
+    void wait(uint64_t seen, int timeout_ms);
+
+    void notify(void);
+
+private:
+    uint64_t count;
+    std::mutex lock;
+    std::condition_variable cond;
+};
+
+class frame_pool {
+public:
+    frame_pool();
+
+    // Also ring signal on every update (before the consumer starts)
+    void attach(frame_signal *s) { signal = s; }
+
+    //------------------------------------------------------------------
+    // Producer
+    //------------------------------------------------------------------
+    // Frame being decoded
+    frame *back(void) { return &frames[back_index]; }
+
+    // The back frame is complete, it becomes the newest one and back()
+    // moves to another buffer. Its dirty rows must be filled in.
+    void publish(void);
+
+    // Rows [0, rows) of the back frame are complete, their last sample
+    // arrived at arrival_us
+    void progress(int rows, uint64_t arrival_us);
+
+    //------------------------------------------------------------------
+    // Consumer
+    //------------------------------------------------------------------
+    // Wait up to timeout_ms for a frame newer than the last one taken.
+    // Returns NULL on timeout (at once if timeout_ms is 0). The frame stays
+    // valid until the next call.
+    const frame *acquire(int timeout_ms);
+
+    // The newest progress into *band. Returns 0 if it is the same as before.
+    int band(frame_band *band);
+
+    // The rows of *band read so far are intact (the buffer is reused only
+    // after the next frame is published)
+    bool band_valid(const frame_band *band) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return n_decoded.load(std::memory_order_relaxed) <= band->seq;
+    }
+
+    // Statistics
+    uint64_t decoded(void) const { return n_decoded.load(std::memory_order_relaxed); }
+    uint64_t presented(void) const { return n_presented.load(std::memory_order_relaxed); }
+    uint64_t skipped(void) const { return n_skipped.load(std::memory_order_relaxed); }
+
+private:
+    static const int FRESH = 4;   // The middle frame has not been taken yet
+
+    frame frames[3];
+    int back_index;               // Producer only
+    int front_index;              // Consumer only
+    std::atomic<int> middle;      // Index of the newest published frame | FRESH
+    std::atomic<uint64_t> progress_word;
+    std::atomic<uint64_t> progress_arrival;
+
+    std::atomic<uint64_t> n_decoded;
+    std::atomic<uint64_t> n_presented;
+    std::atomic<uint64_t> n_skipped;
+
+    // Sleeping consumer
+    frame_signal *signal;
+    std::atomic<int> waiting;
+    std::mutex lock;
+    std::condition_variable cond;
+};
+
+#endif
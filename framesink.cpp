@@ -0,0 +1,122 @@
+//
+// Headless frame output
+//
+#include "framesink.h"
+#include "simd.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#define Y4M_FRAME "FRAME\n"
+#define Y4M_FRAME_LEN (sizeof(Y4M_FRAME) - 1)
+
+int frame_sink_format(const char *name) {
+    if (!strcmp(name, "raw")) {
+        return SINK_RAW;
+    } else if (!strcmp(name, "y4m")) {
+        return SINK_Y4M;
+    } else if (!strcmp(name, "vid")) {
+        return SINK_VID;
+    }
+    return -1;
+}
+
+int frame_sink::open(const char *path, int format, int every, int fps, const uint32_t rgb[PALETTE_SIZE]) {
+    this->format = format;
+    this->every = (every > 0) ? every : 1;
+    next_seq = 1;
+    written = 0;
+
+    if (format == SINK_VID) {
+        // The index goes to the end, the file must be seekable
+        if (!strcmp(path, "-")) {
+            fprintf(stderr, "Sink: The archive cannot be written to stdout\n");
+            return -1;
+        }
+        return archive.open(path, VID_KEYINT, fps, this->every, rgb);
+    }
+
+    if (!strcmp(path, "-")) {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        fp = stdout;
+    } else {
+        fp = fopen(path, "wb");
+        if (fp == NULL) {
+            fprintf(stderr, "Sink: Could not create %s\n", path);
+            return -1;
+        }
+    }
+    // A frame goes out in one write
+    setvbuf(fp, NULL, _IONBF, 0);
+
+    if (format == SINK_Y4M) {
+        buf = (uint8_t *)malloc(Y4M_FRAME_LEN + DW * DH * 3);
+        if (buf == NULL) {
+            close();
+            return -1;
+        }
+        memcpy(buf, Y4M_FRAME, Y4M_FRAME_LEN);
+        palette_yuv(rgb, lut_y, lut_u, lut_v);
+
+        // The lines are shown doubled, so the pixels are twice as tall as wide
+        if (fprintf(fp, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:2 C444\n", DW, DH, fps, this->every) < 0) {
+            close();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int frame_sink::write(const uint8_t *pixels, uint64_t seq) {
+    if (fp == NULL && format != SINK_VID) {
+        return -1;
+    }
+    if (seq < next_seq) {
+        return 0;
+    }
+    // Stay on the grid of every n-th frame, also across skipped frames
+    next_seq += (seq - next_seq) / every * every + every;
+
+    if (format == SINK_VID) {
+        if (archive.write(pixels, seq) < 0) {
+            return -1;
+        }
+        written++;
+        return 0;
+    }
+
+    size_t ret;
+    if (format == SINK_Y4M) {
+        uint8_t *plane = buf + Y4M_FRAME_LEN;
+        expand_palette8(pixels, plane, DW * DH, lut_y);
+        expand_palette8(pixels, plane + DW * DH, DW * DH, lut_u);
+        expand_palette8(pixels, plane + DW * DH * 2, DW * DH, lut_v);
+        ret = fwrite(buf, Y4M_FRAME_LEN + DW * DH * 3, 1, fp);
+    } else {
+        ret = fwrite(pixels, DW * DH, 1, fp);
+    }
+    if (ret != 1) {
+        fprintf(stderr, "Sink: Write failed, output stopped\n");
+        close();
+        return -1;
+    }
+    written++;
+    return 0;
+}
+
+void frame_sink::close(void) {
+    archive.close();
+    if (fp != NULL && fp != stdout) {
+        fclose(fp);
+    }
+    fp = NULL;
+    free(buf);
+    buf = NULL;
+}
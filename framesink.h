@@ -0,0 +1,61 @@
+//
+// Headless frame output
+//
+// Writes the decoded frames to a file or a pipe instead of the window,
+// for servers without a display and for feeding other tools. Every frame
+// has the screen layout (DW x DH, top row first).
+//
+#ifndef FRAMESINK_H
+#define FRAMESINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "decoder.h"
+#include "palette.h"
+#include "vidfile.h"
+
+// Output formats
+enum {
+    SINK_RAW,     // DW x DH palette indices (0..7) per frame, no header
+    SINK_Y4M,     // YUV4MPEG2, 4:4:4 planes of the palette colors
+    SINK_VID,     // Lossless archive (vidfile.h), not to a pipe
+};
+
+// "raw" / "y4m" / "vid" to SINK_*, -1 if unknown
+int frame_sink_format(const char *name);
+
+class frame_sink {
+public:
+    frame_sink() : fp(NULL), format(SINK_RAW), every(1), next_seq(1), written(0), buf(NULL) {}
+    ~frame_sink() { close(); }
+
+    // path "-" is stdout. Only every n-th source frame is written, fps is
+    // the source frame rate (the Y4M header states fps / every).
+    int open(const char *path, int format, int every, int fps, const uint32_t rgb[PALETTE_SIZE]);
+
+    // Frame seq (1, 2, ... as numbered by the decoder) unless it falls
+    // between the decimated ones. Returns -1 once the output is gone,
+    // e.g. the reader of the pipe has quit.
+    int write(const uint8_t *pixels, uint64_t seq);
+
+    void close(void);
+
+    uint64_t frames(void) const { return written; }
+
+private:
+    FILE *fp;
+    int format;
+    int every;
+    uint64_t next_seq;    // First source frame to write
+    uint64_t written;
+
+    // Y4M
+    uint8_t *buf;         // "FRAME\n" and the Y, U, V planes
+    uint8_t lut_y[PALETTE_SIZE], lut_u[PALETTE_SIZE], lut_v[PALETTE_SIZE];
+
+    vidfile_writer archive;
+};
+
+#endif
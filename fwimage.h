@@ -0,0 +1,204 @@
+//
+// EZ-USB firmware image, built from Intel HEX at compile time
+//
+// slave.inc holds the firmware as Intel HEX record strings. fw_measure()
+// and fw_parse() turn them into a binary image while compiling (C++14
+// constexpr): the checksums are verified, the data records are sorted by
+// address and the contiguous ones are merged into ranges, so that the
+// loader writes each range with as few control transfers as possible
+// instead of one request per record. The image also carries a hash of
+// its ranges, which identifies the build on a running device (fx2load.h).
+//
+//   static constexpr const char *hex[] = {
+//   #include "slave.inc"
+//   };
+//   static constexpr fw_size size = fw_measure(hex);
+//   static_assert(size.error == 0, "bad record");
+//   static constexpr fw_image<size.bytes, size.ranges> image = fw_parse<size.bytes, size.ranges>(hex);
+//
+#ifndef FWIMAGE_H
+#define FWIMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Contiguous bytes of the image
+struct fw_range {
+    uint16_t addr;        // EZ-USB RAM address
+    uint16_t size;
+    uint16_t offset;      // Into fw_image::data
+};
+
+struct fw_size {
+    int bytes;            // Data bytes
+    int ranges;           // Contiguous ranges
+    int error;            // 1 + index of the first bad record, 0 if none
+};
+
+template <int Bytes, int Ranges>
+struct fw_image {
+    uint8_t data[Bytes];
+    fw_range range[Ranges];
+    uint64_t hash;        // FNV-1a of the ranges (addresses, sizes, data)
+};
+
+// The same without the sizes in the type, for the loader, with the EP1
+// command set the firmware speaks (not in the records, see fx2load.h)
+struct fw_view {
+    const uint8_t *data;
+    const fw_range *range;
+    int ranges;
+    int bytes;
+    uint64_t hash;
+    int protocol;
+};
+
+template <int Bytes, int Ranges>
+fw_view fw_view_of(const fw_image<Bytes, Ranges> &image, int protocol) {
+    fw_view v = {image.data, image.range, Ranges, Bytes, image.hash, protocol};
+    return v;
+}
+
+#define FW_FNV_OFFSET 0xcbf29ce484222325ULL
+#define FW_FNV_PRIME 0x100000001b3ULL
+
+constexpr uint64_t fw_fnv(uint64_t h, int byte) {
+    return (h ^ (uint8_t)byte) * FW_FNV_PRIME;
+}
+
+// One record ":LLAAAATT<data>CC", type -1 if it is malformed
+struct fw_record {
+    int type;
+    int size;
+    int addr;
+    const char *data;     // Hex digits of the data
+};
+
+constexpr int fw_nibble(char c) {
+    return (c >= '0' && c <= '9') ? c - '0' : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+// Byte of two hex digits, -1 if they are not (never reads past a '\0')
+constexpr int fw_byte(const char *p) {
+    return (fw_nibble(p[0]) < 0) ? -1 : (fw_nibble(p[1]) < 0) ? -1 : fw_nibble(p[0]) << 4 | fw_nibble(p[1]);
+}
+
+constexpr fw_record fw_record_parse(const char *line) {
+    fw_record r = {-1, 0, 0, nullptr};
+    if (line[0] != ':') {
+        return r;
+    }
+    const char *p = line + 1;
+    int sum = 0;
+    for (int i = 0; i < 4; i++) {
+        int b = fw_byte(p + 2 * i);
+        if (b < 0) {
+            return r;
+        }
+        sum += b;
+    }
+    int size = fw_byte(p);
+    for (int i = 0; i <= size; i++) {   // Data and checksum
+        int b = fw_byte(p + 8 + 2 * i);
+        if (b < 0) {
+            return r;
+        }
+        sum += b;
+    }
+    if ((sum & 0xff) != 0 || p[10 + 2 * size] != '\0') {
+        return r;
+    }
+    r.type = fw_byte(p + 6);
+    r.size = size;
+    r.addr = fw_byte(p + 2) << 8 | fw_byte(p + 4);
+    r.data = p + 8;
+    return r;
+}
+
+// Indices of the non-empty data records in order of address
+template <size_t N>
+struct fw_order {
+    int index[N];
+    int n;
+    int error;
+};
+
+template <size_t N>
+constexpr fw_order<N> fw_sort(const char *const (&hex)[N]) {
+    fw_order<N> o = {};
+    for (size_t i = 0; i < N; i++) {
+        fw_record r = fw_record_parse(hex[i]);
+        if (r.type < 0) {
+            o.error = (int)i + 1;
+            return o;
+        }
+        if (r.type != 0 || r.size == 0) {
+            continue;   // End of file, extended addresses (not used by the FX2)
+        }
+        // Insertion sort, there are a few dozen records
+        int j = o.n++;
+        while (j > 0 && fw_record_parse(hex[o.index[j - 1]]).addr > r.addr) {
+            o.index[j] = o.index[j - 1];
+            j--;
+        }
+        o.index[j] = (int)i;
+    }
+    return o;
+}
+
+template <size_t N>
+constexpr fw_size fw_measure(const char *const (&hex)[N]) {
+    fw_size s = {0, 0, 0};
+    fw_order<N> o = fw_sort(hex);
+    if (o.error != 0) {
+        s.error = o.error;
+        return s;
+    }
+    int end = -1;     // Address after the last range
+    for (int k = 0; k < o.n; k++) {
+        fw_record r = fw_record_parse(hex[o.index[k]]);
+        if (r.addr < end) {
+            s.error = o.index[k] + 1;   // Overlaps the previous record
+            return s;
+        }
+        if (r.addr != end) {
+            s.ranges++;
+        }
+        s.bytes += r.size;
+        end = r.addr + r.size;
+    }
+    return s;
+}
+
+template <int Bytes, int Ranges, size_t N>
+constexpr fw_image<Bytes, Ranges> fw_parse(const char *const (&hex)[N]) {
+    fw_image<Bytes, Ranges> image = {};
+    fw_order<N> o = fw_sort(hex);
+    int bytes = 0, ranges = 0, end = -1;
+    for (int k = 0; k < o.n; k++) {
+        fw_record r = fw_record_parse(hex[o.index[k]]);
+        if (r.addr != end) {
+            image.range[ranges].addr = (uint16_t)r.addr;
+            image.range[ranges].offset = (uint16_t)bytes;
+            ranges++;
+        }
+        for (int i = 0; i < r.size; i++) {
+            image.data[bytes++] = (uint8_t)fw_byte(r.data + 2 * i);
+        }
+        image.range[ranges - 1].size = (uint16_t)(image.range[ranges - 1].size + r.size);
+        end = r.addr + r.size;
+    }
+
+    uint64_t h = FW_FNV_OFFSET;
+    for (int k = 0; k < ranges; k++) {
+        const fw_range &r = image.range[k];
+        h = fw_fnv(fw_fnv(fw_fnv(fw_fnv(h, r.addr >> 8), r.addr), r.size >> 8), r.size);
+        for (int i = 0; i < r.size; i++) {
+            h = fw_fnv(h, image.data[r.offset + i]);
+        }
+    }
+    image.hash = h;
+    return image;
+}
+
+#endif
@@ -0,0 +1,102 @@
+//
+// EZ-USB FX2 control channel, beside the running stream
+//
+#include "fx2ctl.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+int fx2_find_marker(const uint8_t *block, long len, fx2_marker *m) {
+    if (len % FX2_PACKET_SIZE != FX2_MARKER_SIZE) {
+        return 0;   // Full packets only, the usual case
+    }
+    const uint8_t *p = block + len - FX2_MARKER_SIZE;
+    if (p[0] != FX2_MARK || p[1] != FX2_MARK) {
+        return 0;
+    }
+    m->command = p[2];
+    m->seq = p[3];
+    return 1;
+}
+
+fx2_control::fx2_control(fx2_port *port)
+    : port(port), running(true), busy(false), seq(0), n_sent(0), n_failed(0) {
+    thread = std::thread(&fx2_control::run, this);
+}
+
+fx2_control::~fx2_control() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+    }
+    cond.notify_all();
+    thread.join();
+}
+
+int fx2_control::post(uint8_t code, const uint8_t *args, int size) {
+    command c;
+    if (size > FX2_COMMAND_MAX - 2) {
+        size = FX2_COMMAND_MAX - 2;
+    }
+    c.data[0] = code;
+    if (size > 0) {
+        memcpy(&c.data[1], args, size);
+    }
+    c.size = size + 2;
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (!queue.empty() && queue.back().data[0] == code) {
+        c.data[c.size - 1] = queue.back().data[queue.back().size - 1];
+        queue.back() = c;
+    } else {
+        seq = seq % 255 + 1;   // 0 is what older hosts sent
+        c.data[c.size - 1] = (uint8_t)seq;
+        queue.push_back(c);
+    }
+    cond.notify_all();
+    return c.data[c.size - 1];
+}
+
+int fx2_control::flush(int timeout_ms) {
+    std::unique_lock<std::mutex> guard(lock);
+    bool empty = cond.wait_for(guard, std::chrono::milliseconds(timeout_ms), [this] { return queue.empty() && !busy; });
+    return empty ? 0 : -1;
+}
+
+uint64_t fx2_control::sent(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return n_sent;
+}
+
+uint64_t fx2_control::failed(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return n_failed;
+}
+
+void fx2_control::run(void) {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        cond.wait(guard, [this] { return !queue.empty() || !running; });
+        if (queue.empty()) {
+            return;   // Stopped, nothing left
+        }
+        command c = queue.front();
+        queue.pop_front();
+        busy = true;
+
+        // The device takes the next command once it has done the last one
+        guard.unlock();
+        int ret = port->command(c.data, c.size, FX2_COMMAND_TIMEOUT_MS);
+        guard.lock();
+
+        busy = false;
+        if (ret < 0) {
+            n_failed++;
+            fprintf(stderr, "USB: Command %02x (seq %d) failed.\n", c.data[0], c.data[c.size - 1]);
+        } else {
+            n_sent++;
+        }
+        cond.notify_all();
+    }
+}
@@ -0,0 +1,80 @@
+//
+// EZ-USB FX2 control channel, beside the running stream
+//
+// The EP1 commands of slave.c (Set PLL, Reset EP6) are queued and sent by
+// a thread of their own, so the caller (the decode thread) never waits for
+// the device and the EP6 transfers stay in flight: while the firmware
+// resets its FIFO and waits for the PLL to lock it simply NAKs them.
+//
+// Each command carries a sequence number as its last byte. When the
+// firmware resumes the FIFO it commits a short marker packet with it
+// before the new samples. The marker ends the pending transfer, so it is
+// always the tail of a block (a multiple of 512 bytes, then 4 bytes), and
+// 0xff never occurs in "000VHRGB" samples. The samples in front of it are
+// the old stream, the decoder resyncs right behind it.
+//
+#ifndef FX2CTL_H
+#define FX2CTL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "fx2load.h"
+
+#define FX2_PACKET_SIZE 512           // EP6 packets (AUTOIN length)
+#define FX2_MARK 0xff
+#define FX2_MARKER_SIZE 4             // FX2_MARK, FX2_MARK, command, sequence
+#define FX2_COMMAND_MAX 8
+#define FX2_COMMAND_TIMEOUT_MS 1000
+#define FX2_PROTOCOL_MARKER 2         // First firmware command set with the markers
+
+struct fx2_marker {
+    int command;
+    int seq;
+};
+
+// Marker at the end of a block of len bytes. Returns 1 (and *m) if there
+// is one, i.e. the samples are len - FX2_MARKER_SIZE bytes, else 0.
+int fx2_find_marker(const uint8_t *block, long len, fx2_marker *m);
+
+class fx2_control {
+public:
+    explicit fx2_control(fx2_port *port);
+    ~fx2_control();   // Sends what is queued, then stops
+
+    // Queue a command (code, then args), never waits. A command still
+    // queued with the same code is replaced, e.g. a burst of Set PLL goes
+    // out as the last one. Returns its sequence number (1-255).
+    int post(uint8_t code, const uint8_t *args, int size);
+
+    // Wait until the queue is empty, up to timeout_ms. Returns 0 / -1
+    int flush(int timeout_ms);
+
+    uint64_t sent(void);
+    uint64_t failed(void);
+
+private:
+    struct command {
+        uint8_t data[FX2_COMMAND_MAX];
+        int size;
+    };
+
+    void run(void);
+
+    fx2_port *port;
+    std::deque<command> queue;
+    std::mutex lock;
+    std::condition_variable cond;     // Queued, or the queue ran empty
+    std::thread thread;
+    bool running;
+    bool busy;                        // A command is being sent
+    int seq;
+    uint64_t n_sent, n_failed;
+};
+
+#endif
@@ -0,0 +1,215 @@
+//
+// EZ-USB FX2 start-up: firmware download, skipped when it already runs
+//
+#include "fx2load.h"
+#include "telemetry.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+int fx2_write_ram(fx2_port *port, int addr, const uint8_t *data, int size, int *chunk, int *requests) {
+    for (int i = 0; i < size;) {
+        int piece = (size - i > *chunk) ? *chunk : size - i;
+        if (port->write_ram(addr + i, data + i, piece) < 0) {
+            if (*chunk > FX2_WRITE_RAM_MIN) {
+                *chunk /= 2;
+                continue;
+            }
+            fprintf(stderr, "USB: Write Ram at %04x (len %d) failed.\n", addr + i, piece);
+            return -1;
+        }
+        (*requests)++;
+        i += piece;
+    }
+    return 0;
+}
+
+// Magic and hash of an identity slot
+static int parse_id(const uint8_t *id, uint64_t *hash) {
+    if (memcmp(id, FX2_ID_MAGIC, 8) != 0) {
+        return 0;
+    }
+    *hash = 0;
+    for (int i = 7; i >= 0; i--) {
+        *hash = *hash << 8 | id[8 + i];
+    }
+    return 1;
+}
+
+int fx2_loaded(fx2_port *port, uint64_t *hash) {
+    uint8_t id[FX2_ID_SIZE];
+    if (port->read_ram(FX2_ID_ADDR, id, sizeof(id)) < 0) {
+        return 0;
+    }
+    return parse_id(id, hash);
+}
+
+int fx2_identify(fx2_port *port, uint64_t *hash) {
+    uint8_t cmd[2] = {FX2_CMD_IDENTIFY, 0x00};
+    if (port->command(cmd, sizeof(cmd), FX2_IDENTIFY_TIMEOUT_MS) < 0) {
+        return 0;
+    }
+    uint8_t r[64];
+    int len = port->reply(r, sizeof(r), FX2_IDENTIFY_TIMEOUT_MS);
+    if (len < 2 + FX2_ID_SIZE || r[0] != FX2_CMD_IDENTIFY || r[1] != FX2_PROTOCOL) {
+        return 0;
+    }
+    return parse_id(&r[2], hash);
+}
+
+int fx2_download(fx2_port *port, const fw_view *fw, int *chunk, int *requests) {
+    // Take the CPU into RESET
+    uint8_t dat = 1;
+    if (fx2_write_ram(port, FX2_CPUCS, &dat, sizeof(dat), chunk, requests) < 0) {
+        return -1;
+    }
+
+    // Load firmware, one write per range
+    for (int i = 0; i < fw->ranges; i++) {
+        const fw_range *r = &fw->range[i];
+        if (fx2_write_ram(port, r->addr, &fw->data[r->offset], r->size, chunk, requests) < 0) {
+            return -1;
+        }
+    }
+
+    // Identity slot
+    uint8_t id[FX2_ID_SIZE];
+    memcpy(id, FX2_ID_MAGIC, 8);
+    for (int i = 0; i < 8; i++) {
+        id[8 + i] = (uint8_t)(fw->hash >> (8 * i));
+    }
+    if (fx2_write_ram(port, FX2_ID_ADDR, id, sizeof(id), chunk, requests) < 0) {
+        return -1;
+    }
+
+    // Take the CPU out of RESET (run)
+    dat = 0;
+    return fx2_write_ram(port, FX2_CPUCS, &dat, sizeof(dat), chunk, requests);
+}
+
+int fx2_boot(fx2_port *port, const fw_view *fw, bool force, fx2_boot_result *result) {
+    uint64_t start = telemetry_now_us();
+    uint64_t hash;
+
+    memset(result, 0, sizeof(*result));
+    result->chunk = FX2_WRITE_RAM_MAX;
+
+    // The slot first, it costs no timeout when nothing runs
+    if (!force && fw->protocol >= FX2_PROTOCOL_IDENTIFY && fx2_loaded(port, &hash) && hash == fw->hash && fx2_identify(port, &hash) && hash == fw->hash) {
+        // Same build: only the samples of the previous session are dropped
+        uint8_t cmd[2] = {FX2_CMD_RESET_EP6, 0x00};
+        if (port->command(cmd, sizeof(cmd), 1000) == 0) {
+            result->skipped = 1;
+            result->ms = (telemetry_now_us() - start) / 1000.0;
+            return 0;
+        }
+    }
+
+    int ret = fx2_download(port, fw, &result->chunk, &result->requests);
+    result->ms = (telemetry_now_us() - start) / 1000.0;
+    return ret;
+}
+
+//----------------------------------------------------------------------
+// Mock device
+//----------------------------------------------------------------------
+fx2_mock::fx2_mock()
+    : identify(true), max_request(FX2_WRITE_RAM_MAX), request_us(0), hold(false), running(false), resets(0),
+      fifo_resets(0), commands(0), held(0), requests(0), pending_len(0) {
+    power_cycle();
+}
+
+void fx2_mock::power_cycle(void) {
+    uint32_t x = 0x12345678;
+    for (size_t i = 0; i < sizeof(ram); i++) {
+        x = x * 1103515245 + 12345;
+        ram[i] = (uint8_t)(x >> 16);
+    }
+    running = false;
+    pending_len = 0;
+}
+
+static void spend(int us) {
+    if (us > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+    }
+}
+
+int fx2_mock::write_ram(int addr, const uint8_t *data, int size) {
+    spend(request_us);
+    if (size > max_request) {
+        return -1;
+    }
+    // Program / data RAM, scratch RAM, or CPUCS alone
+    bool ok = (addr + size <= 0x4000) || (addr >= 0xe000 && addr + size <= 0xe200) ||
+              (addr == FX2_CPUCS && size == 1);
+    if (!ok) {
+        return -1;
+    }
+    requests++;
+    if (addr == FX2_CPUCS) {
+        if (data[0] & 1) {
+            running = false;
+            resets++;
+        } else {
+            running = true;
+            pending_len = 0;
+        }
+        return 0;
+    }
+    memcpy(&ram[addr], data, size);
+    return 0;
+}
+
+int fx2_mock::read_ram(int addr, uint8_t *data, int size) {
+    spend(request_us);
+    if (size > max_request || addr < 0 || addr + size > (int)sizeof(ram)) {
+        return -1;
+    }
+    memcpy(data, &ram[addr], size);
+    return 0;
+}
+
+int fx2_mock::command(const uint8_t *data, int size, int timeout_ms) {
+    if (!running) {
+        spend(timeout_ms * 1000);   // Nobody takes it, NAKed until the timeout
+        return -1;
+    }
+    spend(request_us);
+    held++;
+    while (hold) {
+        spend(100);
+    }
+    held--;
+    commands++;
+    memcpy(last_command, data, (size < (int)sizeof(last_command)) ? size : sizeof(last_command));
+    switch (data[0]) {
+    case FX2_CMD_SET_PLL:
+    case FX2_CMD_RESET_EP6:
+        fifo_resets++;
+        break;
+    case FX2_CMD_IDENTIFY:
+        if (identify) {
+            pending[0] = FX2_CMD_IDENTIFY;
+            pending[1] = FX2_PROTOCOL;
+            memcpy(&pending[2], &ram[FX2_ID_ADDR], FX2_ID_SIZE);
+            pending_len = 2 + FX2_ID_SIZE;
+        }
+        break;
+    }
+    return 0;
+}
+
+int fx2_mock::reply(uint8_t *data, int size, int timeout_ms) {
+    if (pending_len == 0) {
+        spend(timeout_ms * 1000);
+        return -1;
+    }
+    spend(request_us);
+    int len = (pending_len < size) ? pending_len : size;
+    memcpy(data, pending, len);
+    pending_len = 0;
+    return len;
+}
@@ -0,0 +1,134 @@
+//
+// EZ-USB FX2 start-up: firmware download, skipped when it already runs
+//
+// The image is written into the RAM with vendor request 0xA0 while the
+// 8051 is held in reset (CPUCS), together with an identity slot at the end
+// of the scratch RAM: a magic and the hash of the image (fwimage.h). The
+// firmware (slave.c) reports the slot with the Identify command on EP1.
+//
+// On start the slot is read back first (0xA0 reads are served by the
+// EZ-USB core, firmware or not). After a power cycle it holds garbage and
+// the download begins at once. When it names the image, Identify makes
+// sure the firmware really runs, and if so the reset and the download are
+// skipped and only the EP6 FIFO is reset.
+//
+// fx2_port hides the transport: CyAPI for the real device, fx2_mock to
+// try the loader without one (tools/fwload).
+//
+#ifndef FX2LOAD_H
+#define FX2LOAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+#include "fwimage.h"
+
+#define FX2_CPUCS 0xe600
+#define FX2_ID_ADDR 0xe1f0            // Identity slot (id_slot in slave.c)
+#define FX2_ID_SIZE 16                // Magic and hash (little endian)
+#define FX2_ID_MAGIC "DRGBFW01"
+
+// EP1 commands of slave.c
+#define FX2_CMD_SET_PLL 0x01
+#define FX2_CMD_RESET_EP6 0x02
+#define FX2_CMD_IDENTIFY 0x03
+#define FX2_PROTOCOL 2                // Command set of this host (fx2ctl.h)
+#define FX2_PROTOCOL_IDENTIFY 1       // First one with Identify, 0: older builds
+
+// A hung firmware (or a build without Identify) does not answer. The
+// running one replies within a few USB frames.
+#define FX2_IDENTIFY_TIMEOUT_MS 20
+
+// Write RAM requests: the largest size tried first, halved while refused
+#define FX2_WRITE_RAM_MAX 4096
+#define FX2_WRITE_RAM_MIN 64
+
+class fx2_port {
+public:
+    virtual ~fx2_port() {}
+
+    // Vendor request 0xA0 of size bytes at addr. Returns 0 on success,
+    // -1 if the host or the device refused it
+    virtual int write_ram(int addr, const uint8_t *data, int size) = 0;
+
+    // Vendor request 0xA0 reading size bytes at addr. Returns 0 / -1
+    virtual int read_ram(int addr, uint8_t *data, int size) = 0;
+
+    // Command on EP1 OUT. Returns 0 on success, -1 on error or timeout
+    virtual int command(const uint8_t *data, int size, int timeout_ms) = 0;
+
+    // Reply on EP1 IN. Returns its length, -1 on error or timeout
+    virtual int reply(uint8_t *data, int size, int timeout_ms) = 0;
+};
+
+struct fx2_boot_result {
+    int skipped;          // The device already ran the image
+    int requests;         // Write RAM requests of the download
+    int chunk;            // Largest request accepted
+    double ms;            // Identify and download
+};
+
+// Write size bytes in requests of up to *chunk bytes. A refused request is
+// sent again in halves, *chunk is left at the size accepted. *requests
+// counts them. Returns 0 on success, -1 on error.
+int fx2_write_ram(fx2_port *port, int addr, const uint8_t *data, int size, int *chunk, int *requests);
+
+// Hash of the image last downloaded, from the identity slot. Returns 1
+// (and *hash) if the slot is valid, 0 if it is not (e.g. after power on).
+int fx2_loaded(fx2_port *port, uint64_t *hash);
+
+// Identity of the running firmware. Returns 1 (and *hash) if it is one of
+// ours, 0 if the device does not answer.
+int fx2_identify(fx2_port *port, uint64_t *hash);
+
+// Reset, write the image and its identity slot, run. Returns 0 / -1
+int fx2_download(fx2_port *port, const fw_view *fw, int *chunk, int *requests);
+
+// Download fw unless the device runs it already (or force). A firmware
+// older than Identify (fw->protocol 0) is not asked, it is always
+// downloaded without waiting for the timeout. Returns 0 / -1
+int fx2_boot(fx2_port *port, const fw_view *fw, bool force, fx2_boot_result *result);
+
+//----------------------------------------------------------------------
+// Mock device
+//----------------------------------------------------------------------
+// RAM, CPUCS and the EP1 commands of slave.c. The firmware "runs" once the
+// reset is released, i.e. it answers with the identity slot as written.
+// Every request costs request_us of real time, a command to a device
+// without firmware costs its whole timeout.
+class fx2_mock : public fx2_port {
+public:
+    fx2_mock();
+
+    int write_ram(int addr, const uint8_t *data, int size);
+    int read_ram(int addr, uint8_t *data, int size);
+    int command(const uint8_t *data, int size, int timeout_ms);
+    int reply(uint8_t *data, int size, int timeout_ms);
+
+    // Power on without EEPROM: RAM undefined, nothing running
+    void power_cycle(void);
+
+    // Settings
+    bool identify;        // The firmware knows Identify (false: older build)
+    int max_request;      // Largest write RAM request the host passes
+    int request_us;       // Time per request
+    std::atomic<bool> hold;       // Commands wait while set (busy with the PLL)
+
+    // What happened
+    bool running;
+    int resets;           // CPU reset by the host
+    int fifo_resets;      // EP6 FIFO reset by command
+    int commands;         // EP1 commands taken
+    std::atomic<int> held;        // Commands waiting in hold now
+    uint8_t last_command[8];
+    int requests;         // Write RAM requests accepted
+    uint8_t ram[0x10000];
+
+private:
+    uint8_t pending[64];  // Reply waiting on EP1 IN
+    int pending_len;
+};
+
+#endif
@@ -0,0 +1,496 @@
+//
+// Streaming of decoded frames over TCP
+//
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define SOCK(s) ((SOCKET)(s))
+#define NET_SEND_FLAGS 0
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define INVALID_SOCKET (-1)
+#define SD_BOTH SHUT_RDWR
+#define SOCK(s) ((int)(s))
+#define NET_SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+#include "netstream.h"
+#include "caprle.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define NET_ROW_MAX CAPRLE_PACKED_MAX(DW)
+#define NET_FRAME_MAX (DH * (sizeof(net_row) + NET_ROW_MAX))
+
+static int net_init(void) {
+#ifdef _WIN32
+    static int result = -2;
+    static std::mutex init_lock;
+    std::lock_guard<std::mutex> guard(init_lock);
+    if (result == -2) {
+        WSADATA wsa;
+        result = (WSAStartup(MAKEWORD(2, 2), &wsa) == 0) ? 0 : -1;
+    }
+    return result;
+#else
+    return 0;
+#endif
+}
+
+static void net_close(intptr_t sock) {
+#ifdef _WIN32
+    closesocket(SOCK(sock));
+#else
+    ::close(SOCK(sock));
+#endif
+}
+
+static int send_all(intptr_t sock, const uint8_t *p, size_t len) {
+    while (len > 0) {
+        int n = send(SOCK(sock), (const char *)p, (int)len, NET_SEND_FLAGS);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(intptr_t sock, uint8_t *p, size_t len) {
+    while (len > 0) {
+        int n = recv(SOCK(sock), (char *)p, (int)len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static addrinfo *resolve(const char *host, int port, int flags) {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = flags;
+
+    addrinfo *res = NULL;
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        return NULL;
+    }
+    return res;
+}
+
+static intptr_t net_listen(const char *addr, int port) {
+    addrinfo *res = resolve(addr, port, AI_PASSIVE);
+    if (res == NULL) {
+        fprintf(stderr, "Net: Unknown address %s\n", addr);
+        return INVALID_SOCKET;
+    }
+    intptr_t sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sock == (intptr_t)INVALID_SOCKET) {
+        freeaddrinfo(res);
+        return INVALID_SOCKET;
+    }
+    int on = 1;
+    setsockopt(SOCK(sock), SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+    if (bind(SOCK(sock), res->ai_addr, (socklen_t)res->ai_addrlen) != 0 || listen(SOCK(sock), 8) != 0) {
+        fprintf(stderr, "Net: Could not listen on %s:%d\n", addr, port);
+        freeaddrinfo(res);
+        net_close(sock);
+        return INVALID_SOCKET;
+    }
+    freeaddrinfo(res);
+    return sock;
+}
+
+// Wait up to timeout_ms for data (or a connection). Returns > 0 if there is.
+static int wait_readable(intptr_t sock, int timeout_ms) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(SOCK(sock), &fds);
+    timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    return select((int)SOCK(sock) + 1, &fds, NULL, NULL, &tv);
+}
+
+//----------------------------------------------------------------------
+// Server
+//----------------------------------------------------------------------
+frame_server::frame_server() : listen_sock(INVALID_SOCKET), running(0), latest_gen(0), n_viewers(0) {
+    memset(&hello, 0, sizeof(hello));
+}
+
+int frame_server::start(const char *addr, int port, const uint32_t rgb[PALETTE_SIZE]) {
+    if (net_init() < 0) {
+        fprintf(stderr, "Net: Could not initialize the sockets\n");
+        return -1;
+    }
+    listen_sock = net_listen(addr, port);
+    if (listen_sock == (intptr_t)INVALID_SOCKET) {
+        return -1;
+    }
+
+    memcpy(hello.magic, NET_MAGIC, sizeof(hello.magic));
+    hello.width = DW;
+    hello.height = DH;
+    memcpy(hello.palette, rgb, sizeof(hello.palette));
+    latest.reset();
+    latest_gen = 0;
+
+    running = 1;
+    accept_thread = std::thread(&frame_server::accept_run, this);
+    return 0;
+}
+
+void frame_server::stop(void) {
+    if (!running) {
+        return;
+    }
+    {
+        // Under the lock, so that no sender misses the wake up
+        std::lock_guard<std::mutex> guard(lock);
+        running = 0;
+    }
+    accept_thread.join();
+    net_close(listen_sock);
+    listen_sock = INVALID_SOCKET;
+
+    {
+        // Senders blocked in send() return on shutdown
+        std::lock_guard<std::mutex> guard(viewers_lock);
+        for (viewer *v : list) {
+            shutdown(SOCK(v->sock), SD_BOTH);
+        }
+    }
+    cond.notify_all();
+    reap(true);
+}
+
+void frame_server::publish(const uint8_t *pixels, uint64_t seq) {
+    if (n_viewers.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    // A buffer which no sender holds any more
+    std::shared_ptr<snapshot> s;
+    for (auto &p : pool) {
+        if (p.use_count() == 1 && p != latest) {
+            s = p;
+            break;
+        }
+    }
+    if (!s) {
+        s = std::make_shared<snapshot>();
+        pool.push_back(s);
+    }
+    memcpy(s->pixels, pixels, DW * DH);
+    s->seq = seq;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        latest = s;
+        latest_gen++;
+    }
+    cond.notify_all();
+}
+
+void frame_server::accept_run(void) {
+    while (running) {
+        // Wake up now and then to see the stop request
+        int ret = wait_readable(listen_sock, 200);
+        reap(false);
+        if (ret <= 0) {
+            continue;
+        }
+
+        intptr_t sock = accept(SOCK(listen_sock), NULL, NULL);
+        if (sock == (intptr_t)INVALID_SOCKET) {
+            continue;
+        }
+        int on = 1;
+        setsockopt(SOCK(sock), IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+
+        viewer *v = new viewer;
+        v->sock = sock;
+        v->done = 0;
+        std::lock_guard<std::mutex> guard(viewers_lock);
+        list.push_back(v);
+        n_viewers++;
+        v->thread = std::thread(&frame_server::viewer_run, this, v);
+    }
+}
+
+// Join the viewers which have gone (all: every viewer)
+void frame_server::reap(bool all) {
+    std::lock_guard<std::mutex> guard(viewers_lock);
+    for (auto it = list.begin(); it != list.end();) {
+        viewer *v = *it;
+        if (!all && !v->done) {
+            ++it;
+            continue;
+        }
+        v->thread.join();
+        net_close(v->sock);
+        delete v;
+        it = list.erase(it);
+    }
+}
+
+void frame_server::viewer_run(viewer *v) {
+    std::vector<uint8_t> ref(DW * DH, 0);       // What the viewer has
+    std::vector<uint8_t> msg(sizeof(net_frame_header) + NET_FRAME_MAX);
+    uint8_t diff[DW];
+    uint64_t gen = 0;
+    bool key = true;
+
+    bool ok = (send_all(v->sock, (const uint8_t *)&hello, sizeof(hello)) == 0);
+
+    while (ok && running) {
+        std::shared_ptr<snapshot> cur;
+        {
+            // Frames published while the last one was being sent are
+            // skipped, only the newest is sent
+            std::unique_lock<std::mutex> guard(lock);
+            cond.wait(guard, [&] { return !running || latest_gen != gen; });
+            if (!running) {
+                break;
+            }
+            cur = latest;
+            gen = latest_gen;
+        }
+
+        uint8_t *p = msg.data() + sizeof(net_frame_header);
+        int rows = 0;
+        for (int y = 0; y < DH; y++) {
+            const uint8_t *c = &cur->pixels[y * DW];
+            uint8_t *r = &ref[y * DW];
+            if (!key && memcmp(c, r, DW) == 0) {
+                continue;
+            }
+            for (int x = 0; x < DW; x++) {
+                diff[x] = c[x] ^ r[x];
+            }
+            memcpy(r, c, DW);
+
+            net_row row;
+            row.y = (uint16_t)y;
+            row.size = (uint16_t)caprle_encode(diff, DW, p + sizeof(row));
+            memcpy(p, &row, sizeof(row));
+            p += sizeof(row) + row.size;
+            rows++;
+        }
+
+        // An empty frame still goes out, it carries the frame number
+        net_frame_header hdr;
+        hdr.size = (uint32_t)(p - msg.data() - sizeof(hdr));
+        hdr.seq = (uint32_t)cur->seq;
+        hdr.rows = (uint16_t)rows;
+        hdr.flags = key ? NET_KEY : 0;
+        memcpy(msg.data(), &hdr, sizeof(hdr));
+        ok = (send_all(v->sock, msg.data(), p - msg.data()) == 0);
+        key = false;
+    }
+
+    n_viewers--;
+    v->done = 1;
+}
+
+//----------------------------------------------------------------------
+// Client
+//----------------------------------------------------------------------
+frame_client::frame_client() : sock(INVALID_SOCKET), received(0) {
+    memset(&hello, 0, sizeof(hello));
+}
+
+int frame_client::connect(const char *host, int port) {
+    if (net_init() < 0) {
+        fprintf(stderr, "Net: Could not initialize the sockets\n");
+        return -1;
+    }
+    addrinfo *res = resolve(host, port, 0);
+    if (res == NULL) {
+        fprintf(stderr, "Net: Unknown host %s\n", host);
+        return -1;
+    }
+    for (addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock == (intptr_t)INVALID_SOCKET) {
+            continue;
+        }
+        if (::connect(SOCK(sock), ai->ai_addr, (socklen_t)ai->ai_addrlen) == 0) {
+            break;
+        }
+        net_close(sock);
+        sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(res);
+    if (sock == (intptr_t)INVALID_SOCKET) {
+        fprintf(stderr, "Net: Could not connect to %s:%d\n", host, port);
+        return -1;
+    }
+
+    if (recv_all(sock, (uint8_t *)&hello, sizeof(hello)) < 0 || memcmp(hello.magic, NET_MAGIC, sizeof(hello.magic)) ||
+        hello.width != DW || hello.height != DH) {
+        fprintf(stderr, "Net: %s:%d is not a frame server\n", host, port);
+        close();
+        return -1;
+    }
+    buf.resize(NET_FRAME_MAX + 8);
+    received = sizeof(hello);
+    return 0;
+}
+
+void frame_client::close(void) {
+    if (sock != (intptr_t)INVALID_SOCKET) {
+        net_close(sock);
+    }
+    sock = INVALID_SOCKET;
+}
+
+int frame_client::receive(uint8_t *pixels, uint32_t *seq, int *rows) {
+    net_frame_header hdr;
+    if (sock == (intptr_t)INVALID_SOCKET || recv_all(sock, (uint8_t *)&hdr, sizeof(hdr)) < 0) {
+        return -1;
+    }
+    if (hdr.size > NET_FRAME_MAX || hdr.rows > DH || recv_all(sock, buf.data(), hdr.size) < 0) {
+        close();
+        return -1;
+    }
+    received += sizeof(hdr) + hdr.size;
+
+    if (hdr.flags & NET_KEY) {
+        memset(pixels, 0, DW * DH);
+    }
+    uint8_t diff[DW + 8];
+    const uint8_t *p = buf.data();
+    const uint8_t *end = p + hdr.size;
+    for (int i = 0; i < hdr.rows; i++) {
+        net_row row;
+        if (end - p < (ptrdiff_t)sizeof(row)) {
+            close();
+            return -1;
+        }
+        memcpy(&row, p, sizeof(row));
+        p += sizeof(row);
+        if (row.y >= DH || row.size > end - p || caprle_decode(p, row.size, diff, DW) != DW) {
+            fprintf(stderr, "Net: Corrupt frame\n");
+            close();
+            return -1;
+        }
+        p += row.size;
+
+        uint8_t *r = pixels + row.y * DW;
+        for (int x = 0; x < DW; x++) {
+            r[x] ^= diff[x];
+        }
+    }
+
+    if (seq != NULL) {
+        *seq = hdr.seq;
+    }
+    if (rows != NULL) {
+        *rows = hdr.rows;
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------
+// Metrics endpoint
+//----------------------------------------------------------------------
+#define METRICS_PAGE_MAX (64 * 1024)
+
+metrics_server::metrics_server() : listen_sock(INVALID_SOCKET), running(0), render(NULL) {
+}
+
+int metrics_server::start(const char *addr, int port, size_t (*render)(char *buf, size_t size)) {
+    if (net_init() < 0) {
+        fprintf(stderr, "Net: Could not initialize the sockets\n");
+        return -1;
+    }
+    listen_sock = net_listen(addr, port);
+    if (listen_sock == (intptr_t)INVALID_SOCKET) {
+        return -1;
+    }
+    this->render = render;
+    page.resize(METRICS_PAGE_MAX);
+
+    running = 1;
+    thread = std::thread(&metrics_server::run, this);
+    return 0;
+}
+
+void metrics_server::stop(void) {
+    if (!running) {
+        return;
+    }
+    running = 0;
+    thread.join();
+    net_close(listen_sock);
+    listen_sock = INVALID_SOCKET;
+}
+
+void metrics_server::run(void) {
+    while (running) {
+        if (wait_readable(listen_sock, 200) <= 0) {
+            continue;
+        }
+        intptr_t sock = accept(SOCK(listen_sock), NULL, NULL);
+        if (sock != (intptr_t)INVALID_SOCKET) {
+            serve(sock);
+            net_close(sock);
+        }
+    }
+}
+
+void metrics_server::serve(intptr_t sock) {
+    // The request up to the blank line, a client which sends nothing is dropped
+    char req[2048];
+    size_t len = 0;
+    while (len < sizeof(req) - 1) {
+        if (wait_readable(sock, 1000) <= 0) {
+            return;
+        }
+        int n = recv(SOCK(sock), req + len, (int)(sizeof(req) - 1 - len), 0);
+        if (n <= 0) {
+            return;
+        }
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL) {
+            break;
+        }
+    }
+
+    char head[160];
+    int head_len;
+    size_t body = 0;
+    if (strncmp(req, "GET ", 4) != 0) {
+        head_len = snprintf(head, sizeof(head), "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n");
+    } else {
+        body = render(page.data(), page.size());
+        if (body == 0) {
+            head_len = snprintf(head, sizeof(head), "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+        } else {
+            head_len = snprintf(head, sizeof(head),
+                                "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                                body);
+        }
+    }
+    if (send_all(sock, (const uint8_t *)head, head_len) == 0 && body > 0) {
+        send_all(sock, (const uint8_t *)page.data(), body);
+    }
+}
@@ -0,0 +1,170 @@
+//
+// Streaming of decoded frames over TCP
+//
+// The server takes every presented frame and sends each viewer only the
+// rows which differ from the last frame that viewer has received. A row
+// is sent XORed with its old content and run-length coded
+// (caprle_encode(), the palette indices are "000VHRGB" samples without
+// sync bits). Every viewer has its own sender thread, so a slow one only
+// receives fewer frames and never holds up the presenter or the others.
+//
+// The same module serves the metrics (metrics_server), as plain HTTP.
+//
+// Protocol (all fields little endian):
+//   server: net_hello
+//   server: net_frame_header, then header.rows x (net_row, coded row) ...
+//
+#ifndef NETSTREAM_H
+#define NETSTREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "decoder.h"
+#include "palette.h"
+
+#define NET_MAGIC "DRGBNET1"
+#define NET_PORT 5900
+
+struct net_hello {
+    char magic[8];                    // NET_MAGIC
+    uint16_t width, height;           // DW, DH
+    uint32_t palette[PALETTE_SIZE];   // 0xRRGGBB of the indices
+};
+
+#define NET_KEY 1         // All rows, coded against a black screen
+
+struct net_frame_header {
+    uint32_t size;        // Bytes following this header
+    uint32_t seq;         // Frame number of the source (lower 32 bits)
+    uint16_t rows;        // Rows in this message
+    uint16_t flags;       // NET_KEY
+};
+
+struct net_row {
+    uint16_t y;
+    uint16_t size;        // Coded bytes following
+};
+
+static_assert(sizeof(net_hello) == 44, "net_hello must be 44 bytes");
+static_assert(sizeof(net_frame_header) == 12, "net_frame_header must be 12 bytes");
+static_assert(sizeof(net_row) == 4, "net_row must be 4 bytes");
+
+//----------------------------------------------------------------------
+// Server
+//----------------------------------------------------------------------
+class frame_server {
+public:
+    frame_server();
+    ~frame_server() { stop(); }
+
+    // Listen on addr ("127.0.0.1", "0.0.0.0", ...) and port.
+    // Returns 0 on success, -1 on error.
+    int start(const char *addr, int port, const uint32_t rgb[PALETTE_SIZE]);
+    void stop(void);
+
+    // A new frame from the presenter. The frame is copied (only while
+    // there are viewers) and the call returns right away, it never waits
+    // for a sender.
+    void publish(const uint8_t *pixels, uint64_t seq);
+
+    int viewers(void) const { return n_viewers.load(std::memory_order_relaxed); }
+
+private:
+    struct viewer {
+        intptr_t sock;
+        std::thread thread;
+        std::atomic<int> done;
+    };
+
+    void accept_run(void);
+    void viewer_run(viewer *v);
+    void reap(bool all);
+
+    intptr_t listen_sock;
+    std::thread accept_thread;
+    std::atomic<int> running;
+    net_hello hello;
+
+    struct snapshot {
+        uint8_t pixels[DW * DH];
+        uint64_t seq;
+    };
+
+    // The newest frame. The lock is only held to pass the pointer, the
+    // senders read the frame while the next one is being copied.
+    std::mutex lock;
+    std::condition_variable cond;
+    std::shared_ptr<snapshot> latest;
+    uint64_t latest_gen;      // Count of published frames
+    std::vector<std::shared_ptr<snapshot>> pool;
+
+    std::mutex viewers_lock;
+    std::list<viewer *> list;
+    std::atomic<int> n_viewers;
+};
+
+//----------------------------------------------------------------------
+// Client
+//----------------------------------------------------------------------
+class frame_client {
+public:
+    frame_client();
+    ~frame_client() { close(); }
+
+    // Returns 0 on success, -1 on error
+    int connect(const char *host, int port);
+    void close(void);
+
+    const net_hello *info(void) const { return &hello; }
+
+    // Wait for the next frame and apply it to pixels (DW x DH, kept by
+    // the caller between calls). seq and rows (may be NULL) get the frame
+    // number and the number of rows which have changed.
+    // Returns 0 on success, -1 when the connection is closed or broken.
+    int receive(uint8_t *pixels, uint32_t *seq, int *rows);
+
+    uint64_t bytes(void) const { return received; }
+
+private:
+    intptr_t sock;
+    net_hello hello;
+    std::vector<uint8_t> buf;
+    uint64_t received;
+};
+
+//----------------------------------------------------------------------
+// Metrics endpoint
+//----------------------------------------------------------------------
+// HTTP/1.0, every GET gets the text of render() (e.g. telemetry_format(),
+// Prometheus text). The requests are served one by one on its own thread.
+class metrics_server {
+public:
+    metrics_server();
+    ~metrics_server() { stop(); }
+
+    // render() writes the page into buf and returns its length, 0 on error.
+    // Returns 0 on success, -1 on error.
+    int start(const char *addr, int port, size_t (*render)(char *buf, size_t size));
+    void stop(void);
+
+private:
+    void run(void);
+    void serve(intptr_t sock);
+
+    intptr_t listen_sock;
+    std::thread thread;
+    std::atomic<int> running;
+    size_t (*render)(char *buf, size_t size);
+    std::vector<char> page;
+};
+
+#endif
@@ -0,0 +1,71 @@
+//
+// Palette of the 8 digital RGB colors
+//
+#include "palette.h"
+#include "decoder.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+const uint32_t palette_default[PALETTE_SIZE] = {
+    0x000000, 0x0000ff, 0x00ff00, 0x00ffff,
+    0xff0000, 0xff00ff, 0xffff00, 0xffffff,
+};
+
+static_assert(BIT_R == 2 && BIT_G == 1 && BIT_B == 0, "palette_default assumes the RGB bit order");
+
+int palette_parse(const char *spec, uint32_t rgb[PALETTE_SIZE]) {
+    const char *p = spec;
+
+    for (int i = 0; i < PALETTE_SIZE && *p != '\0'; i++) {
+        if (*p == '#') {
+            p++;
+        }
+        // Six hex digits exactly (strtoul also takes a sign or "0x")
+        for (int j = 0; j < 6; j++) {
+            if (!isxdigit((unsigned char)p[j])) {
+                fprintf(stderr, "Palette: Invalid color in %s\n", spec);
+                return -1;
+            }
+        }
+        rgb[i] = (uint32_t)strtoul(p, NULL, 16) & 0xffffff;
+        p += 6;
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            fprintf(stderr, "Palette: Invalid color in %s\n", spec);
+            return -1;
+        }
+    }
+    if (*p != '\0') {
+        fprintf(stderr, "Palette: More than %d colors in %s\n", PALETTE_SIZE, spec);
+        return -1;
+    }
+    return 0;
+}
+
+void palette_argb8888(const uint32_t rgb[PALETTE_SIZE], uint32_t lut[PALETTE_SIZE]) {
+    for (int i = 0; i < PALETTE_SIZE; i++) {
+        lut[i] = 0xff000000 | (rgb[i] & 0xffffff);
+    }
+}
+
+void palette_rgb565(const uint32_t rgb[PALETTE_SIZE], uint16_t lut[PALETTE_SIZE]) {
+    for (int i = 0; i < PALETTE_SIZE; i++) {
+        uint32_t c = rgb[i];
+        lut[i] = (uint16_t)(((c >> 8) & 0xf800) | ((c >> 5) & 0x07e0) | ((c >> 3) & 0x001f));
+    }
+}
+
+void palette_yuv(const uint32_t rgb[PALETTE_SIZE], uint8_t y[PALETTE_SIZE], uint8_t u[PALETTE_SIZE], uint8_t v[PALETTE_SIZE]) {
+    for (int i = 0; i < PALETTE_SIZE; i++) {
+        double r = ((rgb[i] >> 16) & 0xff) / 255.0;
+        double g = ((rgb[i] >> 8) & 0xff) / 255.0;
+        double b = (rgb[i] & 0xff) / 255.0;
+        double luma = 0.299 * r + 0.587 * g + 0.114 * b;
+        y[i] = (uint8_t)(16 + 219 * luma + 0.5);
+        u[i] = (uint8_t)(128 + 224 * (b - luma) / 1.772 + 0.5);
+        v[i] = (uint8_t)(128 + 224 * (r - luma) / 1.402 + 0.5);
+    }
+}
@@ -0,0 +1,27 @@
+//
+// Palette of the 8 digital RGB colors
+//
+// Colors are 0xRRGGBB, indexed by the "RGB" bits of the sample
+// (BIT_R, BIT_G, BIT_B). Lookup tables for expand_palette32() /
+// expand_palette16() / expand_palette8() are built from them.
+//
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <stdint.h>
+
+#define PALETTE_SIZE 8
+
+extern const uint32_t palette_default[PALETTE_SIZE];
+
+// "RRGGBB,RRGGBB,..." with up to 8 colors in index order. Colors which are
+// not given keep their value. Returns 0 on success.
+int palette_parse(const char *spec, uint32_t rgb[PALETTE_SIZE]);
+
+void palette_argb8888(const uint32_t rgb[PALETTE_SIZE], uint32_t lut[PALETTE_SIZE]);
+void palette_rgb565(const uint32_t rgb[PALETTE_SIZE], uint16_t lut[PALETTE_SIZE]);
+
+// BT.601 limited range Y'CbCr, one table per plane (for expand_palette8())
+void palette_yuv(const uint32_t rgb[PALETTE_SIZE], uint8_t y[PALETTE_SIZE], uint8_t u[PALETTE_SIZE], uint8_t v[PALETTE_SIZE]);
+
+#endif
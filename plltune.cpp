@@ -0,0 +1,198 @@
+//
+// Closed-loop H_TOTAL tuning of the CS2300-CP dot clock
+//
+#include "plltune.h"
+#include "decoder.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HMASK (1 << BIT_HSYNC)
+
+// A trial must bring the drift below this share of the best one
+#define PLL_TUNE_BETTER 0.8
+
+void pll_tuner_init(pll_tuner *t, int h_pixels, int oversample) {
+    memset(t, 0, sizeof(*t));
+    t->phase = PLL_TUNE_LOCK;
+    t->start = h_pixels;
+    t->h_pixels = h_pixels;
+    t->oversample = oversample;
+    t->h_level = -1;
+    t->line_off = -1;
+    t->last_edge = -1;
+    t->best = h_pixels;
+    t->best_drift = -1;
+    t->dir = 1;
+}
+
+// Measure at another setting once the PLL has locked to it
+static int move_to(pll_tuner *t, int h_pixels) {
+    if (h_pixels < PLL_TUNE_MIN) {
+        h_pixels = PLL_TUNE_MIN;
+    } else if (h_pixels > PLL_TUNE_MAX) {
+        h_pixels = PLL_TUNE_MAX;
+    }
+    int changed = h_pixels != t->h_pixels;
+    t->h_pixels = h_pixels;
+    t->phase = PLL_TUNE_LOCK;
+    t->locked_lines = 0;
+    t->waited_lines = 0;
+    return changed;
+}
+
+static int finish(pll_tuner *t, int phase, int h_pixels) {
+    int changed = h_pixels != t->h_pixels;
+    t->h_pixels = h_pixels;
+    t->phase = phase;
+    return changed;
+}
+
+// One measurement is complete: keep it or go back, then the next trial
+static int evaluate(pll_tuner *t) {
+    t->drift = (double)t->slips / t->pixels * t->h_pixels;
+    t->trials++;
+
+    if (t->best_drift < 0 || t->drift < t->best_drift * PLL_TUNE_BETTER) {
+        // Better: go on from here, on the same side
+        t->best = t->h_pixels;
+        t->best_drift = t->drift;
+        t->flipped = 0;
+    } else if (!t->flipped) {
+        t->dir = -t->dir;
+        t->flipped = 1;
+    } else {
+        return finish(t, PLL_TUNE_DONE, t->best);
+    }
+
+    // Off by the drift / oversample pixels, at least 1 above the floor
+    if (t->best_drift < PLL_TUNE_DRIFT_MIN || t->trials >= PLL_TUNE_TRIALS_MAX) {
+        return finish(t, PLL_TUNE_DONE, t->best);
+    }
+    int step = (int)(t->best_drift / t->oversample + 0.5);
+    if (step < 1) {
+        step = 1;
+    } else if (step > PLL_TUNE_STEP_MAX) {
+        step = PLL_TUNE_STEP_MAX;
+    }
+    return move_to(t, t->best + t->dir * step);
+}
+
+// H-Sync rising edge, period samples after the last one
+static int end_line(pll_tuner *t, int period) {
+    int locked = abs(period - t->oversample * t->h_pixels) < t->oversample;
+    int pixels = t->line_pixels, slips = t->line_slips;
+
+    t->lines++;
+    t->line_pixels = 0;
+    t->line_slips = 0;
+
+    if (t->phase == PLL_TUNE_LOCK) {
+        t->locked_lines = locked ? t->locked_lines + 1 : 0;
+        if (t->locked_lines >= PLL_TUNE_LOCK_LINES) {
+            t->phase = PLL_TUNE_MEASURE;
+            t->pixels = 0;
+            t->slips = 0;
+            t->measured_lines = 0;
+        } else if (++t->waited_lines >= PLL_TUNE_LOCK_MAX) {
+            return finish(t, PLL_TUNE_FAILED, t->start);
+        }
+        return 0;
+    }
+
+    // A broken line (sync glitch) is left out
+    if (locked) {
+        t->pixels += pixels;
+        t->slips += slips;
+    }
+    if (t->pixels >= PLL_TUNE_PIXELS) {
+        return evaluate(t);
+    }
+    if (++t->measured_lines >= PLL_TUNE_MEASURE_MAX) {
+        // Too few short runs to count: the best one so far, if any
+        t->no_detail = 1;
+        return (t->best_drift < 0) ? finish(t, PLL_TUNE_FAILED, t->start) : finish(t, PLL_TUNE_DONE, t->best);
+    }
+    return 0;
+}
+
+// A run of one color, len samples. Counted twice over, so that a length
+// between the longest run and the next (2 x PLL_TUNE_RUN_MAX + 1: the
+// longest one slipped one way or the next the other way) counts half and
+// uniform runs of either length do not bias the drift.
+static inline void count_run(pll_tuner *t, int len) {
+    int os = t->oversample;
+    int n = (len + os / 2) / os;
+    int weight = 2;
+    if (len > PLL_TUNE_RUN_MAX * os) {
+        if (len >= (PLL_TUNE_RUN_MAX + 1) * os) {
+            return;
+        }
+        weight = 1;
+    }
+    if (n >= 1) {
+        t->line_pixels += n * weight;
+        if (len != n * os) {
+            t->line_slips += weight;
+        }
+    }
+}
+
+void pll_tuner_restart(pll_tuner *t) {
+    t->h_level = -1;
+    t->line_off = -1;
+    t->last_edge = -1;
+    t->line_pixels = 0;
+    t->line_slips = 0;
+    if (t->phase < PLL_TUNE_DONE) {
+        t->phase = PLL_TUNE_LOCK;
+        t->locked_lines = 0;
+        t->waited_lines = 0;
+    }
+}
+
+int pll_tuner_feed(pll_tuner *t, const uint8_t *p, size_t n) {
+    const uint8_t *end = p + n;
+
+    if (n == 0 || t->phase >= PLL_TUNE_DONE) {
+        return 0;
+    }
+    if (t->h_level < 0) {
+        t->h_level = (*p & HMASK) != 0;
+        t->color = *p & 7;
+    }
+
+    for (; p < end; p++) {
+        int h = (*p & HMASK) != 0;
+        if (h != t->h_level) {
+            t->h_level = h;
+            if (h) {
+                // The rest of the span has been sampled at the old setting
+                if (t->line_off >= 0 && end_line(t, t->line_off + 1)) {
+                    t->line_off = -1;
+                    return 1;
+                }
+                if (t->phase >= PLL_TUNE_DONE) {
+                    return 0;
+                }
+                t->line_off = 0;
+                t->last_edge = -1;
+                continue;
+            }
+        }
+        if (t->line_off < 0) {
+            continue;   // Before the first line
+        }
+        t->line_off++;
+
+        int c = *p & 7;
+        if (c != t->color) {
+            if (t->last_edge >= 0) {
+                count_run(t, t->line_off - t->last_edge);
+            }
+            t->last_edge = t->line_off;
+            t->color = c;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+//
+// Closed-loop H_TOTAL tuning of the CS2300-CP dot clock
+//
+// The PLL multiplies the H-Sync frequency by 2 x h_pixels, so a line
+// always has that many samples once it has locked, right or wrong. When
+// h_pixels differs from the H_TOTAL of the source, the pixels are wider
+// or narrower than 2 samples and their edges drift against the sample
+// grid across the line: a run of n pixels then spans 2n - 1 or 2n + 1
+// samples now and then. The share of such slips per pixel is the drift,
+// and the drift across a whole line is 2 x the H_TOTAL error.
+//
+// The tuner watches the live stream: it waits until the samples per
+// H-Sync period show the PLL locked at the setting (off by less than one
+// pixel, so a line of the old setting never passes), counts the slips of
+// the short runs over a few frames, and moves h_pixels by the error
+// derived from them. The sign of the drift cannot be seen with 2 samples
+// per pixel, so the first move is a trial: when the drift does not get
+// smaller, the other side is tried. It stops when the drift is below
+// PLL_TUNE_DRIFT_MIN or neither side is better.
+//
+// A run of n pixels is unambiguous while it is off by less than half a
+// pixel, so the capture range is about h_pixels / (2 x PLL_TUNE_RUN_MAX),
+// +-28 at 896, when the picture has long runs only; short runs widen it.
+// Runs longer than PLL_TUNE_RUN_MAX are not counted at all: a picture
+// without them (color bars, a blank screen) gives up after
+// PLL_TUNE_MEASURE_MAX lines, keeping the best setting measured so far.
+//
+#ifndef PLLTUNE_H
+#define PLLTUNE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Tuner phases
+enum {
+    PLL_TUNE_LOCK,        // Wait until the lines have the samples of the setting
+    PLL_TUNE_MEASURE,     // Count the slips
+    PLL_TUNE_DONE,
+    PLL_TUNE_FAILED,      // The PLL does not lock or nothing to measure (back at the start setting)
+};
+
+#define PLL_TUNE_LOCK_LINES 32    // Lines in a row at the setting: locked
+#define PLL_TUNE_LOCK_MAX 8192    // Lines waited for the lock at most
+#define PLL_TUNE_RUN_MAX 16       // Longest run counted [pixels], its slip is unambiguous
+#define PLL_TUNE_PIXELS 16000     // Pixels of counted runs per measurement (x 2, see count_run)
+#define PLL_TUNE_MEASURE_MAX 8192 // Lines spent on one measurement at most
+#define PLL_TUNE_DRIFT_MIN 0.5    // Drift taken as locked [samples per line]
+#define PLL_TUNE_STEP_MAX 32
+#define PLL_TUNE_TRIALS_MAX 16
+#define PLL_TUNE_MIN 700          // Range of h_pixels
+#define PLL_TUNE_MAX 1280
+
+struct pll_tuner {
+    int phase;
+    int start;                // Setting before tuning, the fallback
+    int h_pixels;             // Setting to be used now
+    int oversample;
+
+    // Line scan, resumable at any sample
+    int h_level;              // -1: not seen yet
+    int color;                // RGB of the last sample
+    int line_off;             // Samples since the last H-Sync rising edge (-1: none yet)
+    int last_edge;            // Offset of the last color edge in the line (-1: none)
+    int line_pixels;          // Counted in the current line
+    int line_slips;
+
+    // Lock
+    int locked_lines;
+    int waited_lines;
+
+    // Measurement
+    uint64_t pixels, slips;
+    int measured_lines;
+    int no_detail;            // Ended by PLL_TUNE_MEASURE_MAX: too few short runs in the picture
+    double drift;             // Of the last measurement [samples per line]
+
+    // Search
+    int best;                 // Setting with the smallest drift so far
+    double best_drift;        // (< 0: none measured yet)
+    int dir;                  // Side of the current trial (+1 / -1)
+    int flipped;              // The other side has been tried from best
+    int trials;
+
+    // Statistics
+    uint64_t lines;           // Since init
+};
+
+void pll_tuner_init(pll_tuner *t, int h_pixels, int oversample);
+
+// Feed the next n samples. Returns 1 when t->h_pixels has changed and the
+// PLL has to be set to it.
+int pll_tuner_feed(pll_tuner *t, const uint8_t *p, size_t n);
+
+// The stream restarts at the new setting (the stream marker): the line in
+// progress is dropped and the lock is waited for again, the search goes on
+void pll_tuner_restart(pll_tuner *t);
+
+#endif
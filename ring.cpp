@@ -0,0 +1,101 @@
+//
+// Lock-free single-producer / single-consumer block ring
+//
+#include "ring.h"
+#include "telemetry.h"
+
+#include <chrono>
+
+spsc_ring::~spsc_ring() {
+    delete[] buf;
+    delete[] len;
+    delete[] stamp;
+}
+
+int spsc_ring::init(size_t block_size, int blocks) {
+    if (blocks < 3) {
+        return -1;
+    }
+    delete[] buf;
+    delete[] len;
+    delete[] stamp;
+    buf = new uint8_t[block_size * blocks];
+    len = new long[blocks];
+    stamp = new uint64_t[blocks];
+    this->block_size = block_size;
+    this->blocks = blocks;
+    reset();
+    return 0;
+}
+
+void spsc_ring::reset(void) {
+    head.store(0);
+    tail.store(0);
+}
+
+//----------------------------------------------------------------------
+// Producer
+//----------------------------------------------------------------------
+void spsc_ring::commit(long length) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+
+    len[h % blocks] = length;
+    stamp[h % blocks] = telemetry_now_us();
+    head.store(h + 1, std::memory_order_seq_cst);
+
+    // Wake the consumer only if it sleeps
+    if (waiting.load(std::memory_order_seq_cst)) {
+        std::lock_guard<std::mutex> guard(lock);
+        cond.notify_one();
+    }
+}
+
+//----------------------------------------------------------------------
+// Consumer
+//----------------------------------------------------------------------
+// Drop the blocks which are no longer safe to read. done blocks starting
+// from tail have been read already and are never handed out again.
+int spsc_ring::skip_lost(uint64_t h, int done) {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    if (h - t <= (uint64_t)safe_blocks()) {
+        return 0;
+    }
+
+    // Leave some room so that the next read is not lapped right away
+    uint64_t nt = h - blocks / 2;
+    if (nt < t + done) {
+        nt = t + done;
+    }
+    lost.fetch_add(nt - t, std::memory_order_relaxed);
+    tail.store(nt, std::memory_order_release);
+    return (int)(nt - t);
+}
+
+int spsc_ring::acquire(int min_blocks, int timeout_ms) {
+    uint64_t h = head.load(std::memory_order_acquire);
+    skip_lost(h, 0);
+
+    if (h - tail.load(std::memory_order_relaxed) < (uint64_t)min_blocks) {
+        std::unique_lock<std::mutex> guard(lock);
+        waiting.store(1, std::memory_order_seq_cst);
+        cond.wait_for(guard, std::chrono::milliseconds(timeout_ms), [&] {
+            h = head.load(std::memory_order_seq_cst);
+            return h - tail.load(std::memory_order_relaxed) >= (uint64_t)min_blocks;
+        });
+        waiting.store(0, std::memory_order_relaxed);
+        skip_lost(h, 0);
+    }
+
+    uint64_t ready = h - tail.load(std::memory_order_relaxed);
+    return (int)ready;
+}
+
+int spsc_ring::release(int n) {
+    // The blocks read so far were intact if their slots have not been
+    // reached by the producer in the meantime
+    int dropped = skip_lost(head.load(std::memory_order_acquire), n);
+    if (dropped == 0) {
+        tail.store(tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+    return dropped;
+}
@@ -0,0 +1,95 @@
+//
+// Lock-free single-producer / single-consumer block ring
+//
+// The producer (USB thread) fills the blocks in place and commits them in
+// order, the consumer (decoder) acquires every committed block in one go
+// and releases them when done. The producer never waits: when it laps the
+// consumer, the lost blocks are counted as overruns.
+//
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+class spsc_ring {
+public:
+    spsc_ring() : buf(NULL), len(NULL), stamp(NULL), block_size(0), blocks(0), head(0), tail(0), lost(0), waiting(0) {}
+    ~spsc_ring();
+
+    // Allocate blocks x block_size bytes. Returns 0 on success, -1 on error
+    int init(size_t block_size, int blocks);
+
+    size_t get_block_size(void) const { return block_size; }
+    int get_blocks(void) const { return blocks; }
+
+    //------------------------------------------------------------------
+    // Producer
+    //------------------------------------------------------------------
+    // Memory of block slot i (0 .. blocks - 1), e.g. a USB transfer buffer
+    uint8_t *block(int i) { return &buf[i * block_size]; }
+
+    // The next block (in slot order) has been filled with length bytes
+    void commit(long length);
+
+    //------------------------------------------------------------------
+    // Consumer
+    //------------------------------------------------------------------
+    // Wait until at least min_blocks are committed or timeout_ms elapses.
+    // Returns the number of blocks ready to read (may be 0).
+    int acquire(int min_blocks, int timeout_ms);
+
+    // k-th acquired block (k = 0 is the oldest)
+    const uint8_t *peek(int k, long *length) const {
+        int slot = (int)((tail.load(std::memory_order_relaxed) + k) % blocks);
+        *length = len[slot];
+        return &buf[slot * block_size];
+    }
+
+    // When the k-th acquired block was committed (telemetry_now_us())
+    uint64_t commit_time(int k) const {
+        return stamp[(tail.load(std::memory_order_relaxed) + k) % blocks];
+    }
+
+    // Hand back the n oldest blocks. Returns the number of blocks lost
+    // because the producer has overwritten them (0 when the data was intact).
+    int release(int n);
+
+    // Blocks committed but not released yet
+    int occupancy(void) const {
+        return (int)(head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed));
+    }
+
+    // Total number of lost blocks
+    uint64_t overruns(void) const { return lost.load(std::memory_order_relaxed); }
+
+    // Restart both indices (only while the producer is stopped)
+    void reset(void);
+
+private:
+    // The producer may already be writing into the slot of the block
+    // (blocks - 1) behind the newest one, so only (blocks - 2) are safe.
+    int safe_blocks(void) const { return blocks - 2; }
+    int skip_lost(uint64_t h, int done);
+
+    uint8_t *buf;
+    long *len;
+    uint64_t *stamp;
+    size_t block_size;
+    int blocks;
+
+    std::atomic<uint64_t> head;    // Blocks committed (written by producer)
+    std::atomic<uint64_t> tail;    // Blocks released (written by consumer)
+    std::atomic<uint64_t> lost;
+
+    // Sleeping consumer
+    std::atomic<int> waiting;
+    std::mutex lock;
+    std::condition_variable cond;
+};
+
+#endif
@@ -0,0 +1,282 @@
+//
+// Synthetic "000VHRGB" signal generator
+//
+#include "siggen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VMASK (1 << BIT_VSYNC)
+#define HMASK (1 << BIT_HSYNC)
+
+void siggen_default_config(siggen_config *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->h_total = 896;
+    cfg->h_sync = 64;
+    cfg->h_porch = 128;
+    cfg->v_total = 262;
+    cfg->v_sync = 4;
+    cfg->v_porch = 36;
+    cfg->oversample = 2;
+    cfg->pattern = SIGGEN_BARS;
+    cfg->seed = 1;
+}
+
+// Pixels per line of the sampling clock
+static int clock_total(const siggen_config *cfg) {
+    return (cfg->pll_total > 0) ? cfg->pll_total : cfg->h_total;
+}
+
+size_t siggen_frame_size(const siggen_config *cfg) {
+    return (size_t)clock_total(cfg) * cfg->oversample * cfg->v_total;
+}
+
+static inline uint32_t next_rand(siggen *gen) {
+    // xorshift32
+    uint32_t x = gen->rand;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    gen->rand = x;
+    return x;
+}
+
+int siggen_init(siggen *gen, const siggen_config *cfg) {
+    if (cfg->oversample < 1 || cfg->h_sync < 1
+        || cfg->h_sync + cfg->h_porch + DW > cfg->h_total
+        || cfg->v_sync < 1 || cfg->v_sync + cfg->v_porch + DH > cfg->v_total
+        || (cfg->pattern == SIGGEN_IMAGE && cfg->image == NULL)) {
+        fprintf(stderr, "Siggen: Invalid timing\n");
+        return -1;
+    }
+
+    gen->cfg = *cfg;
+    int total = (clock_total(cfg) > cfg->h_total) ? clock_total(cfg) : cfg->h_total;
+    gen->line = (uint8_t *)malloc((size_t)(total + cfg->jitter) * cfg->oversample + 1);
+    gen->source = NULL;
+    if (clock_total(cfg) != cfg->h_total) {
+        gen->source = (uint8_t *)malloc((size_t)cfg->h_total * cfg->oversample);
+    }
+    if (gen->line == NULL || (clock_total(cfg) != cfg->h_total && gen->source == NULL)) {
+        siggen_free(gen);
+        return -1;
+    }
+    gen->line_len = 0;
+    gen->line_pos = 0;
+    gen->line_no = -1;
+    gen->frame_no = 0;
+    gen->rand = cfg->seed ? cfg->seed : 1;
+    gen->glitches = 0;
+    return 0;
+}
+
+void siggen_free(siggen *gen) {
+    free(gen->line);
+    free(gen->source);
+    gen->line = NULL;
+    gen->source = NULL;
+}
+
+//----------------------------------------------------------------------
+// Picture of a frame
+//----------------------------------------------------------------------
+static void draw_frame(siggen *gen) {
+    uint8_t *p = gen->frame;
+    int t = (int)gen->frame_no;
+
+    switch (gen->cfg.pattern) {
+    case SIGGEN_BARS:
+        for (int y = 0; y < DH; y++) {
+            for (int x = 0; x < DW; x++) {
+                *p++ = 7 - x * 8 / DW;
+            }
+        }
+        break;
+
+    case SIGGEN_CHECKER:
+        for (int y = 0; y < DH; y++) {
+            for (int x = 0; x < DW; x++) {
+                *p++ = ((x >> 3) ^ (y >> 3)) & 1 ? 7 : 0;
+            }
+        }
+        break;
+
+    case SIGGEN_MOVING:
+        for (int y = 0; y < DH; y++) {
+            for (int x = 0; x < DW; x++) {
+                *p++ = ((x + y + t) >> 4) & 7;
+            }
+        }
+        break;
+
+    case SIGGEN_NOISE:
+        for (int i = 0; i < DW * DH; i++) {
+            *p++ = next_rand(gen) & 7;
+        }
+        break;
+
+    case SIGGEN_IMAGE:
+        memcpy(p, gen->cfg.image, DW * DH);
+        break;
+    }
+}
+
+//----------------------------------------------------------------------
+// Samples of the next line
+//----------------------------------------------------------------------
+static void build_line(siggen *gen) {
+    const siggen_config *cfg = &gen->cfg;
+    int os = cfg->oversample;
+
+    if (++gen->line_no == cfg->v_total) {
+        gen->line_no = 0;
+        gen->frame_no++;
+    }
+    if (gen->line_no == 0) {
+        draw_frame(gen);
+    }
+
+    int l = gen->line_no;
+    int len = clock_total(cfg) * os;
+    if (cfg->jitter > 0) {
+        len += next_rand(gen) % (cfg->jitter + 1);
+    }
+    uint8_t v = (l < cfg->v_sync) ? 0 : VMASK;
+    int sync = cfg->h_sync * os;
+
+    // Built at h_total, then resampled when the clock is set to another
+    uint8_t *line = (gen->source != NULL) ? gen->source : gen->line;
+    int source_len = (gen->source != NULL) ? cfg->h_total * os : len;
+    memset(line, v, sync);
+    memset(line + sync, v | HMASK, source_len - sync);
+
+    int y = l - cfg->v_sync - cfg->v_porch;
+    if (y >= 0 && y < DH) {
+        const uint8_t *src = &gen->frame[y * DW];
+        uint8_t *dst = line + (cfg->h_sync + cfg->h_porch) * os;
+        uint8_t vh = v | HMASK;
+        if (os == 1) {
+            for (int x = 0; x < DW; x++) {
+                dst[x] = src[x] | vh;
+            }
+        } else if (os == 2) {
+            for (int x = 0; x < DW; x++) {
+                uint16_t d = (uint16_t)((src[x] | vh) * 0x0101);
+                memcpy(&dst[x * 2], &d, 2);
+            }
+        } else {
+            for (int x = 0; x < DW; x++) {
+                memset(&dst[x * os], src[x] | vh, os);
+            }
+        }
+    }
+
+    if (gen->source != NULL) {
+        // Sample i sees the source (i + phase) / len of the line on
+        double phase = (next_rand(gen) & 0xffff) / 65536.0;
+        double scale = (double)source_len / (clock_total(cfg) * os);
+        for (int i = 0; i < len; i++) {
+            int at = (int)((i + phase) * scale);
+            gen->line[i] = gen->source[(at < source_len) ? at : source_len - 1];
+        }
+    }
+
+    if (cfg->glitch_rate > 0 && (next_rand(gen) >> 8) < cfg->glitch_rate * (1 << 24)) {
+        gen->glitches++;
+        if (next_rand(gen) & 1) {
+            // Missing H-Sync pulse
+            memset(gen->line, v | HMASK, sync);
+        } else {
+            // Short H-Sync dropout somewhere in the line
+            int at = sync + next_rand(gen) % (len - sync - 8 * os);
+            memset(gen->line + at, v, 8 * os);
+        }
+    }
+
+    gen->line_len = len;
+    gen->line_pos = 0;
+}
+
+void siggen_generate(siggen *gen, uint8_t *out, size_t n) {
+    while (n > 0) {
+        if (gen->line_pos == gen->line_len) {
+            build_line(gen);
+        }
+        size_t len = gen->line_len - gen->line_pos;
+        if (len > n) {
+            len = n;
+        }
+        memcpy(out, gen->line + gen->line_pos, len);
+        gen->line_pos += (int)len;
+        out += len;
+        n -= len;
+    }
+}
+
+//----------------------------------------------------------------------
+// PPM (P6) image
+//----------------------------------------------------------------------
+static int ppm_value(FILE *fp) {
+    int c = fgetc(fp);
+
+    // Skip blanks and comments
+    while (c == '#' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) {
+                c = fgetc(fp);
+            }
+        }
+        c = fgetc(fp);
+    }
+    int v = 0;
+    if (c < '0' || c > '9') {
+        return -1;
+    }
+    while (c >= '0' && c <= '9') {
+        v = v * 10 + (c - '0');
+        c = fgetc(fp);
+    }
+    return v;  // The single blank after the value is consumed
+}
+
+int siggen_load_ppm(const char *path, uint8_t *image) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Siggen: Could not open %s\n", path);
+        return -1;
+    }
+
+    int w = -1, h = -1, max = -1;
+    if (fgetc(fp) == 'P' && fgetc(fp) == '6') {
+        w = ppm_value(fp);
+        h = ppm_value(fp);
+        max = ppm_value(fp);
+    }
+    if (w <= 0 || h <= 0 || max <= 0 || max > 255) {
+        fprintf(stderr, "Siggen: %s is not a binary PPM (P6)\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    uint8_t *rgb = (uint8_t *)malloc((size_t)w * h * 3);
+    if (rgb == NULL || fread(rgb, 3, (size_t)w * h, fp) != (size_t)w * h) {
+        fprintf(stderr, "Siggen: %s is truncated\n", path);
+        free(rgb);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    // Nearest neighbour to DW x DH
+    for (int y = 0; y < DH; y++) {
+        for (int x = 0; x < DW; x++) {
+            const uint8_t *s = &rgb[((size_t)(y * h / DH) * w + x * w / DW) * 3];
+            image[y * DW + x] = ((s[0] * 2 > max) << BIT_R)
+                              | ((s[1] * 2 > max) << BIT_G)
+                              | ((s[2] * 2 > max) << BIT_B);
+        }
+    }
+    free(rgb);
+    return 0;
+}
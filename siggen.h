@@ -0,0 +1,77 @@
+//
+// Synthetic "000VHRGB" signal generator
+//
+// Produces the byte stream the FX2 would deliver from a real machine, with
+// configurable timing, oversampling, jitter and sync glitches. Lines are
+// built once per line and copied out, so generation runs at memcpy speed.
+//
+// pll_total samples the lines like the CS2300-CP set to another H_TOTAL:
+// pll_total x oversample samples per line, at a phase against H-Sync which
+// is new on every line.
+//
+#ifndef SIGGEN_H
+#define SIGGEN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "decoder.h"
+
+// Test patterns
+enum {
+    SIGGEN_BARS,      // 8 vertical color bars
+    SIGGEN_CHECKER,   // 8x8 checker board
+    SIGGEN_MOVING,    // Diagonal stripes, moving every frame
+    SIGGEN_NOISE,     // Random pixels, new every frame
+    SIGGEN_IMAGE,     // siggen_config.image
+};
+
+struct siggen_config {
+    int h_total;          // Pixels per line (896 X1turbo, 912 Pasopia7)
+    int h_sync;           // H-Sync width [pixels]
+    int h_porch;          // H-Sync end to the first pixel [pixels]
+    int v_total;          // Lines per frame
+    int v_sync;           // V-Sync width [lines]
+    int v_porch;          // V-Sync end to the first line [lines]
+    int oversample;       // Samples per pixel (2: CS2300-CP)
+    int pll_total;        // H_TOTAL of the sampling clock, 0: h_total (locked)
+    int jitter;           // Up to this many extra samples at the end of a line
+    double glitch_rate;   // Probability of a broken H-Sync per line
+    int pattern;
+    const uint8_t *image; // DW x DH palette indices for SIGGEN_IMAGE
+    uint32_t seed;
+};
+
+// X1turbo timing (h_porch / v_porch match the decoder defaults)
+void siggen_default_config(siggen_config *cfg);
+
+struct siggen {
+    siggen_config cfg;
+
+    uint8_t frame[DW * DH];   // Picture of the current frame
+    uint8_t *line;            // Samples of the current line
+    uint8_t *source;          // The line at h_total, resampled into line (pll_total)
+    int line_len;
+    int line_pos;
+    int line_no;
+    uint64_t frame_no;
+    uint32_t rand;
+
+    // Statistics
+    uint64_t glitches;
+};
+
+int siggen_init(siggen *gen, const siggen_config *cfg);
+void siggen_free(siggen *gen);
+
+// Fill out with the next n samples
+void siggen_generate(siggen *gen, uint8_t *out, size_t n);
+
+// Samples per frame without jitter
+size_t siggen_frame_size(const siggen_config *cfg);
+
+// Load a binary PPM (P6) image, scaled to DW x DH and reduced to the
+// 8 colors (each channel thresholded at half). Returns 0 on success.
+int siggen_load_ppm(const char *path, uint8_t *image);
+
+#endif
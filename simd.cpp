@@ -0,0 +1,675 @@
+//
+// Vectorized kernels for the "000VHRGB" sample stream
+//
+#include "simd.h"
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#else
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+//----------------------------------------------------------------------
+// Helpers
+//----------------------------------------------------------------------
+static inline int ctz32(uint32_t x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int)i;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+static inline int ctz64(uint64_t x) {
+#ifdef _MSC_VER
+#if defined(_M_X64) || defined(_M_ARM64)
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int)i;
+#else
+    uint32_t lo = (uint32_t)x;
+    return lo ? ctz32(lo) : 32 + ctz32((uint32_t)(x >> 32));
+#endif
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+//----------------------------------------------------------------------
+// Scalar (SWAR, 8 samples at a time)
+//----------------------------------------------------------------------
+// mask is a single bit, so each byte of (w & m) is either 0 or mask and
+// the first non-zero byte is the first match (little endian).
+static size_t scan_scalar(const uint8_t *p, size_t n, uint8_t mask, int want_set) {
+    const uint64_t m = 0x0101010101010101ULL * mask;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        uint64_t t = (want_set ? w : ~w) & m;
+        if (t) {
+            return i + (ctz64(t) >> 3);
+        }
+    }
+    for (; i < n; i++) {
+        if (((p[i] & mask) != 0) == (want_set != 0)) {
+            return i;
+        }
+    }
+    return n;
+}
+
+static size_t run_scalar(const uint8_t *p, size_t n) {
+    const uint64_t m = 0x0101010101010101ULL * p[0];
+    size_t i = 1;
+
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        if (w != m) {
+            return i + (ctz64(w ^ m) >> 3);
+        }
+    }
+    for (; i < n && p[i] == p[0]; i++)
+        ;
+    return i;
+}
+
+//----------------------------------------------------------------------
+// Active pixels (scalar)
+//----------------------------------------------------------------------
+static size_t extract_scalar(const uint8_t *src, uint8_t *dst, size_t count, int step, uint8_t vhmask, uint8_t vhidle) {
+    src += step - 1;  // Only the last sample of a pixel is used
+    for (size_t x = 0; x < count; x++) {
+        uint8_t d = src[x * step];
+        if ((d & vhmask) != vhidle) {
+            return x;
+        }
+        dst[x] = d & 7;
+    }
+    return count;
+}
+
+//----------------------------------------------------------------------
+// Palette expansion (scalar)
+//----------------------------------------------------------------------
+static void expand32_scalar(const uint8_t *src, uint32_t *dst, size_t n, const uint32_t *lut) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = lut[src[i] & 7];
+    }
+}
+
+static void expand16_scalar(const uint8_t *src, uint16_t *dst, size_t n, const uint16_t *lut) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = lut[src[i] & 7];
+    }
+}
+
+static void expand8_scalar(const uint8_t *src, uint8_t *dst, size_t n, const uint8_t *lut) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = lut[src[i] & 7];
+    }
+}
+
+// Byte k of every lut entry, as a 16 entries byte shuffle table
+static inline void lut_planes32(const uint32_t *lut, uint8_t planes[4][16]) {
+    for (int k = 0; k < 4; k++) {
+        for (int i = 0; i < 16; i++) {
+            planes[k][i] = (uint8_t)(lut[i & 7] >> (k * 8));
+        }
+    }
+}
+
+static inline void lut_planes16(const uint16_t *lut, uint8_t planes[2][16]) {
+    for (int k = 0; k < 2; k++) {
+        for (int i = 0; i < 16; i++) {
+            planes[k][i] = (uint8_t)(lut[i & 7] >> (k * 8));
+        }
+    }
+}
+
+static inline void lut_plane8(const uint8_t *lut, uint8_t plane[16]) {
+    for (int i = 0; i < 16; i++) {
+        plane[i] = lut[i & 7];
+    }
+}
+
+#ifdef SIMD_X86
+//----------------------------------------------------------------------
+// SSE2 (64 samples per iteration)
+//----------------------------------------------------------------------
+static size_t scan_sse2(const uint8_t *p, size_t n, uint8_t mask, int want_set) {
+    const __m128i m = _mm_set1_epi8((char)mask);
+    const __m128i zero = _mm_setzero_si128();
+    const uint32_t flip = want_set ? 0xffff : 0;
+    size_t i = 0;
+
+    // Compare (d & mask) == 0, 0xff where the bit is clear
+#define CLR(off) _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i *)(p + i + off)), m), zero)
+
+    for (; i + 64 <= n; i += 64) {
+        __m128i a = CLR(0), b = CLR(16), c = CLR(32), d = CLR(48);
+        uint32_t any;
+        if (want_set) {
+            any = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d))) ^ 0xffff;
+        } else {
+            any = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)));
+        }
+        if (any) {
+            uint64_t bits = (uint64_t)(_mm_movemask_epi8(a) ^ flip)
+                          | (uint64_t)(_mm_movemask_epi8(b) ^ flip) << 16
+                          | (uint64_t)(_mm_movemask_epi8(c) ^ flip) << 32
+                          | (uint64_t)(_mm_movemask_epi8(d) ^ flip) << 48;
+            return i + ctz64(bits);
+        }
+    }
+    for (; i + 16 <= n; i += 16) {
+        uint32_t bits = _mm_movemask_epi8(CLR(0)) ^ flip;
+        if (bits) {
+            return i + ctz32(bits);
+        }
+    }
+#undef CLR
+    return i + scan_scalar(p + i, n - i, mask, want_set);
+}
+
+// Runs are mostly short (a pixel or a few), 16 samples per iteration
+static size_t run_sse2(const uint8_t *p, size_t n) {
+    const __m128i m = _mm_set1_epi8((char)p[0]);
+    size_t i = 1;
+
+    for (; i + 16 <= n; i += 16) {
+        uint32_t bits = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), m)) ^ 0xffff;
+        if (bits) {
+            return i + ctz32(bits);
+        }
+    }
+    return i - 1 + run_scalar(p + i - 1, n - i + 1);
+}
+
+//----------------------------------------------------------------------
+// Active pixels (SSE2, 16 pixels per iteration)
+//----------------------------------------------------------------------
+static size_t extract_sse2(const uint8_t *src, uint8_t *dst, size_t count, int step, uint8_t vhmask, uint8_t vhidle) {
+    if (step != 1 && step != 2) {
+        return extract_scalar(src, dst, count, step, vhmask, vhidle);
+    }
+    const __m128i vh = _mm_set1_epi8((char)vhmask);
+    const __m128i idle = _mm_set1_epi8((char)vhidle);
+    const __m128i rgb = _mm_set1_epi8(7);
+    size_t x = 0;
+
+    for (; x + 16 <= count; x += 16) {
+        __m128i d;
+        if (step == 2) {
+            // Odd samples: high byte of each 16bit word
+            __m128i a = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src + x * 2)), 8);
+            __m128i b = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src + x * 2 + 16)), 8);
+            d = _mm_packus_epi16(a, b);
+        } else {
+            d = _mm_loadu_si128((const __m128i *)(src + x));
+        }
+        uint32_t ok = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(d, vh), idle));
+        if (ok != 0xffff) {
+            // Sync is lost within these pixels
+            return x + extract_scalar(src + x * step, dst + x, 16, step, vhmask, vhidle);
+        }
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_and_si128(d, rgb));
+    }
+    return x + extract_scalar(src + x * step, dst + x, count - x, step, vhmask, vhidle);
+}
+
+//----------------------------------------------------------------------
+// AVX2 (128 samples per iteration)
+//----------------------------------------------------------------------
+TARGET_AVX2 static size_t scan_avx2(const uint8_t *p, size_t n, uint8_t mask, int want_set) {
+    const __m256i m = _mm256_set1_epi8((char)mask);
+    const __m256i zero = _mm256_setzero_si256();
+    const uint32_t flip = want_set ? 0xffffffff : 0;
+    size_t i = 0;
+
+#define CLR(off) _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + i + off)), m), zero)
+
+    for (; i + 128 <= n; i += 128) {
+        __m256i a = CLR(0), b = CLR(32), c = CLR(64), d = CLR(96);
+        uint32_t any;
+        if (want_set) {
+            any = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, d))) ^ flip;
+        } else {
+            any = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d)));
+        }
+        if (any) {
+            uint64_t lo = (uint64_t)((uint32_t)_mm256_movemask_epi8(a) ^ flip)
+                        | (uint64_t)((uint32_t)_mm256_movemask_epi8(b) ^ flip) << 32;
+            if (lo) {
+                return i + ctz64(lo);
+            }
+            uint64_t hi = (uint64_t)((uint32_t)_mm256_movemask_epi8(c) ^ flip)
+                        | (uint64_t)((uint32_t)_mm256_movemask_epi8(d) ^ flip) << 32;
+            return i + 64 + ctz64(hi);
+        }
+    }
+    for (; i + 32 <= n; i += 32) {
+        uint32_t bits = (uint32_t)_mm256_movemask_epi8(CLR(0)) ^ flip;
+        if (bits) {
+            return i + ctz32(bits);
+        }
+    }
+#undef CLR
+    // Not the SSE2 kernel: mixing legacy SSE code costs a state transition
+    return i + scan_scalar(p + i, n - i, mask, want_set);
+}
+
+TARGET_AVX2 static size_t run_avx2(const uint8_t *p, size_t n) {
+    const __m256i m = _mm256_set1_epi8((char)p[0]);
+    size_t i = 1;
+
+    for (; i + 32 <= n; i += 32) {
+        uint32_t bits = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), m)) ^ 0xffffffff;
+        if (bits) {
+            return i + ctz32(bits);
+        }
+    }
+    return i - 1 + run_scalar(p + i - 1, n - i + 1);
+}
+
+//----------------------------------------------------------------------
+// Active pixels (AVX2, 32 pixels per iteration)
+//----------------------------------------------------------------------
+TARGET_AVX2 static size_t extract_avx2(const uint8_t *src, uint8_t *dst, size_t count, int step, uint8_t vhmask, uint8_t vhidle) {
+    if (step != 1 && step != 2) {
+        return extract_scalar(src, dst, count, step, vhmask, vhidle);
+    }
+    const __m256i vh = _mm256_set1_epi8((char)vhmask);
+    const __m256i idle = _mm256_set1_epi8((char)vhidle);
+    const __m256i rgb = _mm256_set1_epi8(7);
+    size_t x = 0;
+
+    for (; x + 32 <= count; x += 32) {
+        __m256i d;
+        if (step == 2) {
+            // packus works per 128bit lane, put the quadwords back in order
+            __m256i a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(src + x * 2)), 8);
+            __m256i b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(src + x * 2 + 32)), 8);
+            d = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        } else {
+            d = _mm256_loadu_si256((const __m256i *)(src + x));
+        }
+        uint32_t ok = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(d, vh), idle));
+        if (ok != 0xffffffff) {
+            return x + extract_scalar(src + x * step, dst + x, 32, step, vhmask, vhidle);
+        }
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_and_si256(d, rgb));
+    }
+    // Scalar tail, as in scan_avx2()
+    return x + extract_scalar(src + x * step, dst + x, count - x, step, vhmask, vhidle);
+}
+
+//----------------------------------------------------------------------
+// Palette expansion (SSSE3 pshufb, 16 pixels per iteration)
+//----------------------------------------------------------------------
+TARGET_SSSE3 static void expand32_ssse3(const uint8_t *src, uint32_t *dst, size_t n, const uint32_t *lut) {
+    uint8_t planes[4][16];
+    lut_planes32(lut, planes);
+    const __m128i t0 = _mm_loadu_si128((const __m128i *)planes[0]);
+    const __m128i t1 = _mm_loadu_si128((const __m128i *)planes[1]);
+    const __m128i t2 = _mm_loadu_si128((const __m128i *)planes[2]);
+    const __m128i t3 = _mm_loadu_si128((const __m128i *)planes[3]);
+    const __m128i idx = _mm_set1_epi8(7);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i)), idx);
+        __m128i b0 = _mm_shuffle_epi8(t0, x);
+        __m128i b1 = _mm_shuffle_epi8(t1, x);
+        __m128i b2 = _mm_shuffle_epi8(t2, x);
+        __m128i b3 = _mm_shuffle_epi8(t3, x);
+        // Interleave the byte planes into pixels
+        __m128i lo01 = _mm_unpacklo_epi8(b0, b1), hi01 = _mm_unpackhi_epi8(b0, b1);
+        __m128i lo23 = _mm_unpacklo_epi8(b2, b3), hi23 = _mm_unpackhi_epi8(b2, b3);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(lo01, lo23));
+        _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(lo01, lo23));
+        _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpacklo_epi16(hi01, hi23));
+        _mm_storeu_si128((__m128i *)(dst + i + 12), _mm_unpackhi_epi16(hi01, hi23));
+    }
+    expand32_scalar(src + i, dst + i, n - i, lut);
+}
+
+TARGET_SSSE3 static void expand16_ssse3(const uint8_t *src, uint16_t *dst, size_t n, const uint16_t *lut) {
+    uint8_t planes[2][16];
+    lut_planes16(lut, planes);
+    const __m128i t0 = _mm_loadu_si128((const __m128i *)planes[0]);
+    const __m128i t1 = _mm_loadu_si128((const __m128i *)planes[1]);
+    const __m128i idx = _mm_set1_epi8(7);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i)), idx);
+        __m128i b0 = _mm_shuffle_epi8(t0, x);
+        __m128i b1 = _mm_shuffle_epi8(t1, x);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi8(b0, b1));
+        _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(b0, b1));
+    }
+    expand16_scalar(src + i, dst + i, n - i, lut);
+}
+
+TARGET_SSSE3 static void expand8_ssse3(const uint8_t *src, uint8_t *dst, size_t n, const uint8_t *lut) {
+    uint8_t plane[16];
+    lut_plane8(lut, plane);
+    const __m128i t = _mm_loadu_si128((const __m128i *)plane);
+    const __m128i idx = _mm_set1_epi8(7);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i)), idx);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(t, x));
+    }
+    expand8_scalar(src + i, dst + i, n - i, lut);
+}
+
+//----------------------------------------------------------------------
+// Palette expansion (AVX2 vpshufb, 32 pixels per iteration)
+//----------------------------------------------------------------------
+TARGET_AVX2 static void expand32_avx2(const uint8_t *src, uint32_t *dst, size_t n, const uint32_t *lut) {
+    uint8_t planes[4][16];
+    lut_planes32(lut, planes);
+    const __m256i t0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)planes[0]));
+    const __m256i t1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)planes[1]));
+    const __m256i t2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)planes[2]));
+    const __m256i t3 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)planes[3]));
+    const __m256i idx = _mm256_set1_epi8(7);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i)), idx);
+        __m256i b0 = _mm256_shuffle_epi8(t0, x);
+        __m256i b1 = _mm256_shuffle_epi8(t1, x);
+        __m256i b2 = _mm256_shuffle_epi8(t2, x);
+        __m256i b3 = _mm256_shuffle_epi8(t3, x);
+        // Unpacks work per 128bit lane: p0 holds pixels 0-3 and 16-19, and so on
+        __m256i lo01 = _mm256_unpacklo_epi8(b0, b1), hi01 = _mm256_unpackhi_epi8(b0, b1);
+        __m256i lo23 = _mm256_unpacklo_epi8(b2, b3), hi23 = _mm256_unpackhi_epi8(b2, b3);
+        __m256i p0 = _mm256_unpacklo_epi16(lo01, lo23), p1 = _mm256_unpackhi_epi16(lo01, lo23);
+        __m256i p2 = _mm256_unpacklo_epi16(hi01, hi23), p3 = _mm256_unpackhi_epi16(hi01, hi23);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i + 8), _mm256_permute2x128_si256(p2, p3, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i + 16), _mm256_permute2x128_si256(p0, p1, 0x31));
+        _mm256_storeu_si256((__m256i *)(dst + i + 24), _mm256_permute2x128_si256(p2, p3, 0x31));
+    }
+    // Scalar tail, as in scan_avx2()
+    expand32_scalar(src + i, dst + i, n - i, lut);
+}
+
+TARGET_AVX2 static void expand16_avx2(const uint8_t *src, uint16_t *dst, size_t n, const uint16_t *lut) {
+    uint8_t planes[2][16];
+    lut_planes16(lut, planes);
+    const __m256i t0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)planes[0]));
+    const __m256i t1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)planes[1]));
+    const __m256i idx = _mm256_set1_epi8(7);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i)), idx);
+        __m256i b0 = _mm256_shuffle_epi8(t0, x);
+        __m256i b1 = _mm256_shuffle_epi8(t1, x);
+        __m256i lo = _mm256_unpacklo_epi8(b0, b1), hi = _mm256_unpackhi_epi8(b0, b1);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    expand16_scalar(src + i, dst + i, n - i, lut);
+}
+
+TARGET_AVX2 static void expand8_avx2(const uint8_t *src, uint8_t *dst, size_t n, const uint8_t *lut) {
+    uint8_t plane[16];
+    lut_plane8(lut, plane);
+    const __m256i t = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)plane));
+    const __m256i idx = _mm256_set1_epi8(7);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i)), idx);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(t, x));
+    }
+    expand8_scalar(src + i, dst + i, n - i, lut);
+}
+
+static int has_ssse3(void) {
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 1);
+    return (r[2] & (1 << 9)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static int has_avx2(void) {
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7) {
+        return 0;
+    }
+    __cpuid(r, 1);
+    // OSXSAVE and AVX, and the OS saves the YMM state
+    if ((r[2] & (1 << 27)) == 0 || (r[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) {
+        return 0;
+    }
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef SIMD_NEON
+//----------------------------------------------------------------------
+// NEON (64 samples per iteration)
+//----------------------------------------------------------------------
+// Narrowing shift packs a 16 bytes compare result into 4 bits per sample
+static inline uint64_t neon_bits(uint8x16_t t) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(t), 4)), 0);
+}
+
+static size_t scan_neon(const uint8_t *p, size_t n, uint8_t mask, int want_set) {
+    const uint8x16_t m = vdupq_n_u8(mask);
+    size_t i = 0;
+
+    // 0xff where the sample matches
+#define HIT(off) (want_set ? vtstq_u8(vld1q_u8(p + i + off), m) : vceqq_u8(vandq_u8(vld1q_u8(p + i + off), m), vdupq_n_u8(0)))
+
+    for (; i + 64 <= n; i += 64) {
+        uint8x16_t a = HIT(0), b = HIT(16), c = HIT(32), d = HIT(48);
+        if (vmaxvq_u8(vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d)))) {
+            uint64_t bits;
+            if ((bits = neon_bits(a)) != 0) return i + (ctz64(bits) >> 2);
+            if ((bits = neon_bits(b)) != 0) return i + 16 + (ctz64(bits) >> 2);
+            if ((bits = neon_bits(c)) != 0) return i + 32 + (ctz64(bits) >> 2);
+            return i + 48 + (ctz64(neon_bits(d)) >> 2);
+        }
+    }
+    for (; i + 16 <= n; i += 16) {
+        uint64_t bits = neon_bits(HIT(0));
+        if (bits) {
+            return i + (ctz64(bits) >> 2);
+        }
+    }
+#undef HIT
+    return i + scan_scalar(p + i, n - i, mask, want_set);
+}
+
+static size_t run_neon(const uint8_t *p, size_t n) {
+    const uint8x16_t m = vdupq_n_u8(p[0]);
+    size_t i = 1;
+
+    for (; i + 16 <= n; i += 16) {
+        uint64_t bits = neon_bits(vmvnq_u8(vceqq_u8(vld1q_u8(p + i), m)));
+        if (bits) {
+            return i + (ctz64(bits) >> 2);
+        }
+    }
+    return i - 1 + run_scalar(p + i - 1, n - i + 1);
+}
+
+//----------------------------------------------------------------------
+// Active pixels (NEON, 16 pixels per iteration)
+//----------------------------------------------------------------------
+static size_t extract_neon(const uint8_t *src, uint8_t *dst, size_t count, int step, uint8_t vhmask, uint8_t vhidle) {
+    if (step != 1 && step != 2) {
+        return extract_scalar(src, dst, count, step, vhmask, vhidle);
+    }
+    const uint8x16_t vh = vdupq_n_u8(vhmask);
+    const uint8x16_t idle = vdupq_n_u8(vhidle);
+    const uint8x16_t rgb = vdupq_n_u8(7);
+    size_t x = 0;
+
+    for (; x + 16 <= count; x += 16) {
+        uint8x16_t d = (step == 2) ? vld2q_u8(src + x * 2).val[1] : vld1q_u8(src + x);
+        if (vminvq_u8(vceqq_u8(vandq_u8(d, vh), idle)) == 0) {
+            return x + extract_scalar(src + x * step, dst + x, 16, step, vhmask, vhidle);
+        }
+        vst1q_u8(dst + x, vandq_u8(d, rgb));
+    }
+    return x + extract_scalar(src + x * step, dst + x, count - x, step, vhmask, vhidle);
+}
+
+//----------------------------------------------------------------------
+// Palette expansion (NEON tbl, 16 pixels per iteration)
+//----------------------------------------------------------------------
+static void expand32_neon(const uint8_t *src, uint32_t *dst, size_t n, const uint32_t *lut) {
+    uint8_t planes[4][16];
+    lut_planes32(lut, planes);
+    const uint8x16_t idx = vdupq_n_u8(7);
+    uint8x16x4_t t;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t x = vandq_u8(vld1q_u8(src + i), idx);
+        for (int k = 0; k < 4; k++) {
+            t.val[k] = vqtbl1q_u8(vld1q_u8(planes[k]), x);
+        }
+        // The interleaving store puts the byte planes together
+        vst4q_u8((uint8_t *)(dst + i), t);
+    }
+    expand32_scalar(src + i, dst + i, n - i, lut);
+}
+
+static void expand16_neon(const uint8_t *src, uint16_t *dst, size_t n, const uint16_t *lut) {
+    uint8_t planes[2][16];
+    lut_planes16(lut, planes);
+    const uint8x16_t idx = vdupq_n_u8(7);
+    uint8x16x2_t t;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t x = vandq_u8(vld1q_u8(src + i), idx);
+        t.val[0] = vqtbl1q_u8(vld1q_u8(planes[0]), x);
+        t.val[1] = vqtbl1q_u8(vld1q_u8(planes[1]), x);
+        vst2q_u8((uint8_t *)(dst + i), t);
+    }
+    expand16_scalar(src + i, dst + i, n - i, lut);
+}
+
+static void expand8_neon(const uint8_t *src, uint8_t *dst, size_t n, const uint8_t *lut) {
+    uint8_t plane[16];
+    lut_plane8(lut, plane);
+    const uint8x16_t t = vld1q_u8(plane);
+    const uint8x16_t idx = vdupq_n_u8(7);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        vst1q_u8(dst + i, vqtbl1q_u8(t, vandq_u8(vld1q_u8(src + i), idx)));
+    }
+    expand8_scalar(src + i, dst + i, n - i, lut);
+}
+#endif
+
+//----------------------------------------------------------------------
+// Dispatch
+//----------------------------------------------------------------------
+typedef size_t (*scan_func)(const uint8_t *p, size_t n, uint8_t mask, int want_set);
+typedef size_t (*run_func)(const uint8_t *p, size_t n);
+typedef size_t (*extract_func)(const uint8_t *src, uint8_t *dst, size_t count, int step, uint8_t vhmask, uint8_t vhidle);
+
+typedef void (*expand32_func)(const uint8_t *src, uint32_t *dst, size_t n, const uint32_t *lut);
+typedef void (*expand16_func)(const uint8_t *src, uint16_t *dst, size_t n, const uint16_t *lut);
+typedef void (*expand8_func)(const uint8_t *src, uint8_t *dst, size_t n, const uint8_t *lut);
+
+struct simd_ops {
+    const char *name;
+    scan_func scan;
+    run_func run;
+    extract_func extract;
+    expand32_func expand32;
+    expand16_func expand16;
+    expand8_func expand8;
+};
+
+static simd_ops select_ops(void) {
+#if defined(SIMD_X86)
+    if (has_avx2()) {
+        return simd_ops{"avx2", scan_avx2, run_avx2, extract_avx2, expand32_avx2, expand16_avx2, expand8_avx2};
+    }
+    // pshufb needs SSSE3, which is not part of the x64 baseline
+    if (has_ssse3()) {
+        return simd_ops{"sse2", scan_sse2, run_sse2, extract_sse2, expand32_ssse3, expand16_ssse3, expand8_ssse3};
+    }
+    return simd_ops{"sse2", scan_sse2, run_sse2, extract_sse2, expand32_scalar, expand16_scalar, expand8_scalar};
+#elif defined(SIMD_NEON)
+    return simd_ops{"neon", scan_neon, run_neon, extract_neon, expand32_neon, expand16_neon, expand8_neon};
+#else
+    return simd_ops{"scalar", scan_scalar, run_scalar, extract_scalar, expand32_scalar, expand16_scalar, expand8_scalar};
+#endif
+}
+
+static const simd_ops ops = select_ops();
+
+size_t scan_bit_clear(const uint8_t *p, size_t n, uint8_t mask) {
+    return ops.scan(p, n, mask, 0);
+}
+
+size_t scan_bit_set(const uint8_t *p, size_t n, uint8_t mask) {
+    return ops.scan(p, n, mask, 1);
+}
+
+size_t scan_run(const uint8_t *p, size_t n) {
+    return ops.run(p, n);
+}
+
+size_t extract_pixels(const uint8_t *src, uint8_t *dst, size_t count, int step, uint8_t vhmask, uint8_t vhidle) {
+    return ops.extract(src, dst, count, step, vhmask, vhidle);
+}
+
+void expand_palette32(const uint8_t *src, uint32_t *dst, size_t n, const uint32_t lut[8]) {
+    ops.expand32(src, dst, n, lut);
+}
+
+void expand_palette16(const uint8_t *src, uint16_t *dst, size_t n, const uint16_t lut[8]) {
+    ops.expand16(src, dst, n, lut);
+}
+
+void expand_palette8(const uint8_t *src, uint8_t *dst, size_t n, const uint8_t lut[8]) {
+    ops.expand8(src, dst, n, lut);
+}
+
+const char *simd_name(void) {
+    return ops.name;
+}
@@ -0,0 +1,55 @@
+//
+// Vectorized kernels for the "000VHRGB" sample stream
+//
+// SSE2 / AVX2 on x86 (AVX2 is selected at run time), NEON on ARM,
+// and a portable scalar fallback.
+//
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Offset of the first sample with (d & mask) == 0, or n if there is none.
+// mask must be a single bit (1 << BIT_HSYNC, 1 << BIT_VSYNC)
+size_t scan_bit_clear(const uint8_t *p, size_t n, uint8_t mask);
+
+// Offset of the first sample with (d & mask) != 0, or n if there is none.
+// mask may have several bits (any of them set, e.g. the RGB bits)
+size_t scan_bit_set(const uint8_t *p, size_t n, uint8_t mask);
+
+// Falling / rising edge of a sync signal within the span.
+// The returned offset points to the first low / hi sample.
+static inline size_t find_falling_edge(const uint8_t *p, size_t n, uint8_t mask) {
+    return scan_bit_clear(p, n, mask);
+}
+
+static inline size_t find_rising_edge(const uint8_t *p, size_t n, uint8_t mask) {
+    return scan_bit_set(p, n, mask);
+}
+
+// Length of the run of samples equal to p[0] (1 .. n), n must be > 0
+size_t scan_run(const uint8_t *p, size_t n);
+
+// Active pixels: take the last of every step samples (step 2 for the
+// CS2300-CP 2x oversampling, 1 otherwise), mask the RGB bits and write
+// count palette indices to dst.
+// Returns the number of pixels written. A smaller value than count is the
+// position of the first pixel whose sync bits (d & vhmask) are not at the
+// idle level vhidle (sync loss), which is not written.
+// vhidle is vhmask for active low syncs.
+size_t extract_pixels(const uint8_t *src, uint8_t *dst, size_t count, int step, uint8_t vhmask, uint8_t vhidle);
+
+// Palette expansion: n palette indices (0..7) to 32-bit (ARGB8888) or
+// 16-bit (RGB565) pixels. The lut entries are stored as they are, so any
+// pixel format of that size works.
+void expand_palette32(const uint8_t *src, uint32_t *dst, size_t n, const uint32_t lut[8]);
+void expand_palette16(const uint8_t *src, uint16_t *dst, size_t n, const uint16_t lut[8]);
+
+// 8-bit version, e.g. one plane of a planar YUV picture
+void expand_palette8(const uint8_t *src, uint8_t *dst, size_t n, const uint8_t lut[8]);
+
+// Name of the kernel set in use ("avx2", "sse2", "neon", "scalar")
+const char *simd_name(void);
+
+#endif
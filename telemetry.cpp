@@ -0,0 +1,197 @@
+//
+// Runtime counters and latency histograms
+//
+#include "telemetry.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+const uint64_t latency_bounds_us[LATENCY_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+};
+
+void latency_hist::add(uint64_t us) {
+    int i = 0;
+    while (i < LATENCY_BUCKETS - 1 && us > latency_bounds_us[i]) {
+        i++;
+    }
+    bucket[i].fetch_add(1, std::memory_order_relaxed);
+    sum_us.fetch_add(us, std::memory_order_relaxed);
+}
+
+static void collect_hist(const latency_hist *h, uint64_t *bucket, uint64_t *sum_us) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        bucket[i] = h->bucket[i].load(std::memory_order_relaxed);
+    }
+    *sum_us = h->sum_us.load(std::memory_order_relaxed);
+}
+
+void telemetry_collect(const telemetry *m, telemetry_sample *s) {
+    memset(s, 0, sizeof(*s));
+    s->time_us = telemetry_now_us();
+    s->usb_bytes = m->usb_bytes.load(std::memory_order_relaxed);
+    s->usb_transfers = m->usb_transfers.load(std::memory_order_relaxed);
+    s->usb_timeouts = m->usb_timeouts.load(std::memory_order_relaxed);
+    s->usb_failed = m->usb_failed.load(std::memory_order_relaxed);
+    s->usb_rate = m->usb_rate.load(std::memory_order_relaxed);
+    s->usb_rate_avg = m->usb_rate_avg.load(std::memory_order_relaxed);
+    s->usb_xfer_size = m->usb_xfer_size.load(std::memory_order_relaxed);
+    s->usb_xfer_num = m->usb_xfer_num.load(std::memory_order_relaxed);
+    s->sync_lost = m->sync_lost.load(std::memory_order_relaxed);
+    collect_hist(&m->decode_latency, s->decode_latency, &s->decode_sum_us);
+    collect_hist(&m->present_latency, s->present_latency, &s->present_sum_us);
+    collect_hist(&m->band_latency, s->band_latency, &s->band_sum_us);
+}
+
+//----------------------------------------------------------------------
+// Log line
+//----------------------------------------------------------------------
+// Upper bound of the bucket where quantile q falls [ms], -1: no samples,
+// -2: beyond the last bound
+static double quantile_ms(const uint64_t *cur, const uint64_t *prev, double q) {
+    uint64_t n[LATENCY_BUCKETS], total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        n[i] = cur[i] - (prev ? prev[i] : 0);
+        total += n[i];
+    }
+    if (total == 0) {
+        return -1;
+    }
+    uint64_t rank = (uint64_t)(q * total + 0.5), seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        seen += n[i];
+        if (seen >= rank) {
+            return latency_bounds_us[i] / 1000.0;
+        }
+    }
+    return -2;
+}
+
+// "x ms", or ">y ms" beyond the last bound y
+static void format_quantile(char *buf, size_t size, double ms) {
+    if (ms == -2) {
+        snprintf(buf, size, ">%.3g ms", latency_bounds_us[LATENCY_BUCKETS - 2] / 1000.0);
+    } else {
+        snprintf(buf, size, "%.3g ms", ms);
+    }
+}
+
+// "p50 x ms p99 y ms" of the interval
+static void quantiles(char *buf, size_t size, const uint64_t *cur, const uint64_t *prev) {
+    double p50 = quantile_ms(cur, prev, 0.5);
+    if (p50 == -1) {
+        snprintf(buf, size, "none");
+        return;
+    }
+    char q50[16], q99[16];
+    format_quantile(q50, sizeof(q50), p50);
+    format_quantile(q99, sizeof(q99), quantile_ms(cur, prev, 0.99));
+    snprintf(buf, size, "p50 %s p99 %s", q50, q99);
+}
+
+void telemetry_log(const telemetry_sample *s, const telemetry_sample *prev, const char *name, FILE *fp) {
+    static const telemetry_sample zero = {};
+    const telemetry_sample *p = prev ? prev : &zero;
+    double sec = prev ? (s->time_us - prev->time_us) / 1e6 : 0;
+    if (sec <= 0) {
+        sec = 1;
+    }
+
+    char decode[64], present[64], band[64];
+    quantiles(decode, sizeof(decode), s->decode_latency, prev ? p->decode_latency : NULL);
+    quantiles(present, sizeof(present), s->present_latency, prev ? p->present_latency : NULL);
+    quantiles(band, sizeof(band), s->band_latency, prev ? p->band_latency : NULL);
+
+    fprintf(fp,
+            "%susb %.2f MB/s (avg %.2f), %llu x %llu KiB, %llu timeouts, %llu failed | ring %d/%d, %llu overruns | "
+            "%.1f fps decoded, %.1f presented, %llu skipped, %llu sync lost | "
+            "decode %s | present %s | band %s\n",
+            name, s->usb_rate / 1048576.0, s->usb_rate_avg / 1048576.0, (unsigned long long)s->usb_xfer_num,
+            (unsigned long long)(s->usb_xfer_size / 1024), (unsigned long long)(s->usb_timeouts - p->usb_timeouts),
+            (unsigned long long)(s->usb_failed - p->usb_failed), s->ring_occupancy, s->ring_blocks,
+            (unsigned long long)(s->ring_overruns - p->ring_overruns), (s->frames_decoded - p->frames_decoded) / sec,
+            (s->frames_presented - p->frames_presented) / sec, (unsigned long long)(s->frames_skipped - p->frames_skipped),
+            (unsigned long long)(s->sync_lost - p->sync_lost), decode, present, band);
+}
+
+//----------------------------------------------------------------------
+// Prometheus text
+//----------------------------------------------------------------------
+struct text_buf {
+    char *p;
+    size_t size, len;
+    bool full;
+};
+
+static void put(text_buf *t, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(t->p + t->len, t->size - t->len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= t->size - t->len) {
+        t->full = true;
+        return;
+    }
+    t->len += n;
+}
+
+// Samples of all the devices: one family per metric, one series per device
+#define FOR_DEVICES(i) for (int i = 0; i < n; i++)
+
+static void put_head(text_buf *t, const char *name, const char *type, const char *help) {
+    put(t, "# HELP drgb_%s %s\n# TYPE drgb_%s %s\n", name, help, name, type);
+}
+
+#define PUT_METRIC(name, type, help, field)                                                 \
+    do {                                                                                    \
+        put_head(&t, name, type, help);                                                     \
+        FOR_DEVICES(i) {                                                                    \
+            put(&t, "drgb_%s{device=\"%d\"} %llu\n", name, i, (unsigned long long)s[i].field); \
+        }                                                                                   \
+    } while (0)
+
+static void put_hist(text_buf *t, const char *name, int device, const uint64_t *bucket, uint64_t sum_us) {
+    uint64_t count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        count += bucket[i];
+        put(t, "drgb_%s_bucket{device=\"%d\",le=\"%g\"} %llu\n", name, device, latency_bounds_us[i] / 1e6,
+            (unsigned long long)count);
+    }
+    count += bucket[LATENCY_BUCKETS - 1];
+    put(t, "drgb_%s_bucket{device=\"%d\",le=\"+Inf\"} %llu\n", name, device, (unsigned long long)count);
+    put(t, "drgb_%s_sum{device=\"%d\"} %.6f\ndrgb_%s_count{device=\"%d\"} %llu\n", name, device, sum_us / 1e6, name,
+        device, (unsigned long long)count);
+}
+
+#define PUT_HIST(name, help, field, sum)                        \
+    do {                                                        \
+        put_head(&t, name, "histogram", help);                  \
+        FOR_DEVICES(i) {                                        \
+            put_hist(&t, name, i, s[i].field, s[i].sum);        \
+        }                                                       \
+    } while (0)
+
+size_t telemetry_format(const telemetry_sample *s, int n, char *buf, size_t size) {
+    text_buf t = {buf, size, 0, false};
+
+    PUT_METRIC("usb_bytes_total", "counter", "Bytes received from EP6", usb_bytes);
+    PUT_METRIC("usb_transfers_total", "counter", "Completed bulk transfers", usb_transfers);
+    PUT_METRIC("usb_timeouts_total", "counter", "Transfer waits which timed out", usb_timeouts);
+    PUT_METRIC("usb_failed_total", "counter", "Failed bulk transfers", usb_failed);
+    PUT_METRIC("usb_rate_bytes", "gauge", "Receive rate of the last second [bytes/s]", usb_rate);
+    PUT_METRIC("usb_rate_avg_bytes", "gauge", "Moving average of the receive rate [bytes/s]", usb_rate_avg);
+    PUT_METRIC("usb_xfer_bytes", "gauge", "Bytes per bulk transfer", usb_xfer_size);
+    PUT_METRIC("usb_xfers", "gauge", "Bulk transfers in flight", usb_xfer_num);
+    PUT_METRIC("ring_blocks", "gauge", "Blocks of the receive ring", ring_blocks);
+    PUT_METRIC("ring_occupancy", "gauge", "Blocks waiting for the decoder", ring_occupancy);
+    PUT_METRIC("ring_overruns_total", "counter", "Blocks lost because the decoder fell behind", ring_overruns);
+    PUT_METRIC("frames_decoded_total", "counter", "Frames decoded", frames_decoded);
+    PUT_METRIC("frames_presented_total", "counter", "Frames taken by the presenter", frames_presented);
+    PUT_METRIC("frames_skipped_total", "counter", "Frames replaced before being presented", frames_skipped);
+    PUT_METRIC("sync_lost_total", "counter", "Frames given up on sync loss", sync_lost);
+    PUT_HIST("decode_latency_seconds", "Last sample of a frame received to the frame published", decode_latency, decode_sum_us);
+    PUT_HIST("present_latency_seconds", "Frame published to presented or written", present_latency, present_sum_us);
+    PUT_HIST("band_latency_seconds", "Last sample of a band received to the band presented", band_latency, band_sum_us);
+
+    return t.full ? 0 : t.len;
+}
@@ -0,0 +1,89 @@
+//
+// Runtime counters and latency histograms
+//
+// Every capture pipeline has its own telemetry. Its USB, decode and
+// presentation threads update the counters with relaxed atomics, nothing
+// on the streaming path takes a lock. A telemetry_sample is a copy of all
+// the values at one moment. It is shown as a log line or as Prometheus
+// text, e.g. for the -metrics endpoint.
+//
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+
+// Steady clock in microseconds, the time base of all the time stamps
+// (spsc_ring commit times, frame publish times)
+static inline uint64_t telemetry_now_us(void) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Upper bounds of the latency buckets [us], and one more for the rest
+#define LATENCY_BUCKETS 12
+extern const uint64_t latency_bounds_us[LATENCY_BUCKETS - 1];
+
+struct latency_hist {
+    std::atomic<uint64_t> bucket[LATENCY_BUCKETS];   // Not cumulative
+    std::atomic<uint64_t> sum_us;
+
+    void add(uint64_t us);
+};
+
+// Starts from zero when static or value-initialized (new pipeline())
+struct telemetry {
+    // USB transfers
+    std::atomic<uint64_t> usb_bytes;
+    std::atomic<uint64_t> usb_transfers;
+    std::atomic<uint64_t> usb_timeouts;     // WaitForXfer() without completion
+    std::atomic<uint64_t> usb_failed;       // FinishDataXfer() failures
+    std::atomic<uint64_t> usb_rate;         // Bytes per second, last second
+    std::atomic<uint64_t> usb_rate_avg;     // Bytes per second, moving average
+    std::atomic<uint64_t> usb_xfer_size;    // Bytes per transfer
+    std::atomic<uint64_t> usb_xfer_num;     // Transfers in flight
+
+    // Decoder
+    std::atomic<uint64_t> sync_lost;        // Frames given up on sync loss
+
+    // Last sample of a frame received -> frame published
+    latency_hist decode_latency;
+    // Frame published -> presented (window) or written (headless)
+    latency_hist present_latency;
+    // Last sample of a band received -> band presented (-band)
+    latency_hist band_latency;
+};
+
+struct telemetry_sample {
+    uint64_t time_us;
+
+    // From the telemetry
+    uint64_t usb_bytes, usb_transfers, usb_timeouts, usb_failed;
+    uint64_t usb_rate, usb_rate_avg;
+    uint64_t usb_xfer_size, usb_xfer_num;
+    uint64_t sync_lost;
+    uint64_t decode_latency[LATENCY_BUCKETS], decode_sum_us;
+    uint64_t present_latency[LATENCY_BUCKETS], present_sum_us;
+    uint64_t band_latency[LATENCY_BUCKETS], band_sum_us;
+
+    // Filled in by the caller, they live elsewhere
+    uint64_t frames_decoded, frames_presented, frames_skipped;
+    uint64_t ring_overruns;
+    int ring_occupancy, ring_blocks;
+};
+
+// Copy the values of m (the other fields are cleared)
+void telemetry_collect(const telemetry *m, telemetry_sample *s);
+
+// One line of the rates and latency quantiles between two samples
+// (prev may be NULL: since the start), beginning with name (e.g. "#1 ")
+void telemetry_log(const telemetry_sample *s, const telemetry_sample *prev, const char *name, FILE *fp);
+
+// Prometheus text format of n devices (s[i] labelled device="i").
+// Returns the length (< size), 0 if it did not fit.
+size_t telemetry_format(const telemetry_sample *s, int n, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,278 @@
+//
+// Decode throughput benchmark
+//
+// Runs the real frame decoder over synthetic (siggen) and recorded streams
+// and reports the throughput, the cost of each decoder stage and the
+// headroom over the real-time byte rate of the source.
+//
+// Build with DECODER_PROFILE, e.g.
+//   g++ -O2 -DDECODER_PROFILE -o bench tools/bench.cpp decoder.cpp simd.cpp ring.cpp siggen.cpp capfile.cpp caprle.cpp palette.cpp -lpthread
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../decoder.h"
+#include "../simd.h"
+#include "../ring.h"
+#include "../siggen.h"
+#include "../capfile.h"
+#include "../caprle.h"
+#include "../palette.h"
+
+#ifndef DECODER_PROFILE
+#error "Build the benchmark with -DDECODER_PROFILE"
+#endif
+
+#define SPAN_SIZE (64 * 1024)
+
+static double now_sec(void) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// decoder_ticks() per second
+static double tick_rate(void) {
+    double t0 = now_sec();
+    uint64_t c0 = decoder_ticks();
+    while (now_sec() - t0 < 0.1)
+        ;
+    return (decoder_ticks() - c0) / (now_sec() - t0);
+}
+
+//----------------------------------------------------------------------
+// Input stream
+//----------------------------------------------------------------------
+struct stream {
+    const char *name;
+    const uint8_t *data;
+    size_t size;
+    int v_porch, h_porch, oversample;
+    int line_bytes;     // Samples per source line
+};
+
+//----------------------------------------------------------------------
+// Decode in spans straight from memory, with the stage breakdown
+//----------------------------------------------------------------------
+static void run_stages(const stream *s, double ticks_per_sec, double realtime) {
+    static uint8_t vram[DW * DH];
+    static uint32_t argb[DW * DH];
+    uint32_t lut[PALETTE_SIZE];
+    decoder dec;
+    uint64_t pal_ticks = 0;
+
+    palette_argb8888(palette_default, lut);
+    decoder_init(&dec, vram, s->v_porch, s->h_porch, s->oversample);
+
+    double t0 = now_sec();
+    for (size_t off = 0; off < s->size; off += SPAN_SIZE) {
+        size_t len = (s->size - off < SPAN_SIZE) ? s->size - off : SPAN_SIZE;
+        const uint8_t *p = s->data + off;
+        while (decoder_feed(&dec, &p, s->data + off + len) == DEC_FRAME) {
+            uint64_t c = decoder_ticks();
+            expand_palette32(vram, argb, DW * DH, lut);
+            pal_ticks += decoder_ticks() - c;
+        }
+    }
+    double sec = now_sec() - t0;
+
+    double mb = s->size / 1048576.0;
+    double lines = (double)s->size / s->line_bytes;
+    printf("  total     %9.1f MB/s %9.0f frames/s %7.1f ns/line  x%.0f real-time (%llu frames, %llu sync lost)\n",
+           mb / sec, dec.frames / sec, sec * 1e9 / lines, mb / sec / realtime,
+           (unsigned long long)dec.frames, (unsigned long long)dec.sync_lost);
+
+    static const char *names[DEC_STAGES] = {"sync", "porch", "pixels"};
+    for (int i = 0; i < DEC_STAGES; i++) {
+        uint64_t bytes = dec.prof_bytes[i];
+        printf("  %-9s %9.1f MB/s %9.3f ticks/byte %5.1f%% of the bytes\n", names[i],
+               bytes / 1048576.0 / (dec.prof_ticks[i] / ticks_per_sec + 1e-12),
+               bytes ? (double)dec.prof_ticks[i] / bytes : 0.0, 100.0 * bytes / s->size);
+    }
+    uint64_t pal_bytes = dec.frames * DW * DH;
+    printf("  %-9s %9.1f MB/s %9.3f ticks/pixel\n", "palette",
+           pal_bytes / 1048576.0 / (pal_ticks / ticks_per_sec + 1e-12),
+           pal_bytes ? (double)pal_ticks / pal_bytes : 0.0);
+}
+
+//----------------------------------------------------------------------
+// Decode through the ring, fed by a producer thread like the USB thread
+//----------------------------------------------------------------------
+static void run_ring(const stream *s, size_t block, int blocks, double realtime) {
+    static uint8_t vram[DW * DH];
+    spsc_ring ring;
+    decoder dec;
+    std::atomic<int> done(0);
+
+    ring.init(block, blocks);
+    decoder_init(&dec, vram, s->v_porch, s->h_porch, s->oversample);
+
+    double t0 = now_sec();
+    std::thread producer([&] {
+        int slot = 0;
+        for (size_t off = 0; off < s->size; off += block) {
+            size_t len = (s->size - off < block) ? s->size - off : block;
+            // Unlike the USB, wait for room so that the throughput is measured
+            while (ring.occupancy() >= blocks - 2) {
+                std::this_thread::yield();
+            }
+            memcpy(ring.block(slot), s->data + off, len);
+            ring.commit((long)len);
+            slot = (slot + 1) % blocks;
+        }
+        done = 1;
+    });
+
+    for (;;) {
+        int n = ring.acquire(1, 10);
+        if (n == 0) {
+            if (done && ring.occupancy() == 0) {
+                break;
+            }
+            continue;
+        }
+        for (int k = 0; k < n; k++) {
+            long len;
+            const uint8_t *p = ring.peek(k, &len);
+            const uint8_t *end = p + len;
+            while (decoder_feed(&dec, &p, end) == DEC_FRAME)
+                ;
+        }
+        ring.release(n);
+    }
+    producer.join();
+    double sec = now_sec() - t0;
+
+    double mb = s->size / 1048576.0;
+    printf("  ring %4zu KiB x %2d  %9.1f MB/s %9.0f frames/s  x%.0f real-time, %llu overruns\n",
+           block / 1024, blocks, mb / sec, dec.frames / sec, mb / sec / realtime,
+           (unsigned long long)ring.overruns());
+}
+
+//----------------------------------------------------------------------
+// Compressed capture coding, block by block like the recorder
+//----------------------------------------------------------------------
+static void run_rle(const stream *s, double realtime) {
+    std::vector<uint8_t> packed(CAPRLE_PACKED_MAX(s->size));
+    std::vector<size_t> sizes;
+    static uint8_t raw[CAPRLE_BLOCK_MAX + 8];
+
+    double t0 = now_sec();
+    size_t total = 0;
+    for (size_t off = 0; off < s->size; off += CAPRLE_BLOCK_MAX) {
+        size_t len = (s->size - off < CAPRLE_BLOCK_MAX) ? s->size - off : CAPRLE_BLOCK_MAX;
+        sizes.push_back(caprle_encode(s->data + off, len, packed.data() + total));
+        total += sizes.back();
+    }
+    double enc = now_sec() - t0;
+
+    t0 = now_sec();
+    size_t pos = 0, bad = 0;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        size_t len = (s->size - i * CAPRLE_BLOCK_MAX < CAPRLE_BLOCK_MAX) ? s->size - i * CAPRLE_BLOCK_MAX : CAPRLE_BLOCK_MAX;
+        long n = caprle_decode(packed.data() + pos, sizes[i], raw, CAPRLE_BLOCK_MAX);
+        if (n != (long)len || memcmp(raw, s->data + i * CAPRLE_BLOCK_MAX, len) != 0) {
+            bad++;
+        }
+        pos += sizes[i];
+    }
+    double dec = now_sec() - t0;
+
+    double mb = s->size / 1048576.0;
+    printf("  rle       %9.1f MB/s encode %9.1f MB/s decode  x%.0f real-time, %.1f:1 (%.2f MB)%s\n",
+           mb / enc, mb / dec, mb / enc / realtime, (double)s->size / total, total / 1048576.0,
+           bad ? ", MISMATCH" : "");
+}
+
+static void run(const stream *s, double ticks_per_sec, double realtime) {
+    static const struct {
+        size_t block;
+        int blocks;
+    } rings[] = {
+        {16 * 1024, 4},
+        {16 * 1024, 16},
+        {64 * 1024, 8},     // RX_SIZE x XFR_NUM
+        {256 * 1024, 8},
+    };
+
+    printf("%s (oversample %d, %.1f MB)\n", s->name, s->oversample, s->size / 1048576.0);
+    run_stages(s, ticks_per_sec, realtime);
+    run_rle(s, realtime);
+    for (size_t i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+        run_ring(s, rings[i].block, rings[i].blocks, realtime);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *record = NULL;
+    long frames = 300;
+    double realtime = 16.0;
+    int pattern = SIGGEN_MOVING;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            record = argv[++i];
+        } else if (!strcmp(argv[i], "-frames") && i + 1 < argc) {
+            frames = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-realtime") && i + 1 < argc) {
+            realtime = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-noise")) {
+            pattern = SIGGEN_NOISE;
+        } else {
+            fprintf(stderr,
+                "Usage: bench [options]\n"
+                "  -r file         also run a recorded capture\n"
+                "  -frames n       synthetic frames (default: 300)\n"
+                "  -realtime MBps  byte rate of the real source (default: 16)\n"
+                "  -noise          random pixels instead of moving stripes\n");
+            return -1;
+        }
+    }
+
+    double ticks_per_sec = tick_rate();
+    printf("kernels: %s, %.0f MHz ticks, real-time %.1f MB/s\n\n", simd_name(), ticks_per_sec / 1e6, realtime);
+
+    // Synthetic: CS2300-CP (2x oversampling) and dot clock (1x)
+    for (int os = 2; os >= 1; os--) {
+        siggen_config cfg;
+        siggen gen;
+        siggen_default_config(&cfg);
+        cfg.oversample = os;
+        cfg.pattern = pattern;
+        cfg.jitter = os;
+        if (siggen_init(&gen, &cfg) < 0) {
+            return -1;
+        }
+        std::vector<uint8_t> data(siggen_frame_size(&cfg) * frames);
+        siggen_generate(&gen, data.data(), data.size());
+        siggen_free(&gen);
+
+        stream s = {os == 2 ? "synthetic, USE_CP2300" : "synthetic, dot clock",
+                    data.data(), data.size(), cfg.v_porch, cfg.h_porch, os, cfg.h_total * os};
+        run(&s, ticks_per_sec, realtime);
+    }
+
+    // Recorded
+    if (record != NULL) {
+        mapped_file file;
+        capfile_header hdr;
+        if (file.open(record) < 0) {
+            fprintf(stderr, "Could not open %s\n", record);
+            return -1;
+        }
+        size_t top = capfile_parse_header(file.data(), file.size(), &hdr);
+        stream s = {record, file.data() + top, file.size() - top, 36, 128, 2, 896 * 2};
+        if (top > 0) {
+            s.v_porch = hdr.v_porch;
+            s.h_porch = hdr.h_porch;
+            s.oversample = hdr.oversample ? hdr.oversample : 2;
+            s.line_bytes = hdr.h_pixels * s.oversample;
+        }
+        run(&s, ticks_per_sec, realtime);
+    }
+    return 0;
+}
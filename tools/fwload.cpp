@@ -0,0 +1,227 @@
+//
+// Firmware start-up and control channel check against the mock EZ-USB
+// (command line)
+//
+// Runs the start-up of the monitor (fx2_boot) on fx2_mock through the
+// cases of a real session: power on, restart with the same build, another
+// build, a firmware without Identify, a host which passes small control
+// requests only. Shows the time each start takes and checks what the
+// device ends up running.
+//
+// Then sends a burst of Set PLL commands through fx2_control, as the 'a' /
+// 's' keys do, and checks that posting never waits for the device and the
+// device ends up with the last one. A burst queued while the device is busy
+// must go out as one command. Last, finds the stream markers.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+#include "../fwimage.h"
+#include "../fx2ctl.h"
+#include "../fx2load.h"
+#include "../telemetry.h"
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: fwload [options]\n"
+        "  -latency us     time per control request of the mock (default: 1000)\n");
+}
+
+// Stand-in for slave.inc, records out of order as sdcc writes them
+static constexpr const char *test_hex[] = {
+    ":03000000020006F5",
+    ":03005F0002000399",
+    ":030003000202B046",
+    ":100006007581070200627800E84400600C79009070",
+    ":00000001FF",
+};
+static constexpr fw_size test_size = fw_measure(test_hex);
+static_assert(test_size.error == 0, "bad test record");
+static constexpr fw_image<test_size.bytes, test_size.ranges> test_image =
+    fw_parse<test_size.bytes, test_size.ranges>(test_hex);
+
+static int failures;
+
+// One start-up, expecting a download (or none)
+static void start(const char *name, fx2_mock *dev, const fw_view *fw, bool force, bool expect_skip) {
+    fx2_boot_result r;
+    int resets = dev->resets, commands = dev->commands;
+    int ret = fx2_boot(dev, fw, force, &r);
+
+    // The device must run fw, either way. A firmware before Identify is
+    // never asked.
+    uint64_t hash = 0;
+    bool ok = ret == 0 && r.skipped == expect_skip && dev->running && (dev->resets != resets) == !expect_skip &&
+              fx2_loaded(dev, &hash) && hash == fw->hash &&
+              (fw->protocol >= FX2_PROTOCOL_IDENTIFY || dev->commands == commands);
+    printf("%-30s %s %7.1f ms, %2d requests (up to %4d bytes)  %s\n", name, r.skipped ? "skipped   " : "downloaded",
+           r.ms, r.requests, r.chunk, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+static void set_pll_ratio(uint8_t ratio[4], int h_pixels) {
+    uint32_t r = (h_pixels * 2) << 4;
+    ratio[0] = r >> 16;
+    ratio[1] = r >> 8;
+    ratio[2] = r & 0xff;
+    ratio[3] = 0x00;
+}
+
+// The device ends up with the last command posted, under its sequence number
+static bool got_last(fx2_mock *dev, const uint8_t ratio[4], int seq) {
+    return dev->last_command[0] == FX2_CMD_SET_PLL && !memcmp(&dev->last_command[1], ratio, 4) &&
+           dev->last_command[5] == seq;
+}
+
+// A burst of Set PLL commands, as fast as a held key repeats: posting never
+// waits for the device (request_us each), however many of them are sent
+static void control(fx2_mock *dev) {
+    fx2_control ctl(dev);
+    int commands = dev->commands;
+    uint8_t ratio[4];
+    int seq = 0;
+
+    uint64_t start = telemetry_now_us(), posting = 0;
+    for (int i = 0; i < 100; i++) {
+        std::this_thread::sleep_until(std::chrono::steady_clock::now() + std::chrono::microseconds(200));
+        set_pll_ratio(ratio, 896 + i);
+        uint64_t t = telemetry_now_us();
+        seq = ctl.post(FX2_CMD_SET_PLL, ratio, sizeof(ratio));
+        posting += telemetry_now_us() - t;
+    }
+    double post_us = (double)posting / 100;
+    int ret = ctl.flush(5000);
+    double done_ms = (telemetry_now_us() - start) / 1000.0;
+
+    int taken = dev->commands - commands;
+    bool ok = ret == 0 && ctl.failed() == 0 && taken <= 100 && got_last(dev, ratio, seq) &&
+              (dev->request_us == 0 || post_us < dev->request_us);
+    printf("%-30s %.1f us per post, %d of 100 sent, last in %.1f ms  %s\n", "Set PLL burst", post_us, taken, done_ms,
+           ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+// While the device is busy with one command, a burst queued behind it
+// collapses into the last one: exactly 2 are sent
+static void coalesce(fx2_mock *dev) {
+    fx2_control ctl(dev);
+    int commands = dev->commands;
+    uint8_t ratio[4];
+
+    dev->hold = true;
+    set_pll_ratio(ratio, 896);
+    int first = ctl.post(FX2_CMD_SET_PLL, ratio, sizeof(ratio));
+    while (dev->held == 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    int seq = 0;
+    bool same = true;
+    for (int i = 1; i <= 50; i++) {
+        set_pll_ratio(ratio, 896 + i);
+        int s = ctl.post(FX2_CMD_SET_PLL, ratio, sizeof(ratio));
+        same = same && (i == 1 || s == seq);
+        seq = s;
+    }
+    dev->hold = false;
+    int ret = ctl.flush(5000);
+
+    int taken = dev->commands - commands;
+    bool ok = ret == 0 && ctl.failed() == 0 && ctl.sent() == 2 && taken == 2 && same && seq != first &&
+              got_last(dev, ratio, seq);
+    printf("%-30s 51 posts, %d sent  %s\n", "Set PLL while busy", taken, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+// Markers at the end of the blocks, and none in plain samples
+static void markers(void) {
+    static uint8_t block[3 * FX2_PACKET_SIZE + FX2_MARKER_SIZE];
+    memset(block, 0x1f, sizeof(block));   // VHRGB all set, the largest sample
+    fx2_marker m = {0, 0};
+
+    bool ok = !fx2_find_marker(block, sizeof(block), &m) && !fx2_find_marker(block, 3 * FX2_PACKET_SIZE, &m);
+    uint8_t *tail = &block[sizeof(block) - FX2_MARKER_SIZE];
+    tail[0] = FX2_MARK;
+    tail[1] = FX2_MARK;
+    tail[2] = FX2_CMD_SET_PLL;
+    tail[3] = 42;
+    ok = ok && fx2_find_marker(block, sizeof(block), &m) && m.command == FX2_CMD_SET_PLL && m.seq == 42 &&
+         fx2_find_marker(tail, FX2_MARKER_SIZE, &m) && !fx2_find_marker(block, sizeof(block) - 1, &m);
+    printf("%-30s %s\n", "Stream markers", ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int latency = 1000;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-latency") && i + 1 < argc) {
+            latency = atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    fw_view fw = fw_view_of(test_image, FX2_PROTOCOL);
+    printf("image: %d bytes in %d ranges (%d records), hash %016llx\n", fw.bytes, fw.ranges,
+           (int)(sizeof(test_hex) / sizeof(test_hex[0])), (unsigned long long)fw.hash);
+
+    static fx2_mock dev;
+    dev.request_us = latency;
+
+    start("power on", &dev, &fw, false, false);
+    start("restart, same build", &dev, &fw, false, true);
+    start("restart, forced", &dev, &fw, true, false);
+
+    // Another build: one byte changed
+    static uint8_t other_data[test_size.bytes];
+    memcpy(other_data, fw.data, sizeof(other_data));
+    other_data[0] ^= 1;
+    fw_view other = fw;
+    other.data = other_data;
+    other.hash ^= 1;
+    start("restart, another build", &dev, &other, false, false);
+    start("restart, back again", &dev, &fw, false, false);
+
+    // The image is a build before Identify: no question, no timeout
+    fw_view old = fw;
+    old.protocol = 0;
+    start("restart, image before Identify", &dev, &old, false, false);
+
+    // The slot names the image but the firmware does not answer
+    dev.identify = false;
+    start("restart, no Identify", &dev, &fw, false, false);
+    dev.identify = true;
+    dev.running = false;
+    start("restart, firmware hung", &dev, &fw, false, false);
+
+    // A large image through a host passing 512 byte requests only
+    static uint8_t big_data[6000];
+    static const fw_range big_range[] = {{0x0000, 6000, 0}};
+    fw_view big = {big_data, big_range, 1, (int)sizeof(big_data), 0x1234, FX2_PROTOCOL};
+    dev.power_cycle();
+    dev.max_request = 512;
+    start("power on, large, 512 byte host", &dev, &big, false, false);
+    start("restart, large, 512 byte host", &dev, &big, false, true);
+
+    control(&dev);
+    coalesce(&dev);
+    markers();
+
+    if (failures > 0) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,234 @@
+//
+// Synthetic "000VHRGB" signal generator (command line)
+//
+// Writes a byte-exact FX2 sample stream to a file or stdout, for replay
+// with -r, the benchmark and load tests.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "../siggen.h"
+#include "../capfile.h"
+#include "../caprle.h"
+
+#define CHUNK (256 * 1024)
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: gen_signal [options]\n"
+        "  -o file         output file (default: stdout)\n"
+        "  -cap            write a capture file header (for -r)\n"
+        "  -rle            write a compressed capture (for -r, needs -o)\n"
+        "  -frames n       number of frames (default: 60)\n"
+        "  -preset name    x1turbo (default) / pasopia7\n"
+        "  -htotal n       pixels per line\n"
+        "  -pll n          sample as the CS2300-CP set to n pixels per line (default: -htotal)\n"
+        "  -hsync n        H-Sync width [pixels]\n"
+        "  -hporch n       H-Sync end to the first pixel [pixels]\n"
+        "  -vtotal n       lines per frame\n"
+        "  -vsync n        V-Sync width [lines]\n"
+        "  -vporch n       V-Sync end to the first line [lines]\n"
+        "  -os n           samples per pixel (1 or 2, default: 2)\n"
+        "  -jitter n       up to n extra samples per line\n"
+        "  -glitch rate    probability of a broken H-Sync per line\n"
+        "  -pattern name   bars / checker / moving / noise\n"
+        "  -image file     binary PPM picture (P6)\n"
+        "  -seed n         random seed\n"
+        "  -bench          generate into memory and report the speed\n");
+}
+
+int main(int argc, char *argv[]) {
+    siggen_config cfg;
+    const char *out_file = NULL;
+    const char *image_file = NULL;
+    bool cap = false;
+    bool rle = false;
+    bool bench = false;
+    long frames = 60;
+
+    siggen_default_config(&cfg);
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (!strcmp(arg, "-cap")) {
+            cap = true;
+        } else if (!strcmp(arg, "-rle")) {
+            rle = true;
+        } else if (!strcmp(arg, "-bench")) {
+            bench = true;
+        } else if (val == NULL) {
+            usage();
+            return -1;
+        } else if (!strcmp(arg, "-o")) {
+            out_file = val;
+            i++;
+        } else if (!strcmp(arg, "-frames")) {
+            frames = atol(val);
+            i++;
+        } else if (!strcmp(arg, "-preset")) {
+            if (!strcmp(val, "pasopia7")) {
+                cfg.h_total = 912;
+            } else if (strcmp(val, "x1turbo")) {
+                usage();
+                return -1;
+            }
+            i++;
+        } else if (!strcmp(arg, "-htotal")) {
+            cfg.h_total = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-pll")) {
+            cfg.pll_total = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-hsync")) {
+            cfg.h_sync = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-hporch")) {
+            cfg.h_porch = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-vtotal")) {
+            cfg.v_total = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-vsync")) {
+            cfg.v_sync = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-vporch")) {
+            cfg.v_porch = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-os")) {
+            cfg.oversample = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-jitter")) {
+            cfg.jitter = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-glitch")) {
+            cfg.glitch_rate = atof(val);
+            i++;
+        } else if (!strcmp(arg, "-pattern")) {
+            if (!strcmp(val, "bars")) {
+                cfg.pattern = SIGGEN_BARS;
+            } else if (!strcmp(val, "checker")) {
+                cfg.pattern = SIGGEN_CHECKER;
+            } else if (!strcmp(val, "moving")) {
+                cfg.pattern = SIGGEN_MOVING;
+            } else if (!strcmp(val, "noise")) {
+                cfg.pattern = SIGGEN_NOISE;
+            } else {
+                usage();
+                return -1;
+            }
+            i++;
+        } else if (!strcmp(arg, "-image")) {
+            image_file = val;
+            i++;
+        } else if (!strcmp(arg, "-seed")) {
+            cfg.seed = (uint32_t)strtoul(val, NULL, 0);
+            i++;
+        } else {
+            usage();
+            return -1;
+        }
+    }
+
+    static uint8_t image[DW * DH];
+    if (image_file != NULL) {
+        if (siggen_load_ppm(image_file, image) < 0) {
+            return -1;
+        }
+        cfg.pattern = SIGGEN_IMAGE;
+        cfg.image = image;
+    }
+
+    static siggen gen;
+    if (siggen_init(&gen, &cfg) < 0) {
+        return -1;
+    }
+
+    static uint8_t buf[CHUNK];
+    uint64_t total = (uint64_t)frames * siggen_frame_size(&cfg);
+
+    if (bench) {
+        auto t0 = std::chrono::steady_clock::now();
+        for (uint64_t done = 0; done < total; done += CHUNK) {
+            siggen_generate(&gen, buf, CHUNK);
+        }
+        double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        printf("%.1f MB in %.3f s: %.1f MB/s, %.0f frames/s\n",
+               total / 1048576.0, sec, total / 1048576.0 / sec, frames / sec);
+        siggen_free(&gen);
+        return 0;
+    }
+
+    capfile_header hdr;
+    capfile_init_header(&hdr);
+    hdr.h_pixels = (cfg.pll_total > 0) ? cfg.pll_total : cfg.h_total;
+    hdr.h_porch = cfg.h_porch;
+    hdr.v_porch = cfg.v_porch;
+    hdr.oversample = cfg.oversample;
+    hdr.block_size = CHUNK;
+
+    if (rle) {
+        // The index is written at the end, so not to stdout
+        caprle_writer writer;
+        if (out_file == NULL || writer.open(out_file, &hdr) < 0) {
+            usage();
+            return -1;
+        }
+        while (total > 0) {
+            size_t len = (total > CHUNK) ? CHUNK : (size_t)total;
+            siggen_generate(&gen, buf, len);
+            if (writer.write(buf, len) < 0) {
+                return -1;
+            }
+            total -= len;
+        }
+        fprintf(stderr, "%.1f MB coded to %.1f MB\n", writer.bytes() / 1048576.0, writer.packed_bytes() / 1048576.0);
+        writer.close();
+        siggen_free(&gen);
+        return 0;
+    }
+
+    FILE *fp = stdout;
+    if (out_file != NULL) {
+        fp = fopen(out_file, "wb");
+        if (fp == NULL) {
+            fprintf(stderr, "Could not create %s\n", out_file);
+            return -1;
+        }
+    } else {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+
+    if (cap) {
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+    }
+
+    while (total > 0) {
+        size_t len = (total > CHUNK) ? CHUNK : (size_t)total;
+        siggen_generate(&gen, buf, len);
+        if (fwrite(buf, 1, len, fp) != len) {
+            fprintf(stderr, "Write failed\n");
+            return -1;
+        }
+        total -= len;
+    }
+
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    siggen_free(&gen);
+    if (gen.glitches > 0) {
+        fprintf(stderr, "%llu glitches injected\n", (unsigned long long)gen.glitches);
+    }
+    return 0;
+}
@@ -0,0 +1,294 @@
+//
+// Reference viewer for the frame stream (-serve) (command line)
+//
+// Connects to a monitor started with -serve, rebuilds the frames and
+// shows the stream statistics once a second. The frames can be written
+// out as raw palette indices or Y4M (e.g. to a player through a pipe).
+//
+// -selftest runs a server fed by the signal generator and several viewers
+// on the loopback interface, and checks every received frame against the
+// one that was sent.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../netstream.h"
+#include "../framesink.h"
+#include "../siggen.h"
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: netview [host][:port] [options]\n"
+        "  (default: 127.0.0.1:%d)\n"
+        "  -o file         write the frames (\"-\": stdout)\n"
+        "  -format name    raw / y4m (default: y4m)\n"
+        "  -frames n       stop after n frames\n"
+        "\n"
+        "       netview -selftest [options]\n"
+        "  -viewers n      viewers on the loopback interface (default: 4)\n"
+        "  -frames n       frames to send (default: 600)\n"
+        "  -pattern name   bars / checker / moving / noise (default: moving)\n",
+        NET_PORT);
+}
+
+static double now_sec(void) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//----------------------------------------------------------------------
+// Viewer
+//----------------------------------------------------------------------
+static int view(const char *host, int port, const char *out_file, int format, uint64_t max_frames) {
+    frame_client client;
+    if (client.connect(host, port) < 0) {
+        return -1;
+    }
+
+    frame_sink sink;
+    if (out_file != NULL && sink.open(out_file, format, 1, 60, client.info()->palette) < 0) {
+        return -1;
+    }
+
+    static uint8_t pixels[DW * DH];
+    uint64_t frames = 0, seq_base = 0, skipped = 0, rows_total = 0;
+    uint32_t last_seq = 0;
+    uint64_t last_bytes = 0, last_frames = 0;
+    double t0 = now_sec();
+
+    while (frames < max_frames) {
+        uint32_t seq;
+        int rows;
+        if (client.receive(pixels, &seq, &rows) < 0) {
+            fprintf(stderr, "Connection closed\n");
+            break;
+        }
+        // The server sends only the newest frame, the gaps are skipped frames
+        if (frames > 0 && seq != last_seq + 1) {
+            skipped += (uint32_t)(seq - last_seq - 1);
+        }
+        if (frames > 0 && seq < last_seq) {
+            seq_base += 1ULL << 32;
+        }
+        last_seq = seq;
+        frames++;
+        rows_total += rows;
+
+        // Consecutive numbers for the sink, it would drop frames on gaps
+        if (out_file != NULL && sink.write(pixels, frames) < 0) {
+            break;
+        }
+
+        double t = now_sec();
+        if (t - t0 >= 1.0) {
+            uint64_t n = frames - last_frames;
+            fprintf(stderr, "frame %llu: %.1f fps, %.1f kB/s, %.1f rows/frame, %llu skipped\n",
+                    (unsigned long long)(seq_base + seq), n / (t - t0), (client.bytes() - last_bytes) / (t - t0) / 1000.0,
+                    (double)rows_total / n, (unsigned long long)skipped);
+            t0 = t;
+            last_frames = frames;
+            last_bytes = client.bytes();
+            rows_total = 0;
+        }
+    }
+    sink.close();
+    return 0;
+}
+
+//----------------------------------------------------------------------
+// Loopback self test
+//----------------------------------------------------------------------
+#define HISTORY 256     // Sent frames kept for the check (by seq)
+
+struct history {
+    uint8_t pixels[HISTORY][DW * DH];
+    double sent[HISTORY];
+    std::atomic<uint64_t> last_seq;
+};
+
+struct viewer_result {
+    uint64_t frames, mismatches, bytes;
+    double latency_sum, latency_max;
+};
+
+static void selftest_viewer(int port, history *h, viewer_result *res) {
+    memset(res, 0, sizeof(*res));
+    frame_client client;
+    if (client.connect("127.0.0.1", port) < 0) {
+        res->mismatches = 1;
+        return;
+    }
+    static thread_local uint8_t pixels[DW * DH];
+    uint32_t seq;
+    while (client.receive(pixels, &seq, NULL) == 0) {
+        // A frame which has already been overwritten in the history cannot be checked
+        if (h->last_seq.load() - seq < HISTORY - 8) {
+            double latency = now_sec() - h->sent[seq % HISTORY];
+            if (memcmp(pixels, h->pixels[seq % HISTORY], DW * DH)) {
+                res->mismatches++;
+            }
+            res->latency_sum += latency;
+            if (latency > res->latency_max) {
+                res->latency_max = latency;
+            }
+        }
+        res->frames++;
+    }
+    res->bytes = client.bytes();
+}
+
+static int selftest(int viewers, uint64_t frames, int pattern) {
+    int port = NET_PORT + 1;
+    frame_server server;
+    if (server.start("127.0.0.1", port, palette_default) < 0) {
+        return -1;
+    }
+
+    siggen_config cfg;
+    siggen_default_config(&cfg);
+    cfg.pattern = pattern;
+    siggen gen;
+    if (siggen_init(&gen, &cfg) < 0) {
+        return -1;
+    }
+    std::vector<uint8_t> samples(siggen_frame_size(&cfg));
+
+    static history h;
+    h.last_seq = 0;
+    std::vector<viewer_result> results(viewers);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < viewers; i++) {
+        threads.emplace_back(selftest_viewer, port, &h, &results[i]);
+    }
+    while (server.viewers() < viewers) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    // 60 frames per second, like the presenter
+    double publish_sum = 0, publish_max = 0;
+    double t0 = now_sec();
+    for (uint64_t seq = 1; seq <= frames; seq++) {
+        siggen_generate(&gen, samples.data(), samples.size());
+        memcpy(h.pixels[seq % HISTORY], gen.frame, DW * DH);
+        h.sent[seq % HISTORY] = now_sec();
+        h.last_seq = seq;
+
+        double t = now_sec();
+        server.publish(gen.frame, seq);
+        double cost = now_sec() - t;
+        publish_sum += cost;
+        if (cost > publish_max) {
+            publish_max = cost;
+        }
+
+        double next = t0 + seq / 60.0;
+        while (now_sec() < next) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    // Let the last frame arrive
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    server.stop();
+    for (auto &t : threads) {
+        t.join();
+    }
+    siggen_free(&gen);
+
+    // The time the presenter would lose
+    printf("publish: avg %.3f ms max %.3f ms\n", publish_sum / frames * 1000, publish_max * 1000);
+
+    int failed = 0;
+    for (int i = 0; i < viewers; i++) {
+        viewer_result *r = &results[i];
+        printf("viewer %d: %llu frames, %.1f bytes/frame, latency avg %.3f ms max %.3f ms, %llu mismatches\n", i,
+               (unsigned long long)r->frames, r->frames ? (double)r->bytes / r->frames : 0.0,
+               r->frames ? r->latency_sum / r->frames * 1000 : 0.0, r->latency_max * 1000,
+               (unsigned long long)r->mismatches);
+        if (r->frames == 0 || r->mismatches) {
+            failed = 1;
+        }
+    }
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *target = NULL;
+    const char *out_file = NULL;
+    int format = SINK_Y4M;
+    uint64_t frames = 0;
+    bool test = false;
+    int viewers = 4;
+    int pattern = SIGGEN_MOVING;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (!strcmp(arg, "-selftest")) {
+            test = true;
+        } else if (arg[0] != '-' && target == NULL) {
+            target = arg;
+        } else if (val == NULL) {
+            usage();
+            return -1;
+        } else if (!strcmp(arg, "-o")) {
+            out_file = val;
+            i++;
+        } else if (!strcmp(arg, "-format")) {
+            format = frame_sink_format(val);
+            if (format != SINK_RAW && format != SINK_Y4M) {
+                usage();
+                return -1;
+            }
+            i++;
+        } else if (!strcmp(arg, "-frames")) {
+            frames = strtoull(val, NULL, 0);
+            i++;
+        } else if (!strcmp(arg, "-viewers")) {
+            viewers = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-pattern")) {
+            if (!strcmp(val, "bars")) {
+                pattern = SIGGEN_BARS;
+            } else if (!strcmp(val, "checker")) {
+                pattern = SIGGEN_CHECKER;
+            } else if (!strcmp(val, "moving")) {
+                pattern = SIGGEN_MOVING;
+            } else if (!strcmp(val, "noise")) {
+                pattern = SIGGEN_NOISE;
+            } else {
+                usage();
+                return -1;
+            }
+            i++;
+        } else {
+            usage();
+            return -1;
+        }
+    }
+
+    if (test) {
+        return selftest(viewers > 0 ? viewers : 1, frames ? frames : 600, pattern);
+    }
+
+    // host, host:port or :port
+    char host[256] = "127.0.0.1";
+    int port = NET_PORT;
+    if (target != NULL) {
+        const char *colon = strrchr(target, ':');
+        size_t len = colon ? (size_t)(colon - target) : strlen(target);
+        if (len > 0 && len < sizeof(host)) {
+            memcpy(host, target, len);
+            host[len] = '\0';
+        }
+        if (colon != NULL) {
+            port = atoi(colon + 1);
+        }
+    }
+    return view(host, port, out_file, format, frames ? frames : UINT64_MAX);
+}
@@ -0,0 +1,215 @@
+//
+// Closed-loop H_TOTAL tuning check on a synthetic signal (command line)
+//
+// Plays the CS2300-CP and a source machine with siggen: the source draws
+// its lines at h_total pixels, the "PLL" samples them at the h_pixels the
+// tuner asks for (pll_total), restarting the stream on every change like
+// the FIFO reset of the firmware. The samples still in flight at a change
+// (the USB ring, up to the stream marker) are the old setting: some cases
+// feed them too, with the restart at the marker or without one. Runs the
+// tuner (pll_tuner) on it from several starting settings and checks that
+// it ends at the H_TOTAL of the source, and how many frames it takes. The
+// color bars have no short runs to measure: the tuner must give up and go
+// back to the start setting.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../plltune.h"
+#include "../siggen.h"
+
+#define CHUNK (64 * 1024)       // One USB transfer
+#define MAX_FRAMES 120
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: plltune [options]\n"
+        "  -htotal n       H_TOTAL of the source: tune to it from -start only\n"
+        "  -start n        PLL setting to start from (default: 896)\n"
+        "  -pattern name   bars / checker / moving / noise (default: all but bars)\n"
+        "  -glitch rate    probability of a broken H-Sync per line\n"
+        "  -old lines      lines of the old setting fed after each change\n"
+        "  -v              show every measurement\n");
+}
+
+struct tune_case {
+    const char *name;
+    int h_total;          // Source
+    int start;            // PLL setting at the start
+    bool follows;         // The PLL takes the new settings
+    int old_lines;        // Lines of the old setting after each change
+    bool marker;          // The tuner is restarted behind them
+    int pattern;          // Only this one (-1: checker, moving and noise)
+};
+
+static const tune_case default_cases[] = {
+    {"X1turbo, already right", 896, 896, true, 0, false, -1},
+    {"Pasopia7 from 896", 912, 896, true, 0, false, -1},
+    {"X1turbo from 912", 896, 912, true, 0, false, -1},
+    {"H_TOTAL 920 from 896", 920, 896, true, 0, false, -1},
+    {"H_TOTAL 880 from 904", 880, 904, true, 0, false, -1},
+    {"Pasopia7, old lines, marker", 912, 896, true, 300, true, -1},
+    {"X1turbo from 897, old lines", 896, 897, true, 300, false, -1},
+    {"X1turbo from 897, marker", 896, 897, true, 300, true, -1},
+    {"PLL not following", 912, 896, false, 0, false, -1},
+    {"Pasopia7 from 896, no detail", 912, 896, true, 0, false, SIGGEN_BARS},
+    {"X1turbo, already right, no detail", 896, 896, true, 0, false, SIGGEN_BARS},
+};
+
+static const char *pattern_names[] = {"bars", "checker", "moving", "noise"};
+
+// The samples of the old setting in flight at a change. Returns 0 if the
+// tuner has taken them for the new one (changed again).
+static int feed_old(siggen *gen, pll_tuner *t, uint64_t samples) {
+    static uint8_t buf[CHUNK];
+    while (samples > 0) {
+        size_t n = (samples < CHUNK) ? (size_t)samples : CHUNK;
+        siggen_generate(gen, buf, n);
+        if (pll_tuner_feed(t, buf, n)) {
+            return 0;
+        }
+        samples -= n;
+    }
+    return 1;
+}
+
+static bool verbose;
+static double glitch_rate;
+static int failures;
+
+static void run(const tune_case *c, int pattern) {
+    siggen_config cfg;
+    siggen_default_config(&cfg);
+    cfg.h_total = c->h_total;
+    cfg.pll_total = c->start;
+    cfg.pattern = pattern;
+    cfg.glitch_rate = glitch_rate;
+
+    static siggen gen;
+    if (siggen_init(&gen, &cfg) < 0) {
+        failures++;
+        return;
+    }
+
+    pll_tuner t;
+    pll_tuner_init(&t, c->start, cfg.oversample);
+
+    static uint8_t buf[CHUNK];
+    uint64_t samples = 0, limit = (uint64_t)MAX_FRAMES * siggen_frame_size(&cfg);
+    int changes = 0;
+    bool misled = false;
+    while (t.phase < PLL_TUNE_DONE && samples < limit) {
+        siggen_generate(&gen, buf, CHUNK);
+        samples += CHUNK;
+        if (!pll_tuner_feed(&t, buf, CHUNK)) {
+            continue;
+        }
+        changes++;
+        if (verbose) {
+            printf("    %4d: drift %5.1f samples/line, %s %d\n", (t.trials > 0) ? t.best : c->start, t.drift,
+                   (t.phase == PLL_TUNE_LOCK) ? "try" : "back to", t.h_pixels);
+        }
+        if (c->follows) {
+            // The PLL relocks, the stream restarts behind the marker
+            if (!feed_old(&gen, &t, (uint64_t)c->old_lines * cfg.oversample * cfg.pll_total)) {
+                misled = true;
+                break;
+            }
+            if (c->marker) {
+                pll_tuner_restart(&t);
+            }
+            siggen_free(&gen);
+            cfg.pll_total = t.h_pixels;
+            cfg.seed++;
+            if (siggen_init(&gen, &cfg) < 0) {
+                failures++;
+                return;
+            }
+        }
+    }
+    siggen_free(&gen);
+
+    // Nothing to measure in the bars: back at the start, and soon
+    double frames = (double)t.lines / cfg.v_total;
+    bool ok = !misled;
+    if (pattern == SIGGEN_BARS) {
+        ok = ok && t.phase == PLL_TUNE_FAILED && t.no_detail && t.h_pixels == c->start &&
+             t.lines <= PLL_TUNE_LOCK_LINES + PLL_TUNE_MEASURE_MAX + 1;
+    } else if (!c->follows) {
+        ok = ok && t.phase == PLL_TUNE_FAILED && !t.no_detail && t.h_pixels == c->start;
+    } else {
+        ok = ok && t.phase == PLL_TUNE_DONE && t.h_pixels == c->h_total;
+    }
+    const char *result = misled ? "old lines" : (t.phase == PLL_TUNE_DONE) ? "tuned"
+                       : (t.phase != PLL_TUNE_FAILED) ? "unfinished" : t.no_detail ? "no detail" : "no lock";
+    printf("%-34s %-8s %-10s %4d, %2d trials, %2d changes, %5.1f frames  %s\n", c->name, pattern_names[pattern], result,
+           t.h_pixels, t.trials, changes, frames, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    tune_case one = {"-htotal", 0, 896, true, 0, true, -1};
+    int pattern = -1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (!strcmp(arg, "-v")) {
+            verbose = true;
+        } else if (val == NULL) {
+            usage();
+            return 1;
+        } else if (!strcmp(arg, "-htotal")) {
+            one.h_total = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-start")) {
+            one.start = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-old")) {
+            one.old_lines = atoi(val);
+            i++;
+        } else if (!strcmp(arg, "-glitch")) {
+            glitch_rate = atof(val);
+            i++;
+        } else if (!strcmp(arg, "-pattern")) {
+            for (pattern = SIGGEN_BARS; pattern <= SIGGEN_NOISE; pattern++) {
+                if (!strcmp(val, pattern_names[pattern])) {
+                    break;
+                }
+            }
+            if (pattern > SIGGEN_NOISE) {
+                usage();
+                return 1;
+            }
+            i++;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    const tune_case *cases = default_cases;
+    int n = (int)(sizeof(default_cases) / sizeof(default_cases[0]));
+    if (one.h_total > 0) {
+        cases = &one;
+        n = 1;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int p = SIGGEN_BARS; p <= SIGGEN_NOISE; p++) {
+            int only = (pattern >= 0) ? pattern : cases[i].pattern;
+            if ((only < 0) ? p != SIGGEN_BARS : p == only) {
+                run(&cases[i], p);
+            }
+        }
+    }
+
+    if (failures > 0) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
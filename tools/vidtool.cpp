@@ -0,0 +1,111 @@
+//
+// Archive (vidfile) inspection and export (command line)
+//
+// Shows the contents of an archive written with -o file -format vid, and
+// exports any range of frames as raw palette indices or Y4M.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "../vidfile.h"
+#include "../framesink.h"
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: vidtool file.vid [options]\n"
+        "  (no options)    show the archive information\n"
+        "  -o file         export the frames (\"-\": stdout)\n"
+        "  -format name    raw / y4m (default: y4m)\n"
+        "  -from n         first frame (default: 0)\n"
+        "  -frames n       number of frames (default: all)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *in_file = NULL;
+    const char *out_file = NULL;
+    int format = SINK_Y4M;
+    uint64_t from = 0;
+    uint64_t frames = UINT64_MAX;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (arg[0] != '-' && in_file == NULL) {
+            in_file = arg;
+        } else if (val == NULL) {
+            usage();
+            return -1;
+        } else if (!strcmp(arg, "-o")) {
+            out_file = val;
+            i++;
+        } else if (!strcmp(arg, "-format")) {
+            format = frame_sink_format(val);
+            if (format != SINK_RAW && format != SINK_Y4M) {
+                usage();
+                return -1;
+            }
+            i++;
+        } else if (!strcmp(arg, "-from")) {
+            from = strtoull(val, NULL, 0);
+            i++;
+        } else if (!strcmp(arg, "-frames")) {
+            frames = strtoull(val, NULL, 0);
+            i++;
+        } else {
+            usage();
+            return -1;
+        }
+    }
+    if (in_file == NULL) {
+        usage();
+        return -1;
+    }
+
+    vidfile_reader reader;
+    vidfile_header hdr;
+    if (reader.open(in_file, &hdr) < 0) {
+        return -1;
+    }
+    uint64_t count = reader.frame_count();
+    double fps = hdr.fps_den ? (double)hdr.fps_num / hdr.fps_den : 0;
+
+    if (out_file == NULL) {
+        printf("%s: %dx%d, %llu frames, %.2f fps, keyframe every %d\n", in_file, hdr.width, hdr.height,
+               (unsigned long long)count, fps, hdr.keyint);
+        printf("palette:");
+        for (int i = 0; i < PALETTE_SIZE; i++) {
+            printf(" %06x", hdr.palette[i]);
+        }
+        printf("\n");
+        return 0;
+    }
+
+    if (from >= count) {
+        fprintf(stderr, "%s has only %llu frames\n", in_file, (unsigned long long)count);
+        return -1;
+    }
+    if (frames > count - from) {
+        frames = count - from;
+    }
+
+    frame_sink sink;
+    if (sink.open(out_file, format, 1, (int)(fps + 0.5), hdr.palette) < 0) {
+        return -1;
+    }
+
+    static uint8_t pixels[DW * DH];
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint64_t n = from; n < from + frames; n++) {
+        // Consecutive numbers for the sink, the archive has no gaps
+        if (reader.read_frame(n, pixels, NULL) < 0 || sink.write(pixels, n - from + 1) < 0) {
+            return -1;
+        }
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    sink.close();
+    fprintf(stderr, "%llu frames exported in %.3f s (%.0f frames/s)\n", (unsigned long long)frames, sec, frames / sec);
+    return 0;
+}
@@ -0,0 +1,189 @@
+//
+// USB transfer tuning check on a simulated stream (command line)
+//
+// Plays the USB thread and the decoder for xfer_tuner_step: a stream of
+// a given byte rate, a host which keeps up with transfers from some size
+// on (smaller ones lose bytes and overrun the ring), and optionally the
+// overruns and the sync loss of the restart after every change. Runs the
+// tuner on the running totals in steps of 10 ms of simulated time and
+// checks the order of the candidates tried, the 16 ms headroom of each,
+// the time spent settling and measuring, and the setting it ends with
+// (the start setting when nothing keeps up).
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "../xfertune.h"
+
+#define STEP_US 10000
+#define MAX_US 120000000ULL
+#define MB 1048576.0
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: xfertune [options]\n"
+        "  -rate MBps      byte rate of the stream: tune for it only\n"
+        "  -min KiB        smallest transfer the host keeps up with (default: 16)\n"
+        "  -v              show every trial\n");
+}
+
+struct tune_case {
+    const char *name;
+    double rate;          // MB/s
+    int min_size;         // Smallest transfer kept up with, 0: none
+    bool glitches;        // Overruns and sync loss right after each change
+    int no_signal_us;     // Nothing received at the start
+};
+
+static const tune_case default_cases[] = {
+    {"16 MB/s, from 16 KiB", 16, 16 * 1024, false, 0},
+    {"16 MB/s, restart glitches", 16, 16 * 1024, true, 0},
+    {"16 MB/s, no signal for 3 s", 16, 16 * 1024, false, 3000000},
+    {"4 MB/s, from 4 KiB", 4, 4 * 1024, false, 0},
+    {"64 MB/s, from 64 KiB", 64, 64 * 1024, true, 0},
+    {"16 MB/s, nothing keeps up", 16, 0, true, 0},
+};
+
+// The candidates of xfertune.cpp, in the order they must be tried
+static const int sizes[] = {4 * 1024, 8 * 1024, 16 * 1024, 32 * 1024, 64 * 1024, 128 * 1024, 256 * 1024};
+static const int nums[] = {4, 8, 16, 32, 64};
+
+static bool verbose;
+static int failures;
+
+static bool keeps_up(const tune_case *c, const xfer_setting *s) {
+    return c->min_size > 0 && s->size >= c->min_size;
+}
+
+static void run(const tune_case *c) {
+    const xfer_setting start = {64 * 1024, 8};
+    double rate = c->rate * MB;
+
+    xfer_tuner t;
+    xfer_tuner_init(&t, &start);
+
+    std::vector<xfer_setting> tried;
+    xfer_setting cur = start;
+    uint64_t now = 1000000, changed = now, bytes = 0, overruns = 0, sync_lost = 0;
+    bool fallback = false;
+    double carry = 0;
+    while (t.phase != TUNE_DONE && now < MAX_US) {
+        now += STEP_US;
+
+        // The stream with the current setting
+        if (now > 1000000 + (uint64_t)c->no_signal_us) {
+            double got = rate * STEP_US / 1e6 * (keeps_up(c, &cur) ? 1.0 : 0.9) + carry;
+            bytes += (uint64_t)got;
+            carry = got - (uint64_t)got;
+            if (!keeps_up(c, &cur) && now % 100000 == 0) {
+                overruns++;
+            }
+        }
+        if (c->glitches && now - changed <= 100000) {
+            overruns++;
+            if (now - changed == STEP_US) {
+                sync_lost++;
+            }
+        }
+
+        if (!xfer_tuner_step(&t, now, bytes, overruns, sync_lost)) {
+            continue;
+        }
+        cur = t.current;
+        changed = now;
+        if (t.phase == TUNE_DONE) {
+            fallback = true;
+        } else {
+            tried.push_back(cur);
+        }
+        if (verbose) {
+            printf("    %6.2f s: %s %3d KiB x %2d, %.2f ms\n", (now - 1000000) / 1e6, fallback ? "back to" : "try",
+                   cur.size / 1024, cur.num, xfer_latency_ms(&cur, t.rate));
+        }
+    }
+
+    // The rate seen with the start setting is measured after settling
+    double seen = rate * (keeps_up(c, &start) ? 1.0 : 0.9);
+    bool ok = t.rate >= seen * 0.99 && t.rate <= seen * 1.01;
+
+    // The candidates usable at that rate, and the one which must win
+    std::vector<xfer_setting> expect;
+    int winner = -1;
+    for (int size : sizes) {
+        for (int num : nums) {
+            xfer_setting s = {size, num};
+            if ((num - 2) * xfer_latency_ms(&s, t.rate) >= 16.0) {
+                if (winner < 0 && keeps_up(c, &s)) {
+                    winner = (int)expect.size();
+                }
+                expect.push_back(s);
+            }
+        }
+    }
+
+    // Tried them in order, up to the winner (or all)
+    size_t n = (winner >= 0) ? winner + 1 : expect.size();
+    ok = ok && t.phase == TUNE_DONE && tried.size() == n;
+    for (size_t i = 0; ok && i < n; i++) {
+        ok = tried[i].size == expect[i].size && tried[i].num == expect[i].num;
+    }
+    if (winner >= 0) {
+        ok = ok && !fallback && t.current.size == expect[winner].size && t.current.num == expect[winner].num;
+    } else {
+        ok = ok && fallback && t.current.size == start.size && t.current.num == start.num;
+    }
+
+    // Each step settles first, then runs its period
+    double spent = (now - 1000000 - c->no_signal_us) / 1e6;
+    double planned = (TUNE_SETTLE_US + TUNE_RATE_US + n * (TUNE_SETTLE_US + TUNE_TRIAL_US)) / 1e6;
+    ok = ok && spent >= planned && spent <= planned + (TUNE_RATE_US + (n + 2) * STEP_US) / 1e6;
+
+    printf("%-28s %3d KiB x %2d, %2d trials of %2d, %5.1f s  %s\n", c->name, t.current.size / 1024, t.current.num,
+           (int)tried.size(), (int)expect.size(), spent, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    tune_case one = {"-rate", 0, 16 * 1024, false, 0};
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (!strcmp(arg, "-v")) {
+            verbose = true;
+        } else if (val == NULL) {
+            usage();
+            return 1;
+        } else if (!strcmp(arg, "-rate")) {
+            one.rate = atof(val);
+            i++;
+        } else if (!strcmp(arg, "-min")) {
+            one.min_size = atoi(val) * 1024;
+            i++;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    const tune_case *cases = default_cases;
+    int n = (int)(sizeof(default_cases) / sizeof(default_cases[0]));
+    if (one.rate > 0) {
+        cases = &one;
+        n = 1;
+    }
+    for (int i = 0; i < n; i++) {
+        run(&cases[i]);
+    }
+
+    if (failures > 0) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,614 @@
+//
+// Lossless archive of decoded frames
+//
+#include "vidfile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+static_assert(DW % 8 == 0, "A row must fill whole bytes of a plane");
+
+#define HUF_MAX_BITS 15
+#define HUF_TABLE_SIZE (256 / 2)    // Code lengths, 4 bits each
+
+//----------------------------------------------------------------------
+// Bit planes
+//----------------------------------------------------------------------
+// Bit k of 8 pixels gathered into one byte, pixel 0 in the MSB. Every bit
+// lands on its own position of the product, so there are no carries.
+static inline uint8_t gather_bits(uint64_t w, int k) {
+    return (uint8_t)((((w >> k) & 0x0101010101010101ULL) * 0x8040201008040201ULL) >> 56);
+}
+
+void vid_pack_planes(const uint8_t *pixels, uint8_t *planes) {
+    for (int i = 0; i < VID_PLANE_SIZE; i++) {
+        uint64_t w;
+        memcpy(&w, pixels + i * 8, 8);
+        planes[i] = gather_bits(w, BIT_R);
+        planes[VID_PLANE_SIZE + i] = gather_bits(w, BIT_G);
+        planes[VID_PLANE_SIZE * 2 + i] = gather_bits(w, BIT_B);
+    }
+}
+
+// Byte of a plane to 8 pixels of 0 / 1
+struct spread_table {
+    uint64_t bits[256];
+
+    spread_table() {
+        for (int b = 0; b < 256; b++) {
+            uint64_t w = 0;
+            for (int j = 0; j < 8; j++) {
+                w |= (uint64_t)((b >> (7 - j)) & 1) << (j * 8);
+            }
+            bits[b] = w;
+        }
+    }
+};
+
+static const spread_table spread;
+
+void vid_unpack_planes(const uint8_t *planes, uint8_t *pixels) {
+    for (int i = 0; i < VID_PLANE_SIZE; i++) {
+        uint64_t w = spread.bits[planes[i]] << BIT_R
+                   | spread.bits[planes[VID_PLANE_SIZE + i]] << BIT_G
+                   | spread.bits[planes[VID_PLANE_SIZE * 2 + i]] << BIT_B;
+        memcpy(pixels + i * 8, &w, 8);
+    }
+}
+
+//----------------------------------------------------------------------
+// Zero run tokens
+//----------------------------------------------------------------------
+static inline uint8_t *put_varint(uint8_t *q, size_t v) {
+    while (v >= 0x80) {
+        *q++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *q++ = (uint8_t)v;
+    return q;
+}
+
+static inline int get_varint(const uint8_t **pp, const uint8_t *end, size_t *v) {
+    const uint8_t *p = *pp;
+    size_t r = 0;
+
+    for (int shift = 0;; shift += 7) {
+        if (p == end || shift > 28) {
+            return -1;
+        }
+        uint8_t b = *p++;
+        r |= (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+    *v = r;
+    *pp = p;
+    return 0;
+}
+
+// Zero bytes from p, 8 at a time
+static inline size_t zero_run(const uint8_t *p, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        if (w != 0) {
+            break;
+        }
+    }
+    while (i < n && p[i] == 0) {
+        i++;
+    }
+    return i;
+}
+
+size_t vid_tokenize(const uint8_t *src, size_t n, uint8_t *dst) {
+    uint8_t *q = dst;
+    size_t i = 0;
+
+    while (i < n) {
+        size_t z = zero_run(src + i, n - i);
+        q = put_varint(q, z);
+        i += z;
+        if (i == n) {
+            break;
+        }
+
+        // Literals up to the next pair of zeros, a single zero is cheaper
+        // as a literal than as a run
+        size_t k = i + 1;
+        while (k < n && !(src[k] == 0 && (k + 1 == n || src[k + 1] == 0))) {
+            k++;
+        }
+        q = put_varint(q, k - i);
+        memcpy(q, src + i, k - i);
+        q += k - i;
+        i = k;
+    }
+    return q - dst;
+}
+
+int vid_detokenize(const uint8_t *src, size_t len, uint8_t *dst, size_t n) {
+    const uint8_t *p = src;
+    const uint8_t *end = src + len;
+    size_t i = 0;
+
+    while (i < n) {
+        size_t z, lit;
+        if (get_varint(&p, end, &z) < 0 || z > n - i) {
+            return -1;
+        }
+        memset(dst + i, 0, z);
+        i += z;
+        if (i == n) {
+            break;
+        }
+        if (get_varint(&p, end, &lit) < 0 || lit > n - i || lit > (size_t)(end - p)) {
+            return -1;
+        }
+        memcpy(dst + i, p, lit);
+        p += lit;
+        i += lit;
+    }
+    return (p == end) ? 0 : -1;
+}
+
+//----------------------------------------------------------------------
+// Canonical Huffman code
+//----------------------------------------------------------------------
+// Code lengths of the 256 byte values (0: unused), at most HUF_MAX_BITS
+static void huffman_lengths(const uint32_t count[256], uint8_t len[256]) {
+    uint32_t freq[256];
+    memcpy(freq, count, sizeof(freq));
+
+    for (;;) {
+        // Leaves sorted by frequency, then the two-queue merge
+        int sym[256], n = 0;
+        for (int i = 0; i < 256; i++) {
+            len[i] = 0;
+            if (freq[i] > 0) {
+                sym[n++] = i;
+            }
+        }
+        if (n == 0) {
+            return;
+        }
+        if (n == 1) {
+            len[sym[0]] = 1;
+            return;
+        }
+        std::sort(sym, sym + n, [&](int a, int b) { return freq[a] < freq[b]; });
+
+        uint64_t weight[512];
+        int parent[512];
+        for (int i = 0; i < n; i++) {
+            weight[i] = freq[sym[i]];
+        }
+        int leaf = 0, inner = n, nodes = n;
+        auto take = [&]() {
+            if (leaf < n && (inner == nodes || weight[leaf] <= weight[inner])) {
+                return leaf++;
+            }
+            return inner++;
+        };
+        while (nodes < 2 * n - 1) {
+            int a = take();
+            int b = take();
+            weight[nodes] = weight[a] + weight[b];
+            parent[a] = parent[b] = nodes;
+            nodes++;
+        }
+
+        // Depths from the root down (parents come after their children)
+        int depth[512];
+        int max_depth = 0;
+        depth[nodes - 1] = 0;
+        for (int i = nodes - 2; i >= 0; i--) {
+            depth[i] = depth[parent[i]] + 1;
+        }
+        for (int i = 0; i < n; i++) {
+            len[sym[i]] = (uint8_t)depth[i];
+            max_depth = std::max(max_depth, depth[i]);
+        }
+        if (max_depth <= HUF_MAX_BITS) {
+            return;
+        }
+        // Too deep, flatten the distribution and build again
+        for (int i = 0; i < 256; i++) {
+            if (freq[i] > 0) {
+                freq[i] = (freq[i] >> 1) | 1;
+            }
+        }
+    }
+}
+
+// Canonical codes from the lengths, in symbol order within a length
+static void huffman_codes(const uint8_t len[256], uint16_t code[256]) {
+    int bl_count[HUF_MAX_BITS + 1] = {0};
+    uint16_t next[HUF_MAX_BITS + 2];
+
+    for (int i = 0; i < 256; i++) {
+        bl_count[len[i]]++;
+    }
+    bl_count[0] = 0;
+    uint16_t c = 0;
+    for (int bits = 1; bits <= HUF_MAX_BITS; bits++) {
+        c = (uint16_t)((c + bl_count[bits - 1]) << 1);
+        next[bits] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        if (len[i] != 0) {
+            code[i] = next[len[i]]++;
+        }
+    }
+}
+
+size_t vid_huffman_encode(const uint8_t *src, size_t n, uint8_t *dst) {
+    uint32_t count[256] = {0};
+    uint8_t len[256];
+    uint16_t code[256];
+
+    for (size_t i = 0; i < n; i++) {
+        count[src[i]]++;
+    }
+    huffman_lengths(count, len);
+    huffman_codes(len, code);
+
+    uint64_t bits = 0;
+    for (int i = 0; i < 256; i++) {
+        bits += (uint64_t)count[i] * len[i];
+    }
+    size_t size = HUF_TABLE_SIZE + (size_t)((bits + 7) / 8);
+    if (size >= n) {
+        return 0;
+    }
+
+    for (int i = 0; i < HUF_TABLE_SIZE; i++) {
+        dst[i] = (uint8_t)(len[i * 2] << 4 | len[i * 2 + 1]);
+    }
+
+    // MSB first
+    uint8_t *q = dst + HUF_TABLE_SIZE;
+    uint64_t acc = 0;
+    int fill = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint8_t s = src[i];
+        acc = acc << len[s] | code[s];
+        fill += len[s];
+        while (fill >= 8) {
+            fill -= 8;
+            *q++ = (uint8_t)(acc >> fill);
+        }
+    }
+    if (fill > 0) {
+        *q++ = (uint8_t)(acc << (8 - fill));
+    }
+    return q - dst;
+}
+
+int vid_huffman_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t n) {
+    if (len < HUF_TABLE_SIZE) {
+        return -1;
+    }
+    uint8_t lens[256];
+    uint16_t code[256];
+    for (int i = 0; i < HUF_TABLE_SIZE; i++) {
+        lens[i * 2] = src[i] >> 4;
+        lens[i * 2 + 1] = src[i] & 15;
+    }
+    huffman_codes(lens, code);
+
+    // (symbol << 4 | length) for every HUF_MAX_BITS bits prefix, 0: invalid
+    static thread_local uint16_t table[1 << HUF_MAX_BITS];
+    memset(table, 0, sizeof(table));
+    for (int s = 0; s < 256; s++) {
+        int l = lens[s];
+        if (l == 0) {
+            continue;
+        }
+        uint32_t first = (uint32_t)code[s] << (HUF_MAX_BITS - l);
+        uint32_t last = first + (1u << (HUF_MAX_BITS - l));
+        if (last > (1u << HUF_MAX_BITS)) {
+            return -1;  // Lengths of no valid code
+        }
+        for (uint32_t k = first; k < last; k++) {
+            table[k] = (uint16_t)(s << 4 | l);
+        }
+    }
+
+    const uint8_t *p = src + HUF_TABLE_SIZE;
+    const uint8_t *end = src + len;
+    uint64_t acc = 0;
+    int fill = 0;
+    for (size_t i = 0; i < n; i++) {
+        while (fill <= 56) {
+            acc |= (uint64_t)(p < end ? *p : 0) << (56 - fill);
+            p++;
+            fill += 8;
+        }
+        uint16_t e = table[acc >> (64 - HUF_MAX_BITS)];
+        if (e == 0) {
+            return -1;
+        }
+        dst[i] = (uint8_t)(e >> 4);
+        acc <<= e & 15;
+        fill -= e & 15;
+    }
+    // The bits used must have come from the code
+    return (p - end) * 8 - fill <= 0 ? 0 : -1;
+}
+
+//----------------------------------------------------------------------
+// Writing
+//----------------------------------------------------------------------
+vidfile_writer::vidfile_writer() : fp(NULL), count(0), file_pos(0) {}
+
+int vidfile_writer::open(const char *path, int keyint, int fps_num, int fps_den, const uint32_t rgb[PALETTE_SIZE]) {
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Archive: Could not create %s\n", path);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VIDFILE_MAGIC, sizeof(header.magic));
+    header.header_size = sizeof(header);
+    header.version = VIDFILE_VERSION;
+    header.width = DW;
+    header.height = DH;
+    header.planes = VID_PLANES;
+    header.keyint = (uint16_t)((keyint > 0 && keyint <= 0xffff) ? keyint : VID_KEYINT);
+    header.fps_num = fps_num;
+    header.fps_den = fps_den;
+    memcpy(header.palette, rgb, sizeof(header.palette));
+
+    planes.resize(VID_FRAME_SIZE);
+    prev.assign(VID_FRAME_SIZE, 0);
+    delta.resize(VID_FRAME_SIZE);
+    tokens.resize(VID_TOKENS_MAX(VID_FRAME_SIZE));
+    packed.resize(sizeof(vidfile_frame_header) + VID_TOKENS_MAX(VID_FRAME_SIZE));
+    keys.clear();
+    count = 0;
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        close();
+        return -1;
+    }
+    file_pos = sizeof(header);
+    return 0;
+}
+
+int vidfile_writer::write(const uint8_t *pixels, uint64_t seq) {
+    if (fp == NULL) {
+        return -1;
+    }
+
+    vid_pack_planes(pixels, planes.data());
+    bool key = (count % header.keyint) == 0;
+    if (key) {
+        memcpy(delta.data(), planes.data(), VID_FRAME_SIZE);
+    } else {
+        for (int i = 0; i < VID_FRAME_SIZE; i += 8) {
+            uint64_t a, b;
+            memcpy(&a, &planes[i], 8);
+            memcpy(&b, &prev[i], 8);
+            a ^= b;
+            memcpy(&delta[i], &a, 8);
+        }
+    }
+    prev.swap(planes);
+
+    vidfile_frame_header fh;
+    fh.tokens = (uint32_t)vid_tokenize(delta.data(), VID_FRAME_SIZE, tokens.data());
+    fh.type = key ? VID_KEY : VID_DELTA;
+    fh.reserved = 0;
+    fh.seq = (uint32_t)seq;
+
+    uint8_t *payload = packed.data() + sizeof(fh);
+    size_t size = vid_huffman_encode(tokens.data(), fh.tokens, payload);
+    if (size > 0) {
+        fh.coding = VID_HUFFMAN;
+    } else {
+        fh.coding = VID_STORED;
+        memcpy(payload, tokens.data(), fh.tokens);
+        size = fh.tokens;
+    }
+    fh.size = (uint32_t)size;
+    memcpy(packed.data(), &fh, sizeof(fh));
+
+    size += sizeof(fh);
+    if (fwrite(packed.data(), 1, size, fp) != size) {
+        fprintf(stderr, "Archive: Write failed, archiving stopped\n");
+        close();
+        return -1;
+    }
+    if (key) {
+        keys.push_back(vidfile_key{count, file_pos});
+    }
+    file_pos += size;
+    count++;
+    return 0;
+}
+
+void vidfile_writer::close(void) {
+    if (fp == NULL) {
+        return;
+    }
+
+    vidfile_trailer tr;
+    tr.index_offset = file_pos;
+    tr.keys = (uint32_t)keys.size();
+    tr.frames = (uint32_t)count;
+    memcpy(tr.magic, VIDFILE_INDEX_MAGIC, sizeof(tr.magic));
+    if (!keys.empty()) {
+        fwrite(keys.data(), sizeof(keys[0]), keys.size(), fp);
+    }
+    fwrite(&tr, sizeof(tr), 1, fp);
+    fclose(fp);
+    fp = NULL;
+}
+
+//----------------------------------------------------------------------
+// Reading
+//----------------------------------------------------------------------
+vidfile_reader::vidfile_reader() : top(0), count(0), next_frame(0), next_offset(0), last_seq(0) {}
+
+int vidfile_reader::open(const char *path, vidfile_header *hdr) {
+    if (file.open(path) < 0) {
+        fprintf(stderr, "Archive: Could not open %s\n", path);
+        return -1;
+    }
+    if (file.size() < sizeof(*hdr) || memcmp(file.data(), VIDFILE_MAGIC, sizeof(hdr->magic)) != 0) {
+        fprintf(stderr, "Archive: %s is not an archive\n", path);
+        close();
+        return -1;
+    }
+    memcpy(hdr, file.data(), sizeof(*hdr));
+    if (hdr->header_size < sizeof(*hdr) || hdr->header_size > file.size()
+        || hdr->width != DW || hdr->height != DH || hdr->planes != VID_PLANES) {
+        fprintf(stderr, "Archive: %s has an unknown layout\n", path);
+        close();
+        return -1;
+    }
+    top = hdr->header_size;
+
+    if (load_index() < 0) {
+        fprintf(stderr, "Archive: %s has no index, scanning the frames\n", path);
+        rebuild_index();
+    }
+
+    planes.assign(VID_FRAME_SIZE, 0);
+    delta.resize(VID_FRAME_SIZE);
+    tokens.resize(VID_TOKENS_MAX(VID_FRAME_SIZE));
+    next_frame = 0;
+    next_offset = top;
+    return 0;
+}
+
+void vidfile_reader::close(void) {
+    file.close();
+    keys.clear();
+    count = 0;
+}
+
+int vidfile_reader::load_index(void) {
+    const uint8_t *data = file.data();
+    size_t size = file.size();
+    vidfile_trailer tr;
+
+    if (size < top + sizeof(tr)) {
+        return -1;
+    }
+    memcpy(&tr, data + size - sizeof(tr), sizeof(tr));
+    uint64_t index_size = (uint64_t)tr.keys * sizeof(vidfile_key);
+    if (memcmp(tr.magic, VIDFILE_INDEX_MAGIC, sizeof(tr.magic)) != 0
+        || tr.index_offset < top || tr.index_offset + index_size + sizeof(tr) != size) {
+        return -1;
+    }
+    keys.resize(tr.keys);
+    if (tr.keys > 0) {
+        memcpy(keys.data(), data + tr.index_offset, index_size);
+    }
+    count = tr.frames;
+    return 0;
+}
+
+// Walk the frame records up to the first broken one
+void vidfile_reader::rebuild_index(void) {
+    const uint8_t *data = file.data();
+    size_t size = file.size();
+
+    keys.clear();
+    count = 0;
+    for (size_t pos = top; pos + sizeof(vidfile_frame_header) <= size;) {
+        vidfile_frame_header fh;
+        memcpy(&fh, data + pos, sizeof(fh));
+        if (fh.size > size - pos - sizeof(fh) || fh.type > VID_DELTA || fh.coding > VID_HUFFMAN
+            || (count == 0 && fh.type != VID_KEY)) {
+            break;
+        }
+        if (fh.type == VID_KEY) {
+            keys.push_back(vidfile_key{count, pos});
+        }
+        count++;
+        pos += sizeof(fh) + fh.size;
+    }
+}
+
+int vidfile_reader::decode_next(void) {
+    const uint8_t *data = file.data();
+    size_t size = file.size();
+    vidfile_frame_header fh;
+
+    if (next_offset + sizeof(fh) > size) {
+        return -1;
+    }
+    memcpy(&fh, data + next_offset, sizeof(fh));
+    const uint8_t *payload = data + next_offset + sizeof(fh);
+    if (fh.size > size - next_offset - sizeof(fh) || fh.tokens > tokens.size()) {
+        return -1;
+    }
+
+    if (fh.coding == VID_HUFFMAN) {
+        if (vid_huffman_decode(payload, fh.size, tokens.data(), fh.tokens) < 0) {
+            return -1;
+        }
+    } else if (fh.coding == VID_STORED && fh.size == fh.tokens) {
+        memcpy(tokens.data(), payload, fh.tokens);
+    } else {
+        return -1;
+    }
+    if (vid_detokenize(tokens.data(), fh.tokens, delta.data(), VID_FRAME_SIZE) < 0) {
+        return -1;
+    }
+
+    if (fh.type == VID_KEY) {
+        planes.swap(delta);
+    } else {
+        for (int i = 0; i < VID_FRAME_SIZE; i += 8) {
+            uint64_t a, b;
+            memcpy(&a, &planes[i], 8);
+            memcpy(&b, &delta[i], 8);
+            a ^= b;
+            memcpy(&planes[i], &a, 8);
+        }
+    }
+    last_seq = fh.seq;
+    next_frame++;
+    next_offset += sizeof(fh) + fh.size;
+    return 0;
+}
+
+int vidfile_reader::read_frame(uint64_t n, uint8_t *pixels, uint32_t *seq) {
+    if (n >= count) {
+        return -1;
+    }
+
+    // Start over from the keyframe unless the frame follows the decoded ones
+    auto it = std::upper_bound(keys.begin(), keys.end(), n,
+                               [](uint64_t f, const vidfile_key &k) { return f < k.frame; });
+    if (it == keys.begin()) {
+        return -1;
+    }
+    --it;
+    if (n < next_frame || next_frame == 0 || it->frame >= next_frame) {
+        next_frame = it->frame;
+        next_offset = it->file_offset;
+    }
+
+    while (next_frame <= n) {
+        if (decode_next() < 0) {
+            fprintf(stderr, "Archive: Frame %llu is broken\n", (unsigned long long)next_frame);
+            next_frame = 0;
+            return -1;
+        }
+    }
+    vid_unpack_planes(planes.data(), pixels);
+    if (seq != NULL) {
+        *seq = last_seq;
+    }
+    return 0;
+}
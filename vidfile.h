@@ -0,0 +1,170 @@
+//
+// Lossless archive of decoded frames
+//
+// A vidfile_header, one record per frame, a keyframe index and a trailer.
+// Each frame is coded as:
+//   1. 3 bit planes (R, G, B) of DW x DH bits, the first pixel in the MSB
+//   2. XOR with the planes of the previous frame (not for keyframes)
+//   3. zero runs and literal bytes as tokens:
+//        varint zeros, varint n, n literal bytes, varint zeros, ...
+//      (LEB128, the last literal count may be left out)
+//   4. canonical Huffman code of the token bytes, or the tokens as they
+//      are when that is not smaller
+// A frame is decoded from the keyframe at or before it, which the index
+// points to. A file without the index is indexed again by walking the
+// records.
+//
+#ifndef VIDFILE_H
+#define VIDFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "capfile.h"
+#include "decoder.h"
+#include "palette.h"
+
+#define VIDFILE_MAGIC "DRGBVID1"
+#define VIDFILE_VERSION 1
+#define VIDFILE_INDEX_MAGIC "DRGBVIX1"
+
+#define VID_PLANES 3
+#define VID_PLANE_SIZE (DW * DH / 8)
+#define VID_FRAME_SIZE (VID_PLANE_SIZE * VID_PLANES)
+
+#define VID_KEYINT 300      // Frames between keyframes by default (5 s)
+
+// All fields are little endian
+struct vidfile_header {
+    char magic[8];            // VIDFILE_MAGIC
+    uint32_t header_size;     // sizeof(vidfile_header), the frames follow
+    uint32_t version;
+    uint16_t width, height;   // DW, DH
+    uint16_t planes;          // VID_PLANES
+    uint16_t keyint;
+    uint32_t fps_num, fps_den;
+    uint32_t palette[PALETTE_SIZE];   // 0xRRGGBB of the indices
+};
+
+static_assert(sizeof(vidfile_header) == 64, "vidfile_header must be 64 bytes");
+
+// Frame types / codings
+enum { VID_KEY, VID_DELTA };
+enum { VID_STORED, VID_HUFFMAN };
+
+struct vidfile_frame_header {
+    uint32_t size;            // Bytes following this header
+    uint32_t tokens;          // Size of the token stream
+    uint8_t type;
+    uint8_t coding;
+    uint16_t reserved;
+    uint32_t seq;             // Source frame number (lower 32 bits)
+};
+
+// Index: keys x vidfile_key, then the trailer at the very end of the file
+struct vidfile_key {
+    uint64_t frame;           // Frame number in the file (0, 1, ...)
+    uint64_t file_offset;     // vidfile_frame_header
+};
+
+struct vidfile_trailer {
+    uint64_t index_offset;
+    uint32_t keys;
+    uint32_t frames;
+    char magic[8];            // VIDFILE_INDEX_MAGIC
+};
+
+static_assert(sizeof(vidfile_frame_header) == 16, "vidfile_frame_header must be 16 bytes");
+static_assert(sizeof(vidfile_key) == 16, "vidfile_key must be 16 bytes");
+static_assert(sizeof(vidfile_trailer) == 24, "vidfile_trailer must be 24 bytes");
+
+//----------------------------------------------------------------------
+// Codec
+//----------------------------------------------------------------------
+// DW x DH palette indices to / from VID_PLANES bit planes
+void vid_pack_planes(const uint8_t *pixels, uint8_t *planes);
+void vid_unpack_planes(const uint8_t *planes, uint8_t *pixels);
+
+// Token stream of n bytes (VID_TOKENS_MAX(n) at most). Returns its size.
+#define VID_TOKENS_MAX(n) ((n) + (n) / 64 + 16)
+size_t vid_tokenize(const uint8_t *src, size_t n, uint8_t *dst);
+
+// Tokens to n bytes. Returns 0 on success, -1 if the tokens are corrupt.
+int vid_detokenize(const uint8_t *src, size_t len, uint8_t *dst, size_t n);
+
+// Huffman code of n bytes into dst (n bytes). Returns the coded size, or
+// 0 if the code would not be smaller than n.
+size_t vid_huffman_encode(const uint8_t *src, size_t n, uint8_t *dst);
+
+// Returns 0 on success, -1 if the code is corrupt
+int vid_huffman_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t n);
+
+//----------------------------------------------------------------------
+// Writing
+//----------------------------------------------------------------------
+// Real time is a few hundred microseconds per frame at most
+class vidfile_writer {
+public:
+    vidfile_writer();
+    ~vidfile_writer() { close(); }
+
+    // keyint: frames between keyframes, fps: source frame rate
+    int open(const char *path, int keyint, int fps_num, int fps_den, const uint32_t rgb[PALETTE_SIZE]);
+
+    // Frame seq (source frame number) of DW x DH palette indices
+    int write(const uint8_t *pixels, uint64_t seq);
+
+    // Writes the index
+    void close(void);
+
+    uint64_t frames(void) const { return count; }
+    uint64_t bytes(void) const { return file_pos; }
+
+private:
+    FILE *fp;
+    vidfile_header header;
+    uint64_t count;
+    uint64_t file_pos;
+    std::vector<uint8_t> planes, prev, delta, tokens, packed;
+    std::vector<vidfile_key> keys;
+};
+
+//----------------------------------------------------------------------
+// Reading
+//----------------------------------------------------------------------
+class vidfile_reader {
+public:
+    vidfile_reader();
+
+    int open(const char *path, vidfile_header *hdr);
+    void close(void);
+
+    uint64_t frame_count(void) const { return count; }
+
+    // Decode frame n (0, 1, ...) into DW x DH palette indices. The next
+    // frame is decoded from the last one, any other from its keyframe.
+    // seq (may be NULL) gets the source frame number.
+    // Returns 0 on success, -1 on error.
+    int read_frame(uint64_t n, uint8_t *pixels, uint32_t *seq);
+
+private:
+    int load_index(void);
+    void rebuild_index(void);
+    int decode_next(void);
+
+    mapped_file file;
+    size_t top;               // First frame
+    uint64_t count;
+    std::vector<vidfile_key> keys;
+
+    // Position of the frame after the last decoded one
+    uint64_t next_frame;
+    uint64_t next_offset;
+    uint32_t last_seq;
+    std::vector<uint8_t> planes, tokens, delta;
+};
+
+#endif
@@ -0,0 +1,124 @@
+//
+// USB transfer size / queue depth tuning
+//
+#include "xfertune.h"
+
+#include <string.h>
+
+// Candidates in order of latency, then of memory
+static const int tune_sizes[] = {4 * 1024, 8 * 1024, 16 * 1024, 32 * 1024, 64 * 1024, 128 * 1024, 256 * 1024};
+static const int tune_nums[] = {4, 8, 16, 32, 64};
+
+#define TUNE_SIZES ((int)(sizeof(tune_sizes) / sizeof(tune_sizes[0])))
+#define TUNE_NUMS ((int)(sizeof(tune_nums) / sizeof(tune_nums[0])))
+
+// The queue must hold at least this much of the stream, a shorter one is
+// lost on the first scheduling hiccup (Windows timer tick: 15.6 ms) even
+// if a short trial happens to pass
+#define TUNE_HEADROOM_MS 16.0
+
+double xfer_latency_ms(const xfer_setting *s, double bytes_per_sec) {
+    return (bytes_per_sec > 0) ? s->size * 1000.0 / bytes_per_sec : 0;
+}
+
+static xfer_setting candidate(int i) {
+    xfer_setting s;
+    s.size = tune_sizes[i / TUNE_NUMS];
+    s.num = tune_nums[i % TUNE_NUMS];
+    return s;
+}
+
+// First usable candidate from i on, -1 if there is none
+static int next_candidate(const xfer_tuner *t, int i) {
+    for (; i < TUNE_SIZES * TUNE_NUMS; i++) {
+        xfer_setting s = candidate(i);
+        // The ring can only use (num - 2) blocks safely
+        if ((s.num - 2) * xfer_latency_ms(&s, t->rate) >= TUNE_HEADROOM_MS) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The setting has changed, the counters are taken again after settling
+static void begin(xfer_tuner *t, uint64_t now_us, uint64_t bytes) {
+    t->settled = 0;
+    t->since_us = now_us;
+    t->bytes = bytes;
+}
+
+void xfer_tuner_init(xfer_tuner *t, const xfer_setting *start) {
+    memset(t, 0, sizeof(*t));
+    t->phase = TUNE_RATE;
+    t->start = *start;
+    t->current = *start;
+    t->candidate = -1;
+    t->since_us = UINT64_MAX;   // The start settles from the first step on
+}
+
+int xfer_tuner_step(xfer_tuner *t, uint64_t now_us, uint64_t bytes, uint64_t overruns, uint64_t sync_lost) {
+    if (t->phase == TUNE_DONE) {
+        return 0;
+    }
+    if (t->since_us == UINT64_MAX) {
+        begin(t, now_us, bytes);
+        return 0;
+    }
+    if (!t->settled) {
+        // Settled once the stream has flowed for a whole period, so that a
+        // measurement never starts before the signal does
+        if (bytes == t->bytes) {
+            t->since_us = now_us;
+        } else if (now_us - t->since_us >= TUNE_SETTLE_US) {
+            t->settled = 1;
+            t->since_us = now_us;
+            t->bytes = bytes;
+            t->overruns = overruns;
+            t->sync_lost = sync_lost;
+        }
+        return 0;
+    }
+
+    uint64_t elapsed = now_us - t->since_us;
+    double rate = (elapsed > 0) ? (bytes - t->bytes) * 1e6 / elapsed : 0;
+
+    if (t->phase == TUNE_RATE) {
+        if (elapsed < TUNE_RATE_US) {
+            return 0;
+        }
+        if (rate <= 0) {
+            // The signal has gone, settle again
+            begin(t, now_us, bytes);
+            return 0;
+        }
+        t->rate = rate;
+        t->candidate = next_candidate(t, 0);
+        if (t->candidate < 0) {
+            t->phase = TUNE_DONE;
+            return 0;
+        }
+        t->phase = TUNE_TRIAL;
+        t->current = candidate(t->candidate);
+        begin(t, now_us, bytes);
+        return 1;
+    }
+
+    // TUNE_TRIAL
+    if (elapsed < TUNE_TRIAL_US) {
+        return 0;
+    }
+    if (overruns == t->overruns && sync_lost == t->sync_lost && rate >= t->rate * TUNE_RATE_MIN) {
+        t->phase = TUNE_DONE;
+        return 0;
+    }
+    t->candidate = next_candidate(t, t->candidate + 1);
+    if (t->candidate < 0) {
+        // Nothing has passed, back to where we started
+        t->phase = TUNE_DONE;
+        t->current = t->start;
+        return 1;
+    }
+    t->current = candidate(t->candidate);
+    begin(t, now_us, bytes);
+    return 1;
+}
@@ -0,0 +1,66 @@
+//
+// USB transfer size / queue depth tuning
+//
+// Every queued transfer is one block of the receive ring. A sample waits
+// until its whole transfer is filled, so the transfer size sets the
+// latency before the decoder sees it (size / byte rate), and the queue
+// depth sets how long the decoder may stall before blocks are lost.
+// Small transfers cost more CPU per byte, and below some size the USB
+// thread cannot requeue them fast enough.
+//
+// The tuner measures the byte rate with the starting setting, then tries
+// the settings in order of latency (smallest transfer first, the shallow
+// queues first) for a trial period each. The first one which keeps the
+// rate without overruns or sync loss is taken. Every step settles first
+// (TUNE_SETTLE_US of a flowing stream), the restart is not held against it.
+//
+#ifndef XFERTUNE_H
+#define XFERTUNE_H
+
+#include <stdint.h>
+
+#define XFER_SIZE_MIN (4 * 1024)
+#define XFER_SIZE_MAX (1024 * 1024)
+#define XFER_NUM_MIN 4            // spsc_ring needs 3, one more to overlap
+#define XFER_NUM_MAX 64
+
+struct xfer_setting {
+    int size;     // Bytes per transfer (multiple of 512)
+    int num;      // Transfers in flight (ring blocks)
+};
+
+// Latency added by filling one transfer at bytes_per_sec [ms]
+double xfer_latency_ms(const xfer_setting *s, double bytes_per_sec);
+
+// Tuner phases
+enum {
+    TUNE_RATE,        // Measure the byte rate with the starting setting
+    TUNE_TRIAL,       // Run a candidate
+    TUNE_DONE,
+};
+
+#define TUNE_SETTLE_US 300000     // Ignored after every change (restart, resync)
+#define TUNE_RATE_US 1000000      // Rate measurement
+#define TUNE_TRIAL_US 2000000     // Trial of a candidate
+#define TUNE_RATE_MIN 0.97        // A trial must keep this share of the rate
+
+struct xfer_tuner {
+    int phase;
+    xfer_setting start;       // Setting before tuning, the fallback
+    xfer_setting current;     // Setting to be used now
+    int candidate;            // Index of the candidate on trial
+    double rate;              // Measured byte rate [bytes/s]
+
+    // Counters at the beginning of the measurement (after settling)
+    int settled;
+    uint64_t since_us;
+    uint64_t bytes, overruns, sync_lost;
+};
+
+void xfer_tuner_init(xfer_tuner *t, const xfer_setting *start);
+
+// Feed the running totals of the stream. Returns 1 when t->current has
+// changed and the transfers have to be set up again with it.
+int xfer_tuner_step(xfer_tuner *t, uint64_t now_us, uint64_t bytes, uint64_t overruns, uint64_t sync_lost);
+
+#endif